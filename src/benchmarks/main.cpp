@@ -0,0 +1,16 @@
+#include <benchmark/benchmark.h>
+
+#include "logger/logger.h"
+
+int main( int argc, char** argv )
+{
+  ::benchmark::Initialize( &argc, argv );
+  if ( ::benchmark::ReportUnrecognizedArguments( argc, argv ) )
+    return 1;
+
+  vector_db::logger_factory::initialize();
+
+  ::benchmark::RunSpecifiedBenchmarks();
+  ::benchmark::Shutdown();
+  return 0;
+}
@@ -0,0 +1,111 @@
+//
+// Search latency benchmarks, parameterised by the prefetch distance the searches use.
+//
+#include <benchmark/benchmark.h>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "core/collection.h"
+#include "core/indices/hnsw.h"
+#include "core/indices/ivfflat.h"
+#include "core/indices/ivfpq.h"
+
+namespace vector_db::bench
+{
+
+namespace
+{
+constexpr std::size_t dimension = 128;
+constexpr std::size_t no_of_vectors = 200000;  // ~100MB of rows, well past L2: at 20000 the prefetch made no difference
+constexpr std::size_t no_of_queries = 256;
+constexpr unsigned int top_k = 10;
+
+std::vector< float > random_rows( std::size_t count, std::mt19937& rng )
+{
+  std::uniform_real_distribution< float > dist( -1.0f, 1.0f );
+  std::vector< float > rows( count * dimension );
+  for ( auto& value : rows )
+    value = dist( rng );
+  return rows;
+}
+
+// one collection shared by every benchmark, large enough that the rows don't fit in cache
+std::shared_ptr< collection > shared_collection()
+{
+  static const auto col = []
+  {
+    std::mt19937 rng( 42 );
+    const auto rows = random_rows( no_of_vectors, rng );
+    auto _col = std::make_shared< collection >( dimension, "bench" );
+    std::vector< std::pair< id_t, float_vector > > vectors;
+    vectors.reserve( no_of_vectors );
+    for ( std::size_t i = 0; i < no_of_vectors; ++i )
+      vectors.emplace_back( i, float_vector( dimension, rows.data() + i * dimension ) );
+    _col->add_vectors( std::move( vectors ) );
+    return _col;
+  }();
+  return col;
+}
+
+const std::vector< float_vector >& queries()
+{
+  static const auto _queries = []
+  {
+    std::mt19937 rng( 7 );
+    const auto rows = random_rows( no_of_queries, rng );
+    std::vector< float_vector > _q;
+    for ( std::size_t i = 0; i < no_of_queries; ++i )
+      _q.emplace_back( dimension, rows.data() + i * dimension );
+    return _q;
+  }();
+  return _queries;
+}
+
+// built once and reused across repetitions; every prefetch distance searches the same index, HNSW levels
+// being random
+template < typename idx_t, typename idx_params_t >
+idx_t& cached_index()
+{
+  static const std::unique_ptr< idx_t > built = []
+  {
+    auto idx = std::make_unique< idx_t >( shared_collection(), idx_params_t() );
+    idx->init();
+    return idx;
+  }();
+  return *built;
+}
+
+template < typename idx_t, typename idx_params_t >
+void run_search( benchmark::State& state )
+{
+  auto& idx = cached_index< idx_t, idx_params_t >();
+  search_params_t search_params;
+  search_params.prefetch_distance_ = static_cast< unsigned int >( state.range( 0 ) );
+  const auto& _queries = queries();
+  std::vector< score_pair > results;
+  std::size_t i = 0;
+  for ( auto _ : state )
+  {
+    idx.search_for_top_k( _queries[ i++ % _queries.size() ], top_k, results, search_params );
+    benchmark::DoNotOptimize( results.data() );
+  }
+  state.SetItemsProcessed( static_cast< int64_t >( state.iterations() ) );
+}
+}  // namespace
+
+void BM_HNSWSearch( benchmark::State& state ) { run_search< indices::hnsw::index, indices::hnsw::params >( state ); }
+
+void BM_IVFFlatSearch( benchmark::State& state )
+{
+  run_search< indices::ivf_flat::index, indices::ivf_flat::params >( state );
+}
+
+void BM_IVFPQSearch( benchmark::State& state ) { run_search< indices::ivf_pq::index, indices::ivf_pq::params >( state ); }
+
+// 0 disables prefetching and is the baseline the other distances are compared against
+BENCHMARK( BM_HNSWSearch )->Arg( 0 )->Arg( 1 )->Arg( 2 )->Arg( 4 )->Arg( 8 );
+BENCHMARK( BM_IVFFlatSearch )->Arg( 0 )->Arg( 1 )->Arg( 2 )->Arg( 4 )->Arg( 8 );
+BENCHMARK( BM_IVFPQSearch )->Arg( 0 )->Arg( 1 )->Arg( 2 )->Arg( 4 )->Arg( 8 );
+
+}  // namespace vector_db::bench
@@ -7,6 +7,7 @@
 #include "core/collection.h"
 #include "core/indices/euclidean.h"
 #include "core/indices/ivfflat.h"
+#include "core/indices/ivfpq.h"
 #include "core/utils/util.h"
 
 namespace vector_db
@@ -120,6 +121,19 @@ bool collection::add_index( const std::string& name, index_type _index_type, par
         indices_.emplace( name, std::move( _index ) );
         return true;
       }
+      case index_type::ivf_pq:
+      {
+        auto ivf_pq_params = dynamic_cast< indices::ivf_pq::params* >( params );
+        if ( !ivf_pq_params )
+        {
+          logger_->error( "Invalid params type for IVF-PQ index" );
+          return false;
+        }
+        auto _index = std::make_unique< indices::ivf_pq::index >( weak_from_this(), *ivf_pq_params );
+        _index->init();
+        indices_.emplace( name, std::move( _index ) );
+        return true;
+      }
       default:
         return false;
     }
@@ -147,21 +161,65 @@ std::unordered_set< id_t, hash > collection::get_all_vector_ids() const
   return _ids;
 }
 
+size_t collection::size() const
+{
+  std::shared_lock lock( vec_mutex_ );
+  return vectors_.size();
+}
+
+search_params_t collection::bind_filter( const search_params_t& search_params ) const
+{
+  // the vectors can be read directly, they can't change while the caller holds vec_mutex_
+  auto _search_params = search_params;
+  if ( _search_params.filter_ && !_search_params.accepts_ )
+  {
+    _search_params.accepts_ = [ this, &filter = *search_params.filter_ ]( const id_t _id )
+    {
+      const auto vec_it = vectors_.find( _id );
+      return vec_it != vectors_.end() && filter.matches( vec_it->second->metadata_.get() );
+    };
+  }
+  return _search_params;
+}
+
 bool collection::search_for_top_k( const float_vector& query_vector,
                                    const unsigned int k,
                                    std::vector< score_pair >& results,
-                                   const std::string& index_name )
+                                   const std::string& index_name,
+                                   const search_params_t& search_params )
 {
   std::shared_lock< std::shared_mutex > lock( idx_mutex_ );
   std::shared_lock< std::shared_mutex > lock2( vec_mutex_ );
+
+  const auto _search_params = bind_filter( search_params );
   const auto it = indices_.find( index_name );
   if ( it == indices_.end() )
   {
     indices::euclidean::index _idx( weak_from_this() );
-    return _idx.search_for_top_k( query_vector, k, results );
+    return _idx.search_for_top_k( query_vector, k, results, _search_params );
   }
 
-  return it->second->search_for_top_k( query_vector, k, results );
+  return it->second->search_for_top_k( query_vector, k, results, _search_params );
+}
+
+bool collection::search_for_top_k_batch( const std::vector< float_vector >& queries,
+                                         const unsigned int k,
+                                         std::vector< std::vector< score_pair > >& results,
+                                         const std::string& index_name,
+                                         const search_params_t& search_params )
+{
+  std::shared_lock< std::shared_mutex > lock( idx_mutex_ );
+  std::shared_lock< std::shared_mutex > lock2( vec_mutex_ );
+
+  const auto _search_params = bind_filter( search_params );
+  const auto it = indices_.find( index_name );
+  if ( it == indices_.end() )
+  {
+    indices::euclidean::index _idx( weak_from_this() );
+    return _idx.search_for_top_k_batch( queries, k, results, _search_params );
+  }
+
+  return it->second->search_for_top_k_batch( queries, k, results, _search_params );
 }
 
 std::pair< index_type, const params_t* > collection::get_index_params( const std::string& index_name ) const
@@ -173,6 +231,25 @@ std::pair< index_type, const params_t* > collection::get_index_params( const std
   return { it->second->get_index_type(), it->second->get_params() };
 }
 
+bool collection::retrain_index( const std::string& index_name )
+{
+  std::shared_lock< std::shared_mutex > lock( idx_mutex_ );
+  const auto it = indices_.find( index_name );
+  if ( it == indices_.end() )
+    return false;
+  it->second->retrain();
+  return true;
+}
+
+std::pair< index_type, std::unique_ptr< stats_t > > collection::get_index_stats( const std::string& index_name ) const
+{
+  std::shared_lock< std::shared_mutex > lock( idx_mutex_ );
+  const auto it = indices_.find( index_name );
+  if ( it == indices_.end() )
+    return { index_type::unknown, nullptr };
+  return { it->second->get_index_type(), it->second->get_stats() };
+}
+
 void collection::serialize( std::ostream& os ) const
 {
   std::shared_lock vec_lock( vec_mutex_ );
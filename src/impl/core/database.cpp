@@ -88,7 +88,9 @@ status database::delete_collection( const std::string& collection_name )
 
 result< std::vector< score_pair > > database::get_nearest_k( const std::string& collection_name,
                                                              const float_vector& query,
-                                                             const unsigned int k )
+                                                             const unsigned int k,
+                                                             const std::string& index_name,
+                                                             const search_params_t& search_params )
 {
   if ( const auto _status = is_collection_name_valid( collection_name ); _status != status::success )
     return { _status };
@@ -96,11 +98,32 @@ result< std::vector< score_pair > > database::get_nearest_k( const std::string&
   const auto it = collections_.find( collection_name );
   if ( it == collections_.end() )
     return { status::collection_does_not_exist };
+  if ( !index_name.empty() && !it->second->get_index_params( index_name ).second )
+    return { status::index_does_not_exist };
   std::vector< score_pair > search_result;
-  it->second->search_for_top_k( query, k, search_result );
+  it->second->search_for_top_k( query, k, search_result, index_name, search_params );
   return { status::success, std::move( search_result ) };
 }
 
+result< std::vector< std::vector< score_pair > > > database::get_nearest_k_batch( const std::string& collection_name,
+                                                                                  const std::vector< float_vector >& queries,
+                                                                                  const unsigned int k,
+                                                                                  const std::string& index_name,
+                                                                                  const search_params_t& search_params )
+{
+  if ( const auto _status = is_collection_name_valid( collection_name ); _status != status::success )
+    return { _status };
+  std::shared_lock< std::shared_mutex > lock( mutex_ );
+  const auto it = collections_.find( collection_name );
+  if ( it == collections_.end() )
+    return { status::collection_does_not_exist };
+  if ( !index_name.empty() && !it->second->get_index_params( index_name ).second )
+    return { status::index_does_not_exist };
+  std::vector< std::vector< score_pair > > search_results;
+  it->second->search_for_top_k_batch( queries, k, search_results, index_name, search_params );
+  return { status::success, std::move( search_results ) };
+}
+
 status database::delete_vectors( const std::string& collection_name, const std::vector< id_t >& _ids )
 {
   if ( const auto _status = is_collection_name_valid( collection_name ); _status != status::success )
@@ -145,6 +168,31 @@ result< std::pair< index_type, const params_t* > > database::get_index_params( c
                             : result< std::pair< index_type, const params_t* > >( status::index_does_not_exist );
 }
 
+status database::retrain_index( const std::string& collection_name, const std::string& index_name )
+{
+  if ( const auto _status = is_collection_name_valid( collection_name ); _status != status::success )
+    return _status;
+  std::shared_lock< std::shared_mutex > lock( mutex_ );
+  const auto it = collections_.find( collection_name );
+  if ( it == collections_.end() )
+    return status::collection_does_not_exist;
+  return it->second->retrain_index( index_name ) ? status::success : status::index_does_not_exist;
+}
+
+result< std::pair< index_type, std::unique_ptr< stats_t > > > database::get_index_stats( const std::string& collection_name,
+                                                                                         const std::string& index_name )
+{
+  if ( const auto _status = is_collection_name_valid( collection_name ); _status != status::success )
+    return { _status };
+  std::shared_lock< std::shared_mutex > lock( mutex_ );
+  const auto it = collections_.find( collection_name );
+  if ( it == collections_.end() )
+    return { status::collection_does_not_exist };
+  if ( !it->second->get_index_params( index_name ).second )
+    return { status::index_does_not_exist };
+  return { status::success, it->second->get_index_stats( index_name ) };
+}
+
 status database::save()
 {
   try
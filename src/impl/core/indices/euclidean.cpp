@@ -8,12 +8,16 @@
 
 namespace vector_db::indices::euclidean
 {
-index::index( const wk_col_ptr& col_ptr )
+index::index( const wk_col_ptr& col_ptr, const distance::dist_type dist_type )
     : index_t( col_ptr )
+    , dist_type_( dist_type )
 {
 }
 
-bool index::search_for_top_k( const float_vector& query_vector, unsigned int k, std::vector< score_pair >& results )
+bool index::search_for_top_k( const float_vector& query_vector,
+                              unsigned int k,
+                              std::vector< score_pair >& results,
+                              const search_params_t& search_params )
 {
   try
   {
@@ -22,15 +26,13 @@ bool index::search_for_top_k( const float_vector& query_vector, unsigned int k,
       throw std::runtime_error( "Collection pointer expired during search" );
     const auto& _id_set = col->get_all_vector_ids();
     results.clear();
-    if ( k > _id_set.size() )
-    {
-      k = static_cast< unsigned int >( _id_set.size() );
-    }
     std::vector< std::pair< double, id_t > > dist_vec;
     dist_vec.reserve( _id_set.size() );
+    const auto dist_func = distance::get_distance_instance( dist_type_ );
     for ( const auto& _id : _id_set )
     {
-      const auto dist_func = distance::euclidean::get_instance();
+      if ( search_params.accepts_ && !search_params.accepts_( _id ) )
+        continue;
       if ( const auto vector = col->get_vector_by_id( _id ); vector )
         dist_vec.emplace_back( dist_func->compute( query_vector, vector.value() ), _id );
       else
@@ -41,6 +43,13 @@ bool index::search_for_top_k( const float_vector& query_vector, unsigned int k,
       }
     }
 
+    if ( search_params.stats_ )
+      search_params.stats_->distance_computations_ += dist_vec.size();
+
+    if ( k > dist_vec.size() )
+    {
+      k = static_cast< unsigned int >( dist_vec.size() );
+    }
     std::partial_sort( dist_vec.begin(), dist_vec.begin() + k, dist_vec.end() );
 
     results.resize( k );
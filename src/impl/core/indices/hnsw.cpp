@@ -2,11 +2,16 @@
 // Created by Vivek Yamsani on 14/12/25.
 //
 
+#include <atomic>
+#include <exception>
+#include <limits>
 #include <random>
+#include <string>
 #include <utility>
 
 #include "core/collection.h"
 #include "core/indices/hnsw.h"
+#include "core/utils/thread_pool.h"
 #include "core/utils/util.h"
 
 
@@ -24,15 +29,34 @@ index::index( wk_col_ptr _collection_ptr, const params& _params )
   }
 }
 
+index::~index() { stop_indexer(); }
+
 void index::no_lock_clear()
 {
-  to_be_inserted_.clear();
-  to_be_removed_.clear();
-  inserted_.clear();
-  node_levels_.clear();
-  neighbours_.clear();
+  {
+    std::lock_guard pending_lock( pending_mutex_ );
+    to_be_inserted_.clear();
+    to_be_removed_.clear();
+  }
+  dim_ = 0;
+  data_.clear();
+  slot_ids_.clear();
+  id_to_slot_.clear();
+  links0_.clear();
+  upper_links_.clear();
+  deleted_.clear();
+  free_slots_.clear();
+  sq8_ = {};
+  codes_.clear();
+  live_count_ = 0;
+  deleted_since_repair_ = 0;
+  changed_since_reorder_ = 0;
+  ++generation_;
   entry_point_ = 0;
   max_layer_ = -1;
+  inserts_ = 0;
+  insert_time_ = {};
+  pruned_edges_ = 0;
 }
 
 void index::clear()
@@ -41,29 +65,140 @@ void index::clear()
   no_lock_clear();
 }
 
-// distance helpers using collection-stored data
-double index::dist( const id_t _a, const id_t _b, const col_ptr& col ) const
+size_t index::pending() const
 {
-  if ( !col )
-    throw std::runtime_error( "Collection expired" );
+  std::lock_guard pending_lock( pending_mutex_ );
+  return to_be_inserted_.size() + to_be_removed_.size() + in_flight_;
+}
 
-  const auto va = col->get_vector_by_id( _a );
-  const auto vb = col->get_vector_by_id( _b );
+size_t index::slot_count() const
+{
+  std::shared_lock< std::shared_mutex > lock( mutex_ );
+  return slot_ids_.size();
+}
 
-  if ( !va || !vb )
-    return std::numeric_limits< double >::max();
-  return params_.distance_->compute( *va, *vb );
+std::unique_ptr< stats_t > index::get_stats() const
+{
+  auto _stats = std::make_unique< stats >();
+  _stats->queries_ = queries_.load( std::memory_order_relaxed );
+  _stats->totals_.distance_computations_ = distance_computations_.load( std::memory_order_relaxed );
+  _stats->totals_.nodes_expanded_ = nodes_expanded_.load( std::memory_order_relaxed );
+  _stats->totals_.visited_ = visited_.load( std::memory_order_relaxed );
+  for ( const auto& hops : hops_per_layer_ )
+    _stats->totals_.hops_per_layer_.push_back( hops.load( std::memory_order_relaxed ) );
+  while ( !_stats->totals_.hops_per_layer_.empty() && _stats->totals_.hops_per_layer_.back() == 0 )
+    _stats->totals_.hops_per_layer_.pop_back();
+
+  std::shared_lock< std::shared_mutex > lock( mutex_ );
+  _stats->inserts_ = inserts_;
+  const auto seconds = std::chrono::duration< double >( insert_time_ ).count();
+  _stats->inserts_per_sec_ = seconds > 0.0 ? inserts_ / seconds : 0.0;
+  _stats->pruned_edges_ = pruned_edges_;
+  _stats->live_count_ = live_count_;
+  _stats->slot_count_ = slot_ids_.size();
+
+  std::vector< std::size_t > edges, nodes;
+  for ( slot_t slot = 0; slot < slot_ids_.size(); ++slot )
+  {
+    if ( deleted_[ slot ] )
+      continue;
+    const auto levels = static_cast< size_t >( level_of( slot ) ) + 1;
+    if ( edges.size() < levels )
+    {
+      edges.resize( levels, 0 );
+      nodes.resize( levels, 0 );
+    }
+    for ( size_t level = 0; level < levels; ++level )
+    {
+      edges[ level ] += links( slot, static_cast< int >( level ) ).size();
+      ++nodes[ level ];
+    }
+  }
+  for ( size_t level = 0; level < edges.size(); ++level )
+    _stats->average_degree_.push_back( static_cast< double >( edges[ level ] ) / nodes[ level ] );
+  return _stats;
 }
 
-double index::dist( const float_vector& q, const id_t _b, const col_ptr& col ) const
+// distance helpers using the vectors linked into the graph
+double index::dist( const slot_t _a, const slot_t _b ) const { return params_.distance_->compute( row( _a ), row( _b ), dim_ ); }
+
+double index::dist( const float* q, const slot_t _b ) const { return params_.distance_->compute( q, row( _b ), dim_ ); }
+
+sq8_quantizer index::train_quantizer( const std::vector< const float_vector* >& sample )
 {
-  if ( !col )
-    throw std::runtime_error( "Collection expired" );
+  sq8_quantizer quantizer;
+  if ( sample.empty() )
+    return quantizer;
+  const auto dim = static_cast< size_t >( sample.front()->dimension_ );
+  std::vector< float > rows;
+  rows.reserve( sample.size() * dim );
+  for ( const auto* vec : sample )
+    rows.insert( rows.end(), vec->data_.get(), vec->data_.get() + dim );
+  quantizer.train( rows.data(), sample.size(), dim );
+  return quantizer;
+}
 
-  const auto vb = col->get_vector_by_id( _b );
-  if ( !vb )
-    return std::numeric_limits< double >::max();
-  return params_.distance_->compute( q, *vb );
+bool index::has_quantizer() const
+{
+  std::shared_lock< std::shared_mutex > lock( mutex_ );
+  return sq8_.trained();
+}
+
+std::vector< float_vector > index::quantizer_sample() const
+{
+  std::shared_lock< std::shared_mutex > lock( mutex_ );
+  std::lock_guard pending_lock( pending_mutex_ );
+  std::vector< float_vector > sample;
+  if ( live_count_ + to_be_inserted_.size() < min_quantizer_sample )
+    return sample;
+  sample.reserve( live_count_ + to_be_inserted_.size() );
+  for ( slot_t slot = 0; slot < slot_ids_.size(); ++slot )
+    if ( !deleted_[ slot ] )
+      sample.emplace_back( dim_, row( slot ) );
+  for ( const auto& [ _, vec ] : to_be_inserted_ )
+    sample.push_back( vec );
+  return sample;
+}
+
+void index::adopt_quantizer( sq8_quantizer&& quantizer )
+{
+  sq8_ = std::move( quantizer );
+  codes_.assign( sq8_.trained() ? slot_ids_.size() * sq8_.dimension() : 0, 0 );
+  for ( slot_t slot = 0; slot < slot_ids_.size(); ++slot )
+    encode( slot );
+}
+
+void index::encode( const slot_t slot )
+{
+  if ( !quantized() )
+    return;
+  const auto end = ( static_cast< size_t >( slot ) + 1 ) * dim_;
+  if ( codes_.size() < end )
+    codes_.resize( end );
+  sq8_.encode( row( slot ), codes_.data() + end - dim_ );
+}
+
+index::links_view index::links( const slot_t slot, const int level ) const
+{
+  if ( level == 0 )
+  {
+    const auto* block = links0_block( slot );
+    return { block + 1, block + 1 + block[ 0 ] };
+  }
+  const auto& nbs = upper_links_[ slot ][ level - 1 ];
+  return { nbs.data(), nbs.data() + nbs.size() };
+}
+
+void index::set_links( const slot_t slot, const int level, const links_t& neighbours )
+{
+  if ( level == 0 )
+  {
+    auto* block = links0_.data() + static_cast< size_t >( slot ) * ( params_.M0_ + 1 );
+    block[ 0 ] = static_cast< slot_t >( neighbours.size() );
+    std::copy( neighbours.begin(), neighbours.end(), block + 1 );
+    return;
+  }
+  upper_links_[ slot ][ level - 1 ] = neighbours;
 }
 
 int index::generate_random_level() const
@@ -74,316 +209,1100 @@ int index::generate_random_level() const
   return static_cast< int >( -std::log( r ) * params_.ml_ );
 }
 
-index::cand_set_t index::search_layer( const float_vector& query,
-                                       const id_set& entry_points,
-                                       unsigned int ef,
-                                       unsigned int level,
-                                       const col_ptr& col )
+void index::layer_scratch::reset( const size_t slots )
+{
+  if ( marks_.size() < slots )
+    marks_.resize( slots, 0 );
+  if ( ++epoch_ == 0 )
+  {
+    // wrapped around: stale marks could collide with the new epochs
+    std::fill( marks_.begin(), marks_.end(), 0 );
+    epoch_ = 1;
+  }
+  candidates_.clear();
+  result_.clear();
+}
+
+bool index::layer_scratch::visit( const slot_t slot )
+{
+  if ( marks_[ slot ] == epoch_ )
+    return false;
+  marks_[ slot ] = epoch_;
+  return true;
+}
+
+index::cand_set_t index::search_layer( const float* query,
+                                      const links_t& entry_points,
+                                      unsigned int ef,
+                                      int level,
+                                      const bool use_codes,
+                                      const layer_filter& filter,
+                                      query_stats* stats,
+                                      const std::optional< unsigned int > prefetch_distance ) const
 {
-  cand_set_t result;  // found nearest neighbors
   if ( entry_points.empty() )
-    return result;
+    return {};
+
+  thread_local layer_scratch scratch;
+  scratch.reset( slot_ids_.size() );
+  auto& candidates = scratch.candidates_;  // potential candidates
+  auto& result = scratch.result_;          // found nearest neighbors
+
+  const auto push_candidate = [ & ]( const double d, const slot_t slot )
+  {
+    candidates.emplace_back( d, slot );
+    std::push_heap( candidates.begin(), candidates.end(), std::greater<>{} );
+  };
+  const auto push_result = [ & ]( const double d, const slot_t slot )
+  {
+    result.emplace_back( d, slot );
+    std::push_heap( result.begin(), result.end() );
+    if ( result.size() > ef )
+    {
+      std::pop_heap( result.begin(), result.end() );
+      result.pop_back();
+    }
+  };
+
+  // counted locally, the caller's stats are only touched once
+  std::uint64_t computations = 0, expanded = 0, visited = 0;
+  const auto visit = [ & ]( const slot_t slot )
+  {
+    const bool first = scratch.visit( slot );
+    visited += first;
+    return first;
+  };
+  const auto distance_to = [ & ]( const slot_t slot )
+  {
+    ++computations;
+    return use_codes ? sq8_.distance( params_.dist_type_, query, code( slot ) ) : dist( query, slot );
+  };
+  const auto prefetch_row = [ & ]( const slot_t slot )
+  {
+    if ( use_codes )
+      utils::prefetch( code( slot ), dim_ );
+    else
+      utils::prefetch( row( slot ), dim_ * sizeof( float ) );
+  };
+
+  const auto accepted = [ & ]( const slot_t slot )
+  { return !deleted_[ slot ] && ( !filter.accepts_ || ( *filter.accepts_ )( slot_ids_[ slot ] ) ); };
+
+  const auto consider = [ & ]( const slot_t slot )
+  {
+    const auto d = distance_to( slot );
+    if ( result.size() < ef || d < result.front().first )
+    {
+      push_candidate( d, slot );
+      if ( accepted( slot ) )
+        push_result( d, slot );
+    }
+  };
 
-  visited_map_t visited;
-  cand_set_t candidates;  // potential candidates
   for ( const auto& ep : entry_points )
   {
-    result.emplace( dist( query, ep, col ), ep );
-    candidates.emplace( dist( query, ep, col ), ep );
-    visited[ ep ] = true;
+    if ( !visit( ep ) )
+      continue;
+    const auto d = distance_to( ep );
+    push_candidate( d, ep );
+    if ( accepted( ep ) )
+      push_result( d, ep );
   }
 
+  const size_t distance = prefetch_distance.value_or( params_.prefetch_distance_ );
   while ( !candidates.empty() )
   {
-    auto [ dist_curr_cand, cand_id ] = *candidates.begin();
-    candidates.erase( candidates.begin() );  // extract nearest candidate
+    // extract nearest candidate
+    std::pop_heap( candidates.begin(), candidates.end(), std::greater<>{} );
+    const auto [ dist_curr_cand, cand_id ] = candidates.back();
+    candidates.pop_back();
 
-    auto [ dist_ele, _ ] = *result.rbegin();  // get farthest element dist
-    if ( dist_curr_cand > dist_ele )
+    if ( result.size() >= ef && dist_curr_cand > result.front().first )
       break;
+    ++expanded;
+
+    // the next candidate is likely to be expanded right after this one
+    if ( distance > 0 && level == 0 && !candidates.empty() )
+      utils::prefetch( links0_block( candidates.front().second ), ( params_.M0_ + 1 ) * sizeof( slot_t ) );
+
+    // rows are fetched `distance` neighbours ahead of the one being scored
+    const auto neighbours = links( cand_id, level );
+    for ( size_t j = 0; j < std::min( distance, neighbours.size() ); ++j )
+      prefetch_row( neighbours[ j ] );
 
-    for ( auto& neighbour : neighbours_[ level ][ cand_id ] )
+    for ( size_t j = 0; j < neighbours.size(); ++j )
     {
-      if ( visited[ neighbour ] )
+      if ( distance > 0 && j + distance < neighbours.size() )
+        prefetch_row( neighbours[ j + distance ] );
+
+      const auto neighbour = neighbours[ j ];
+      if ( !visit( neighbour ) )
         continue;
-      visited[ neighbour ] = true;
-      auto [ farthest_ele_dist, _ ] = *result.rbegin();  // get farthest element dist
-      auto d = dist( query, neighbour, col );
-      if ( d < farthest_ele_dist || result.size() < ef )
+
+      // with a selective filter most neighbours are rejected: skip scoring them and look one hop further
+      if ( filter.two_hop_ && !accepted( neighbour ) )
       {
-        candidates.emplace( d, neighbour );
-        result.emplace( d, neighbour );
-        if ( result.size() > ef )
-          result.erase( --result.end() );
+        for ( const auto hop : links( neighbour, level ) )
+          if ( accepted( hop ) && visit( hop ) )
+            consider( hop );
+        continue;
       }
+      consider( neighbour );
     }
   }
 
-  return result;
+  if ( stats )
+  {
+    stats->distance_computations_ += computations;
+    stats->nodes_expanded_ += expanded;
+    stats->visited_ += visited;
+    if ( stats->hops_per_layer_.size() <= static_cast< size_t >( level ) )
+      stats->hops_per_layer_.resize( level + 1, 0 );
+    stats->hops_per_layer_[ level ] += expanded;
+  }
+  return { result.begin(), result.end() };
+}
+
+std::vector< index::cand_t > index::select_neighbors_heuristic( const slot_t base,
+                                                                 const cand_set_t& candidates,
+                                                                 unsigned int no_of_cand,
+                                                                 const int level ) const
+{
+  const auto between = [ this ]( const slot_t a, const slot_t b ) { return dist( a, b ); };
+  if ( !params_.extend_candidates_ )
+    return vector_db::select_neighbors_heuristic< slot_t >( candidates, no_of_cand, between, params_.keep_pruned_connections_ );
+
+  cand_set_t working_set = candidates;
+  for ( const auto& [ _, cand ] : candidates )
+    for ( const auto cand_adj : links( cand, level ) )
+      if ( cand_adj != base && !deleted_[ cand_adj ] )
+        working_set.emplace( dist( base, cand_adj ), cand_adj );
+  return vector_db::select_neighbors_heuristic< slot_t >( working_set, no_of_cand, between, params_.keep_pruned_connections_ );
 }
 
-index::cand_set_t index::select_neighbors_heuristic( const cand_set_t& candidates, unsigned int no_of_cand ) const
+void index::init()
 {
-  // Algorithm 4: Heuristic Neighbor Selection
-  cand_set_t result_set;
-  cand_set_t discarded_candidates;
+  std::unique_lock< std::shared_mutex > lock( mutex_ );
+  auto col = collection_ptr_.lock();
+  if ( !col )
+    throw std::runtime_error( "Collection pointer expired during build" );
 
-  for ( const auto& element : candidates )
+  if ( restored_ )
   {
-    if ( result_set.size() >= no_of_cand )
-      break;
+    // the graph came from disk, only the changes it had not absorbed yet need to be replayed
+    restored_ = false;
+    const auto pending_ids = std::move( restored_pending_ );
+    restored_pending_.clear();
+    lock.unlock();
 
-    auto [ dist_from_q, _ ] = element;
+    std::vector< id_t > added, removed;
+    for ( const auto _id : pending_ids )
+      ( col->get_vector_by_id( _id ) ? added : removed ).push_back( _id );
 
-    // element is closer to q compared to any element from result
-    if ( result_set.empty() || dist_from_q < result_set.begin()->first )
-    {
-      result_set.insert( element );
-    }
-    else
-    {
-      discarded_candidates.insert( element );
-    }
+    on_vectors_removed( removed );
+    on_vectors_added( added );
+    start_indexer();
+    return;
   }
 
-  // "Backfill": fill remaining slots with closest from discarded
-  if ( result_set.size() < no_of_cand )
+  // The vectors are fetched without the graph lock, searches take the collection's lock first.
+  // Anything added meanwhile is queued by the hooks, after the clear.
+  no_lock_clear();
+  lock.unlock();
+  std::vector< std::pair< id_t, float_vector > > vectors;
+  for ( const auto& _id : col->get_all_vector_ids() )
+  {
+    auto vec = col->get_vector_by_id( _id );
+    if ( vec )
+      vectors.emplace_back( _id, std::move( vec.value() ) );
+  }
+  sq8_quantizer quantizer;
+  if ( params_.quantizer_ != quantizer_type::none && vectors.size() >= min_quantizer_sample )
+  {
+    std::vector< const float_vector* > sample;
+    for ( const auto& [ _, vec ] : vectors )
+      sample.push_back( &vec );
+    quantizer = train_quantizer( sample );
+  }
+
+  lock.lock();
+  if ( quantizer.trained() )
+    adopt_quantizer( std::move( quantizer ) );
+  const auto start = std::chrono::steady_clock::now();
+  for ( const auto& [ _id, vec ] : vectors )
+    insert( _id, vec );
+  inserts_ += vectors.size();
+  insert_time_ += std::chrono::steady_clock::now() - start;
+  if ( params_.reorder_ )
+    reorder();
+  lock.unlock();
+
+  start_indexer();
+}
+
+void index::upsert( id_t id, const float_vector& vec )
+{
+  if ( const auto it = id_to_slot_.find( id ); it != id_to_slot_.end() )
   {
-    for ( const auto& element : discarded_candidates )
+    // updates and re-inserts of a deleted id are applied in place
+    const auto slot = it->second;
+    if ( deleted_[ slot ] )
     {
-      if ( result_set.size() >= no_of_cand )
-        break;
-      result_set.insert( element );
+      deleted_[ slot ] = 0;
+      ++live_count_;
     }
+    update( slot, vec );
+    return;
   }
 
-  return result_set;
+  while ( !free_slots_.empty() )
+  {
+    const auto slot = free_slots_.back();
+    free_slots_.pop_back();
+    if ( !deleted_[ slot ] )
+      continue;  // re-inserted by its previous id in the meantime
+
+    if ( const auto it = id_to_slot_.find( slot_ids_[ slot ] ); it != id_to_slot_.end() && it->second == slot )
+      id_to_slot_.erase( it );
+    slot_ids_[ slot ] = id;
+    id_to_slot_[ id ] = slot;
+    deleted_[ slot ] = 0;
+    ++live_count_;
+    ++changed_since_reorder_;
+    update( slot, vec );
+    return;
+  }
+
+  insert( id, vec );
 }
 
-void index::init()
+void index::insert( id_t id, const float_vector& vec )
 {
-  std::unique_lock< std::shared_mutex > lock( mutex_ );
-  auto col = collection_ptr_.lock();
-  if ( !col )
-    throw std::runtime_error( "Collection pointer expired during build" );
-  const auto& _id_set = col->get_all_vector_ids();
-  no_lock_clear();
-  if ( _id_set.empty() )
-    return;
+  if ( dim_ == 0 )
+    dim_ = vec.dimension_;
 
-  for ( const auto& _id : _id_set )
-    to_be_inserted_.insert( _id );
+  const auto slot = static_cast< slot_t >( slot_ids_.size() );
+  slot_ids_.push_back( id );
+  id_to_slot_[ id ] = slot;
+  data_.insert( data_.end(), vec.data_.get(), vec.data_.get() + dim_ );
+  upper_links_.emplace_back( generate_random_level() );
+  links0_.resize( links0_.size() + params_.M0_ + 1, 0 );
+  deleted_.push_back( 0 );
+  ++live_count_;
+  ++changed_since_reorder_;
+  encode( slot );
 
-  // Initialize the first point
-  // entry_point_ = *to_be_inserted_.begin();
-  // inserted_.insert( entry_point_ );
-  // to_be_inserted_.erase( entry_point_ );
-  // node_levels_[ entry_point_ ] = 0;
-  // max_layer_ = 0;
-  // neighbours_.resize( 1 );
-  build( col );
+  link( slot );
 }
 
-void index::insert( id_t id, const col_ptr& col )
+void index::update( slot_t slot, const float_vector& vec )
 {
-  static constexpr auto _func_name = "index::insert";
-  cand_set_t candidates;  // currently found nearest elements
-  int node_level = generate_random_level();
-  node_levels_[ id ] = node_level;
+  std::copy( vec.data_.get(), vec.data_.get() + dim_, data_.begin() + static_cast< std::ptrdiff_t >( slot ) * dim_ );
+  encode( slot );
 
-  // Search from the top layer down to layer 0
-  if ( entry_point_ == 0 )
+  // The former neighbours may have relied on `slot` as a hop into its old region: let each of them
+  // re-select its links among the two-hop neighbourhood of `slot`.
+  for ( int lc = std::min( level_of( slot ), max_layer_ ); lc >= 0; --lc )
   {
-    entry_point_ = id;
+    const auto own_links = links( slot, lc );
+    links_t neighbourhood( own_links.begin(), own_links.end() );
+    for ( const auto nb : own_links )
+      for ( const auto nb2 : links( nb, lc ) )
+        neighbourhood.push_back( nb2 );
+    neighbourhood.push_back( slot );
+    std::sort( neighbourhood.begin(), neighbourhood.end() );
+    neighbourhood.erase( std::unique( neighbourhood.begin(), neighbourhood.end() ), neighbourhood.end() );
+
+    for ( const auto nb : own_links )
+    {
+      if ( deleted_[ nb ] )
+        continue;
+      cand_set_t candidates;
+      for ( const auto cand : neighbourhood )
+        if ( cand != nb && !deleted_[ cand ] )
+          candidates.emplace( dist( nb, cand ), cand );
+
+      if ( candidates.empty() )
+        continue;
+      links_t nb_links;
+      for ( const auto& [ _, cand ] : select_neighbors_heuristic( nb, candidates, max_links( lc ), lc ) )
+        nb_links.push_back( cand );
+      set_links( nb, lc, nb_links );
+    }
   }
-  id_set ep{ entry_point_ };
-  const auto curr_vector = col->get_vector_by_id( id );
-  if ( !curr_vector )
+
+  link( slot );
+}
+
+void index::remove( id_t id )
+{
+  const auto it = id_to_slot_.find( id );
+  if ( it == id_to_slot_.end() || deleted_[ it->second ] )
+    return;
+
+  // reusable once repair() bridged the edges into it
+  deleted_[ it->second ] = 1;
+  --live_count_;
+  ++deleted_since_repair_;
+  ++changed_since_reorder_;
+}
+
+void index::link( slot_t slot )
+{
+  const int node_level = level_of( slot );
+  if ( max_layer_ < 0 )
   {
-    logger_->error( "{}: Failed to get vector for id {} in collection {}", _func_name, id, col->name_ );
+    entry_point_ = slot;
+    max_layer_ = node_level;
     return;
   }
+
+  // Search from the top layer down to layer 0
+  const float* curr_vector = row( slot );
+  links_t ep{ entry_point_ };
   for ( int lc = max_layer_; lc > node_level; --lc )
   {
-    candidates = search_layer( curr_vector.value(), ep, 1, lc, col );
-    ep = { candidates.begin()->second };
+    const auto candidates = search_layer( curr_vector, ep, 1, lc );
+    if ( !candidates.empty() )
+      ep = { candidates.begin()->second };
   }
 
   // Insert into layers from node_level down to 0
   for ( int lc = std::min( node_level, max_layer_ ); lc >= 0; --lc )
   {
-    auto layer_M = lc == 0 ? params_.M0_ : params_.M_;
-    candidates = search_layer( curr_vector.value(), { ep }, params_.ef_construction_, lc, col );
-    auto selected_candidates = select_neighbors_heuristic( candidates, layer_M );
-
-    // add bidirectional links
-    for ( auto& [ _, neighbour_id ] : selected_candidates )
+    auto candidates = search_layer( curr_vector, ep, params_.ef_construction_, lc );
+    for ( auto it = candidates.begin(); it != candidates.end(); ++it )
     {
-      neighbours_[ lc ][ id ].insert( neighbour_id );
-      neighbours_[ lc ][ neighbour_id ].insert( id );
+      if ( it->second == slot )
+      {
+        candidates.erase( it );
+        break;
+      }
     }
+    if ( candidates.empty() )
+      continue;
+
+    connect( slot, lc, candidates );
+
+    ep.clear();
+    for ( const auto& [ _, cand ] : candidates )
+      ep.push_back( cand );
+  }
+
+  if ( node_level > max_layer_ )
+  {
+    entry_point_ = slot;
+    max_layer_ = node_level;
+  }
+}
+
+void index::connect( slot_t slot, int lc, const cand_set_t& candidates )
+{
+  const auto layer_M = max_links( lc );
+  auto selected_candidates = select_neighbors_heuristic( slot, candidates, layer_M, lc );
+  pruned_edges_ += candidates.size() - std::min( candidates.size(), selected_candidates.size() );
+
+  // add bidirectional links
+  links_t own_links;
+  for ( auto& [ _, neighbour_id ] : selected_candidates )
+    own_links.push_back( neighbour_id );
+  set_links( slot, lc, own_links );
+
+  for ( auto neighbour_id : own_links )
+  {
+    const auto current = links( neighbour_id, lc );
+    if ( std::find( current.begin(), current.end(), slot ) != current.end() )
+      continue;
+    links_t nb_links( current.begin(), current.end() );
+    nb_links.push_back( slot );
 
     // shrink connections
-    for ( auto neighbour_id : neighbours_[ lc ][ id ] )
+    if ( nb_links.size() > layer_M )
     {
-      auto create_cand_set = [ this, inserting_id = id, col, lc ]( id_t node_id ) -> cand_set_t
-      {
-        cand_set_t candidates;
-        for ( auto neighbour_id : neighbours_[ lc ][ node_id ] )
-        {
-          candidates.insert( { dist( inserting_id, node_id, col ), neighbour_id } );
-        }
+      cand_set_t nb_candidates;
+      for ( auto nb : nb_links )
+        nb_candidates.insert( { dist( neighbour_id, nb ), nb } );
+
+      nb_links.clear();
+      for ( const auto& [ _, cand ] : select_neighbors_heuristic( neighbour_id, nb_candidates, layer_M, lc ) )
+        nb_links.push_back( cand );
+      pruned_edges_ += nb_candidates.size() - nb_links.size();
+    }
+    set_links( neighbour_id, lc, nb_links );
+  }
+}
 
-        return candidates;
-      };
+void index::repair()
+{
+  for ( slot_t slot = 0; slot < slot_ids_.size(); ++slot )
+  {
+    if ( deleted_[ slot ] )
+      continue;
 
-      auto create_neighbour_set = []( const cand_set_t& candidates )
+    for ( int lc = 0; lc <= level_of( slot ); ++lc )
+    {
+      const auto own_links = links( slot, lc );
+      if ( std::none_of( own_links.begin(), own_links.end(), [ this ]( slot_t nb ) { return deleted_[ nb ]; } ) )
+        continue;
+
+      // bridge over the deleted neighbours to their live neighbours
+      cand_set_t candidates;
+      for ( const auto nb : own_links )
       {
-        id_set neighbour_set;
-        for ( auto [ _, cand_id ] : candidates )
-          neighbour_set.insert( cand_id );
+        if ( !deleted_[ nb ] )
+        {
+          candidates.emplace( dist( slot, nb ), nb );
+          continue;
+        }
+        for ( const auto nb2 : links( nb, lc ) )
+          if ( nb2 != slot && !deleted_[ nb2 ] )
+            candidates.emplace( dist( slot, nb2 ), nb2 );
+      }
 
-        return neighbour_set;
-      };
+      // no live node may keep an edge into a slot a new id can take
+      links_t repaired;
+      if ( !candidates.empty() )
+        for ( const auto& [ _, cand ] : select_neighbors_heuristic( slot, candidates, max_links( lc ), lc ) )
+          repaired.push_back( cand );
+      set_links( slot, lc, repaired );
+    }
+  }
 
-      if ( neighbours_[ lc ][ neighbour_id ].size() > layer_M )
+  // repaired lists no longer lead into deleted slots, so the entry point has to be a live one
+  if ( max_layer_ >= 0 && deleted_[ entry_point_ ] && live_count_ > 0 )
+  {
+    max_layer_ = -1;
+    for ( slot_t slot = 0; slot < slot_ids_.size(); ++slot )
+    {
+      if ( !deleted_[ slot ] && level_of( slot ) > max_layer_ )
       {
-        const auto new_neighbour_cand = select_neighbors_heuristic( create_cand_set( neighbour_id ), layer_M );
-        neighbours_[ lc ][ neighbour_id ] = create_neighbour_set( new_neighbour_cand );
+        entry_point_ = slot;
+        max_layer_ = level_of( slot );
       }
     }
+  }
+  deleted_since_repair_ = 0;
+  compact();
+}
+
+void index::compact()
+{
+  // the deleted slots at the end go, the others wait for new ids
+  auto n = slot_ids_.size();
+  for ( ; n > 0 && deleted_[ n - 1 ]; --n )
+    if ( const auto it = id_to_slot_.find( slot_ids_[ n - 1 ] ); it != id_to_slot_.end() && it->second == n - 1 )
+      id_to_slot_.erase( it );
+  data_.resize( n * dim_ );
+  if ( !codes_.empty() )
+    codes_.resize( n * dim_ );
+  slot_ids_.resize( n );
+  links0_.resize( n * ( params_.M0_ + 1 ) );
+  upper_links_.resize( n );
+  deleted_.resize( n );
+
+  // their links may point past the end now, and nothing searches through them anymore
+  free_slots_.clear();
+  for ( slot_t slot = 0; slot < n; ++slot )
+  {
+    if ( !deleted_[ slot ] )
+      continue;
+    for ( int lc = 0; lc <= level_of( slot ); ++lc )
+      set_links( slot, lc, {} );
+    free_slots_.push_back( slot );
+  }
+  if ( n == 0 )
+  {
+    entry_point_ = 0;
+    max_layer_ = -1;
+  }
+}
+
+index::layout index::reordered() const
+{
+  constexpr auto unassigned = std::numeric_limits< slot_t >::max();
+  const auto n = static_cast< slot_t >( slot_ids_.size() );
+  std::vector< slot_t > new_slot( n, unassigned );
+  std::vector< slot_t > order;  // new slot -> old slot
+  order.reserve( live_count_ );
+
+  const auto visit = [ & ]( const slot_t slot )
+  {
+    if ( deleted_[ slot ] || new_slot[ slot ] != unassigned )
+      return;
+    new_slot[ slot ] = static_cast< slot_t >( order.size() );
+    order.push_back( slot );
+  };
+
+  // BFS from the entry point first, then from whatever it did not reach
+  size_t head = 0;
+  const auto bfs = [ & ]( const slot_t root )
+  {
+    visit( root );
+    for ( ; head < order.size(); ++head )
+      for ( const auto nb : links( order[ head ], 0 ) )
+        visit( nb );
+  };
+  if ( max_layer_ >= 0 )
+    bfs( entry_point_ );
+  for ( slot_t slot = 0; slot < n; ++slot )
+    bfs( slot );
 
-    ep = [ candidates ]()
+  const auto remap = [ & ]( const links_view neighbours )
+  {
+    links_t remapped;
+    for ( const auto nb : neighbours )
+      if ( new_slot[ nb ] != unassigned )
+        remapped.push_back( new_slot[ nb ] );
+    return remapped;
+  };
+
+  const size_t block_size = params_.M0_ + 1;
+  layout renumbered;
+  renumbered.data_.resize( order.size() * dim_ );
+  renumbered.slot_ids_.resize( order.size() );
+  renumbered.links0_.resize( order.size() * block_size, 0 );
+  renumbered.upper_links_.resize( order.size() );
+  renumbered.codes_.resize( quantized() ? order.size() * dim_ : 0 );
+  renumbered.id_to_slot_.reserve( order.size() );
+  for ( slot_t slot = 0; slot < order.size(); ++slot )
+  {
+    const auto old = order[ slot ];
+    std::copy( row( old ), row( old ) + dim_, renumbered.data_.begin() + static_cast< std::ptrdiff_t >( slot ) * dim_ );
+    if ( quantized() )
+      std::copy( code( old ), code( old ) + dim_, renumbered.codes_.begin() + static_cast< std::ptrdiff_t >( slot ) * dim_ );
+    renumbered.slot_ids_[ slot ] = slot_ids_[ old ];
+    renumbered.id_to_slot_[ slot_ids_[ old ] ] = slot;
+
+    const auto level0 = remap( links( old, 0 ) );
+    auto* block = renumbered.links0_.data() + slot * block_size;
+    block[ 0 ] = static_cast< slot_t >( level0.size() );
+    std::copy( level0.begin(), level0.end(), block + 1 );
+
+    renumbered.upper_links_[ slot ].resize( level_of( old ) );
+    for ( int lc = 1; lc <= level_of( old ); ++lc )
+      renumbered.upper_links_[ slot ][ lc - 1 ] = remap( links( old, lc ) );
+  }
+
+  if ( max_layer_ >= 0 && !deleted_[ entry_point_ ] )
+  {
+    renumbered.entry_point_ = new_slot[ entry_point_ ];
+    renumbered.max_layer_ = max_layer_;
+    return renumbered;
+  }
+  for ( slot_t slot = 0; slot < order.size(); ++slot )
+  {
+    const auto level = static_cast< int >( renumbered.upper_links_[ slot ].size() );
+    if ( level > renumbered.max_layer_ )
     {
-      id_set res;
-      for ( auto [ _, _id ] : candidates )
-        res.insert( _id );
-      return res;
-    }();
+      renumbered.entry_point_ = slot;
+      renumbered.max_layer_ = level;
+    }
   }
+  return renumbered;
+}
 
-  if ( node_level > max_layer_ )
+void index::adopt( layout&& renumbered )
+{
+  data_ = std::move( renumbered.data_ );
+  codes_ = std::move( renumbered.codes_ );
+  slot_ids_ = std::move( renumbered.slot_ids_ );
+  id_to_slot_ = std::move( renumbered.id_to_slot_ );
+  links0_ = std::move( renumbered.links0_ );
+  upper_links_ = std::move( renumbered.upper_links_ );
+  entry_point_ = renumbered.entry_point_;
+  max_layer_ = renumbered.max_layer_;
+  deleted_.assign( slot_ids_.size(), 0 );
+  free_slots_.clear();
+  deleted_since_repair_ = 0;
+  changed_since_reorder_ = 0;
+}
+
+void index::reorder_in_background( std::unique_lock< std::shared_mutex >& lock )
+{
+  // Only the indexer changes the graph, short of a clear: searches keep running on it while the copy is
+  // made, and the copy is still current when the exclusive lock is taken back.
+  const auto generation = generation_;
+  lock.unlock();
+  layout renumbered;
   {
-    entry_point_ = id;
-    max_layer_ = node_level;
-    neighbours_.resize( max_layer_ + 1 );
+    std::shared_lock< std::shared_mutex > shared_lock( mutex_ );
+    if ( generation_ != generation )
+    {
+      shared_lock.unlock();
+      lock.lock();
+      return;
+    }
+    renumbered = reordered();
   }
+  lock.lock();
+  if ( generation_ == generation )
+    adopt( std::move( renumbered ) );
+}
 
-  inserted_.insert( id );
+void index::start_indexer()
+{
+  std::lock_guard pending_lock( pending_mutex_ );
+  if ( indexer_.joinable() )
+    return;
+  stop_indexer_ = false;
+  indexer_ = std::thread( [ this ] { indexer_loop(); } );
+}
+
+void index::stop_indexer()
+{
+  {
+    std::lock_guard pending_lock( pending_mutex_ );
+    stop_indexer_ = true;
+  }
+  pending_cv_.notify_all();
+  if ( indexer_.joinable() )
+    indexer_.join();
 }
 
-void index::build( const col_ptr& col )
+void index::indexer_loop()
 {
-  for ( const auto& id : to_be_removed_ )
+  while ( true )
   {
-    for ( int layer = 0; layer <= max_layer_; ++layer )
     {
-      for ( auto& nb : neighbours_[ layer ][ id ] )
+      std::unique_lock pending_lock( pending_mutex_ );
+      pending_cv_.wait( pending_lock,
+                        [ this ] { return stop_indexer_ || !to_be_inserted_.empty() || !to_be_removed_.empty(); } );
+      if ( stop_indexer_ )
+        return;
+    }
+
+    // An index created with too few vectors trains its quantizer once the graph and the queue hold enough,
+    // on copies of them and without the graph lock: searches go on meanwhile. Until then it traverses data_.
+    sq8_quantizer quantizer;
+    if ( params_.quantizer_ != quantizer_type::none && !has_quantizer() )
+    {
+      const auto copies = quantizer_sample();
+      std::vector< const float_vector* > sample;
+      for ( const auto& vec : copies )
+        sample.push_back( &vec );
+      quantizer = train_quantizer( sample );
+    }
+
+    // Queued work is moved into the graph under a single exclusive lock, so searches observe every
+    // vector either in the pending tail or in the graph, never in both or neither.
+    std::unique_lock< std::shared_mutex > lock( mutex_ );
+    id_set removals;
+    std::vector< std::pair< id_t, float_vector > > batch;
+    {
+      std::lock_guard pending_lock( pending_mutex_ );
+      removals.swap( to_be_removed_ );
+      batch.reserve( std::min( indexer_batch_size, to_be_inserted_.size() ) );
+      for ( auto it = to_be_inserted_.begin(); it != to_be_inserted_.end() && batch.size() < indexer_batch_size; )
       {
-        neighbours_[ layer ][ nb ].erase( id );
+        batch.emplace_back( it->first, std::move( it->second ) );
+        it = to_be_inserted_.erase( it );
       }
-      neighbours_[ layer ].erase( id );
+      in_flight_ = removals.size() + batch.size();
     }
-    node_levels_.erase( id );
-    inserted_.erase( id );
+    if ( quantizer.trained() && !sq8_.trained() )
+      adopt_quantizer( std::move( quantizer ) );
+
+    for ( const auto& id : removals )
+      remove( id );
+
+    const auto start = std::chrono::steady_clock::now();
+    for ( const auto& [ id, vec ] : batch )
+      upsert( id, vec );
+    inserts_ += batch.size();
+    insert_time_ += std::chrono::steady_clock::now() - start;
+
+    // a full renumbering only pays off once much of the graph changed since the last one, and it drops the
+    // deleted slots: their neighbours are repaired first
+    const bool renumber
+        = params_.reorder_ && changed_since_reorder_ > 0 && changed_since_reorder_ * reorder_ratio >= live_count_;
+    if ( deleted_since_repair_ > 0 && ( renumber || deleted_since_repair_ * repair_ratio >= live_count_ ) )
+      repair();
+    if ( renumber )
+      reorder_in_background( lock );
+
+    std::lock_guard pending_lock( pending_mutex_ );
+    in_flight_ = 0;
   }
+}
+
+double index::estimate_selectivity( const std::function< bool( id_t ) >& accepts ) const
+{
+  const size_t step = std::max< size_t >( 1, slot_ids_.size() / filter_sample_size );
+  size_t sampled = 0, accepted = 0;
+  for ( size_t slot = 0; slot < slot_ids_.size(); slot += step )
+  {
+    if ( deleted_[ slot ] )
+      continue;
+    ++sampled;
+    accepted += accepts( slot_ids_[ slot ] );
+  }
+  return sampled == 0 ? 1.0 : static_cast< double >( accepted ) / sampled;
+}
+
+std::vector< std::pair< double, id_t > > index::search_ids( const float_vector& query,
+                                                            unsigned int k,
+                                                            const search_params_t& search_params,
+                                                            query_stats& stats )
+{
+  if ( k == 0 )
+    return {};
 
-  to_be_removed_.clear();
-  if ( entry_point_ > 0 && !inserted_.count( entry_point_ ) )
+  query_stats local;
+
+  const auto& accepts = search_params.accepts_;
+  const unsigned int ef = std::max( k, search_params.ef_search_.value_or( params_.ef_search_ ) );
+  cand_set_t candidates;
+  if ( live_count_ > 0 )
   {
-    if ( inserted_.empty() )
-      entry_point_ = 0;
+    const double selectivity = accepts ? estimate_selectivity( accepts ) : 1.0;
+    if ( accepts && selectivity * live_count_ <= brute_force_matches )
+    {
+      // so few vectors match that scanning them is cheaper, and exact
+      for ( slot_t slot = 0; slot < slot_ids_.size(); ++slot )
+      {
+        if ( deleted_[ slot ] || !accepts( slot_ids_[ slot ] ) )
+          continue;
+        candidates.emplace( dist( query.data_.get(), slot ), slot );
+        ++local.distance_computations_;
+        if ( candidates.size() > ef )
+          candidates.erase( --candidates.end() );
+      }
+    }
     else
     {
-      for ( const auto& id : inserted_ )
+      // Search from the top layer down to layer 1
+      const bool use_codes = quantized();
+      links_t ep{ entry_point_ };
+      for ( int lc = max_layer_; lc > 0; --lc )
+      {
+        const auto layer_result
+            = search_layer( query.data_.get(), ep, 1, lc, use_codes, {}, &local, search_params.prefetch_distance_ );
+        if ( !layer_result.empty() )
+          ep = { layer_result.begin()->second };
+      }
+      const layer_filter filter{ accepts ? &accepts : nullptr, selectivity < two_hop_selectivity };
+      candidates
+          = search_layer( query.data_.get(), ep, ef, 0, use_codes, filter, &local, search_params.prefetch_distance_ );
+
+      // re-rank the best of the code distances against the full vectors
+      if ( use_codes )
       {
-        if ( node_levels_[ id ] == max_layer_ )
+        size_t rerank = candidates.size();
+        if ( search_params.rerank_factor_ )
+          rerank = std::min(
+              rerank, std::max< size_t >( k, static_cast< size_t >( std::ceil( k * *search_params.rerank_factor_ ) ) ) );
+        cand_set_t reranked;
+        for ( auto it = candidates.begin(); reranked.size() < rerank; ++it )
+          reranked.emplace( dist( query.data_.get(), it->second ), it->second );
+        local.distance_computations_ += reranked.size();
+        candidates = std::move( reranked );
+      }
+    }
+  }
+
+  std::vector< std::pair< double, id_t > > found;
+  found.reserve( candidates.size() );
+  {
+    // Queued changes are newer than the graph: removed hits are dropped and the unlinked tail is scanned.
+    // Without that scan, a hit whose update is queued is scored against the new vector instead, so the id
+    // stays searchable until the indexer links it.
+    std::lock_guard pending_lock( pending_mutex_ );
+    for ( const auto& [ distance, slot ] : candidates )
+    {
+      const auto id = slot_ids_[ slot ];
+      if ( const auto queued = to_be_inserted_.find( id ); queued != to_be_inserted_.end() )
+      {
+        if ( !params_.search_pending_ )
         {
-          entry_point_ = id;
-          break;
+          found.emplace_back( params_.distance_->compute( query, queued->second ), id );
+          ++local.distance_computations_;
         }
+        continue;
       }
+      if ( to_be_removed_.count( id ) )
+        continue;
+      found.emplace_back( distance, id );
+    }
+    if ( params_.search_pending_ )
+    {
+      const auto before = found.size();
+      for ( const auto& [ _id, vec ] : to_be_inserted_ )
+        if ( !accepts || accepts( _id ) )
+          found.emplace_back( params_.distance_->compute( query, vec ), _id );
+      local.distance_computations_ += found.size() - before;
     }
   }
-  for ( const auto& id : to_be_inserted_ )
+
+  queries_.fetch_add( 1, std::memory_order_relaxed );
+  distance_computations_.fetch_add( local.distance_computations_, std::memory_order_relaxed );
+  nodes_expanded_.fetch_add( local.nodes_expanded_, std::memory_order_relaxed );
+  visited_.fetch_add( local.visited_, std::memory_order_relaxed );
+  for ( size_t level = 0; level < local.hops_per_layer_.size(); ++level )
+    hops_per_layer_[ std::min( level, tracked_layers - 1 ) ].fetch_add( local.hops_per_layer_[ level ],
+                                                                         std::memory_order_relaxed );
+  stats.merge( local );
+
+  k = std::min< size_t >( k, found.size() );
+  std::partial_sort( found.begin(), found.begin() + k, found.end() );
+  found.resize( k );
+  return found;
+}
+
+namespace
+{
+void materialize( const collection& col, const std::vector< std::pair< double, id_t > >& found, vector< score_pair >& result )
+{
+  result.clear();
+  result.reserve( found.size() );
+  for ( const auto& [ distance, id ] : found )
   {
-    insert( id, col );
+    const auto curr_vector = col.get_vector_by_id( id );
+    if ( !curr_vector )
+      continue;
+    result.emplace_back( distance, id_vector{ id, std::make_unique< float_vector >( curr_vector.value() ) } );
   }
+}
+}  // namespace
 
-  to_be_removed_.clear();
-  to_be_inserted_.clear();
+void index::search_knn( const float_vector& query,
+                        const unsigned int k,
+                        vector< score_pair >& result,
+                        const search_params_t& search_params )
+{
+  std::shared_lock< std::shared_mutex > lock( mutex_ );
+  const auto col = collection_ptr_.lock();
+  if ( !col )
+    throw std::runtime_error( "Collection pointer expired during search" );
+
+  query_stats stats;
+  materialize( *col, search_ids( query, k, search_params, stats ), result );
+  if ( search_params.stats_ )
+    search_params.stats_->merge( stats );
 }
 
-void index::search_knn( const float_vector& query, unsigned int k, vector< score_pair >& result )
+void index::search_knn_batch( const std::vector< float_vector >& queries,
+                              const unsigned int k,
+                              std::vector< std::vector< score_pair > >& results,
+                              const search_params_t& search_params,
+                              unsigned int threads )
 {
   std::shared_lock< std::shared_mutex > lock( mutex_ );
   const auto col = collection_ptr_.lock();
   if ( !col )
     throw std::runtime_error( "Collection pointer expired during search" );
 
+  std::vector< std::vector< std::pair< double, id_t > > > found( queries.size() );
+  auto& pool = utils::thread_pool::shared();
+  if ( threads == 0 )
+    threads = pool.size() + 1;
+  threads = static_cast< unsigned int >( std::min< size_t >( threads, queries.size() ) );
+
+  // workers pull the next query off a shared counter, which keeps them busy when query costs vary
+  std::atomic< size_t > next{ 0 };
+  std::exception_ptr error;
+  std::mutex mutex;  // guards error and the caller's stats
+  const std::function< void() > work = [ & ]
   {
-    if ( !to_be_inserted_.empty() || !to_be_removed_.empty() )
+    query_stats stats;
+    try
     {
-      lock.unlock();
-      {
-        std::unique_lock< std::shared_mutex > uni_lock( mutex_ );
-        build( col );
-      }
-      lock.lock();
+      for ( size_t i = next++; i < queries.size(); i = next++ )
+        found[ i ] = search_ids( queries[ i ], k, search_params, stats );
+    }
+    catch ( ... )
+    {
+      std::lock_guard error_lock( mutex );
+      error = std::current_exception();
+    }
+    if ( search_params.stats_ )
+    {
+      std::lock_guard stats_lock( mutex );
+      search_params.stats_->merge( stats );
+    }
+  };
+  pool.run( threads > 0 ? threads - 1 : 0, work );
+  if ( error )
+    std::rethrow_exception( error );
+
+  // the vectors are copied out on this thread, which already holds the collection's locks
+  results.clear();
+  results.resize( queries.size() );
+  for ( size_t i = 0; i < queries.size(); ++i )
+    materialize( *col, found[ i ], results[ i ] );
+}
+
+bool index::search_for_top_k( const float_vector& query_vector,
+                              unsigned int k,
+                              std::vector< score_pair >& results,
+                              const search_params_t& search_params )
+{
+  search_knn( query_vector, k, results, search_params );
+  return true;
+}
+
+bool index::search_for_top_k_batch( const std::vector< float_vector >& queries,
+                                    const unsigned int k,
+                                    std::vector< std::vector< score_pair > >& results,
+                                    const search_params_t& search_params )
+{
+  search_knn_batch( queries, k, results, search_params );
+  return true;
+}
+
+void index::serialize( std::ostream& os ) const
+{
+  write_format_version( os, params::format_version );
+  params_.serialize( os );
+
+  std::shared_lock< std::shared_mutex > lock( mutex_ );
+  const auto slot_count = static_cast< uint32_t >( slot_ids_.size() );
+  os.write( reinterpret_cast< const char* >( &dim_ ), sizeof( dim_ ) );
+  os.write( reinterpret_cast< const char* >( &slot_count ), sizeof( slot_count ) );
+  os.write( reinterpret_cast< const char* >( &entry_point_ ), sizeof( entry_point_ ) );
+  os.write( reinterpret_cast< const char* >( &max_layer_ ), sizeof( max_layer_ ) );
+  os.write( reinterpret_cast< const char* >( slot_ids_.data() ), slot_ids_.size() * sizeof( id_t ) );
+  os.write( reinterpret_cast< const char* >( deleted_.data() ), deleted_.size() * sizeof( std::uint8_t ) );
+  os.write( reinterpret_cast< const char* >( data_.data() ), data_.size() * sizeof( float ) );
+  os.write( reinterpret_cast< const char* >( links0_.data() ), links0_.size() * sizeof( slot_t ) );
+  for ( const auto& levels : upper_links_ )
+  {
+    const auto level_count = static_cast< uint32_t >( levels.size() );
+    os.write( reinterpret_cast< const char* >( &level_count ), sizeof( level_count ) );
+    for ( const auto& nbs : levels )
+    {
+      const auto nb_count = static_cast< uint32_t >( nbs.size() );
+      os.write( reinterpret_cast< const char* >( &nb_count ), sizeof( nb_count ) );
+      os.write( reinterpret_cast< const char* >( nbs.data() ), nbs.size() * sizeof( slot_t ) );
     }
   }
-  result.clear();
-  if ( inserted_.empty() || k == 0 )
-    return;
-  k = std::min< unsigned int >( k, inserted_.size() );
 
-  // Search from the top layer down to layer 1
-  id_set ep{ entry_point_ };
-  for ( int lc = max_layer_; lc > 0; --lc )
+  // queued changes are stored as ids only, the collection saved alongside holds their current state
+  std::vector< id_t > pending_ids;
   {
-    ep = { search_layer( query, ep, 1, lc, col ).begin()->second };
+    std::lock_guard pending_lock( pending_mutex_ );
+    for ( const auto& [ _id, _ ] : to_be_inserted_ )
+      pending_ids.push_back( _id );
+    pending_ids.insert( pending_ids.end(), to_be_removed_.begin(), to_be_removed_.end() );
   }
-  auto candidates = search_layer( query, ep, std::max( k, params_.ef_search_ ), 0, col );
+  const auto pending_count = static_cast< uint32_t >( pending_ids.size() );
+  os.write( reinterpret_cast< const char* >( &pending_count ), sizeof( pending_count ) );
+  os.write( reinterpret_cast< const char* >( pending_ids.data() ), pending_ids.size() * sizeof( id_t ) );
 
-  result.reserve( k );
-  for ( auto [ distance, id ] : candidates )
+  if ( params_.quantizer_ == quantizer_type::sq8 )
   {
-    if ( result.size() >= k )
-      break;
-    const auto curr_vector = col->get_vector_by_id( id );
-    result.emplace_back( distance, id_vector{ id, std::make_unique< float_vector >( curr_vector.value() ) } );
+    sq8_.serialize( os );
+    os.write( reinterpret_cast< const char* >( codes_.data() ), codes_.size() * sizeof( std::uint8_t ) );
   }
 }
 
-bool index::search_for_top_k( const float_vector& query_vector, unsigned int k, std::vector< score_pair >& results )
+std::unique_ptr< index > index::deserialize( std::istream& is, wk_col_ptr _collection_ptr )
 {
-  search_knn( query_vector, k, results );
-  return true;
+  const auto version = read_format_version( is );
+  if ( version > params::format_version )
+    throw std::runtime_error( "Unsupported HNSW format version " + std::to_string( version ) );
+  auto idx = std::make_unique< index >( std::move( _collection_ptr ), params::deserialize( is, version ) );
+  // the params alone: init() builds the graph from the collection
+  if ( version == 0 )
+  {
+    if ( !is )
+      throw std::runtime_error( "Truncated HNSW graph" );
+    return idx;
+  }
+
+  uint32_t slot_count;
+  is.read( reinterpret_cast< char* >( &idx->dim_ ), sizeof( idx->dim_ ) );
+  is.read( reinterpret_cast< char* >( &slot_count ), sizeof( slot_count ) );
+  is.read( reinterpret_cast< char* >( &idx->entry_point_ ), sizeof( idx->entry_point_ ) );
+  is.read( reinterpret_cast< char* >( &idx->max_layer_ ), sizeof( idx->max_layer_ ) );
+
+  idx->slot_ids_.resize( slot_count );
+  idx->deleted_.resize( slot_count );
+  idx->data_.resize( static_cast< size_t >( slot_count ) * idx->dim_ );
+  idx->links0_.resize( static_cast< size_t >( slot_count ) * ( idx->params_.M0_ + 1 ) );
+  idx->upper_links_.resize( slot_count );
+  is.read( reinterpret_cast< char* >( idx->slot_ids_.data() ), idx->slot_ids_.size() * sizeof( id_t ) );
+  is.read( reinterpret_cast< char* >( idx->deleted_.data() ), idx->deleted_.size() * sizeof( std::uint8_t ) );
+  is.read( reinterpret_cast< char* >( idx->data_.data() ), idx->data_.size() * sizeof( float ) );
+  is.read( reinterpret_cast< char* >( idx->links0_.data() ), idx->links0_.size() * sizeof( slot_t ) );
+  for ( auto& levels : idx->upper_links_ )
+  {
+    uint32_t level_count;
+    is.read( reinterpret_cast< char* >( &level_count ), sizeof( level_count ) );
+    levels.resize( level_count );
+    for ( auto& nbs : levels )
+    {
+      uint32_t nb_count;
+      is.read( reinterpret_cast< char* >( &nb_count ), sizeof( nb_count ) );
+      nbs.resize( nb_count );
+      is.read( reinterpret_cast< char* >( nbs.data() ), nbs.size() * sizeof( slot_t ) );
+    }
+  }
+
+  uint32_t pending_count;
+  is.read( reinterpret_cast< char* >( &pending_count ), sizeof( pending_count ) );
+  idx->restored_pending_.resize( pending_count );
+  is.read( reinterpret_cast< char* >( idx->restored_pending_.data() ), pending_count * sizeof( id_t ) );
+
+  if ( idx->params_.quantizer_ == quantizer_type::sq8 )
+  {
+    idx->sq8_ = sq8_quantizer::deserialize( is );
+    idx->codes_.resize( idx->sq8_.trained() ? static_cast< size_t >( slot_count ) * idx->dim_ : 0 );
+    is.read( reinterpret_cast< char* >( idx->codes_.data() ), idx->codes_.size() * sizeof( std::uint8_t ) );
+  }
+  if ( !is )
+    throw std::runtime_error( "Truncated HNSW graph" );
+
+  for ( slot_t slot = 0; slot < slot_count; ++slot )
+  {
+    // deleted slots become reusable with the next repair()
+    if ( idx->deleted_[ slot ] )
+    {
+      ++idx->deleted_since_repair_;
+      continue;
+    }
+    idx->id_to_slot_[ idx->slot_ids_[ slot ] ] = slot;
+    ++idx->live_count_;
+  }
+  idx->restored_ = true;
+  return idx;
 }
 
 void index::on_vectors_added( const std::vector< id_t >& new_ids )
 {
-  unique_lock< shared_mutex > lock( mutex_ );
+  const auto col = collection_ptr_.lock();
+  if ( !col )
+    return;
+
+  // copy the vectors now, so the indexer never has to reach back into the collection
+  vector_map fetched;
   for ( auto _id : new_ids )
   {
-    if ( inserted_.count( _id ) )
-    {
-      to_be_removed_.insert( _id );
-    }
-    to_be_inserted_.insert( _id );
+    auto vec = col->get_vector_by_id( _id );
+    if ( !vec )
+      continue;
+    vec->metadata_.reset();
+    fetched.insert_or_assign( _id, std::move( vec.value() ) );
+  }
+
+  {
+    std::lock_guard pending_lock( pending_mutex_ );
+    for ( auto& [ _id, vec ] : fetched )
+      to_be_inserted_.insert_or_assign( _id, std::move( vec ) );
   }
+  pending_cv_.notify_one();
 }
 
 void index::on_vectors_removed( const std::vector< id_t >& removed_ids )
 {
-  unique_lock< shared_mutex > lock( mutex_ );
-  for ( auto _id : removed_ids )
   {
-    if ( to_be_inserted_.count( _id ) )
+    std::lock_guard pending_lock( pending_mutex_ );
+    for ( auto _id : removed_ids )
+    {
       to_be_inserted_.erase( _id );
-    else
       to_be_removed_.insert( _id );
+    }
   }
+  pending_cv_.notify_one();
 }
 
 }  // namespace vector_db::indices::hnsw
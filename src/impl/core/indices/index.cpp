@@ -4,10 +4,27 @@
 #include "core/indices/index.h"
 #include "core/indices/hnsw.h"
 #include "core/indices/ivfflat.h"
+#include "core/indices/ivfpq.h"
 
 namespace vector_db
 {
 
+void write_format_version( std::ostream& os, const std::uint32_t version )
+{
+  os.write( reinterpret_cast< const char* >( &format_tag ), sizeof( format_tag ) );
+  os.write( reinterpret_cast< const char* >( &version ), sizeof( version ) );
+}
+
+std::uint32_t read_format_version( std::istream& is )
+{
+  if ( is.peek() != format_tag )
+    return 0;
+  is.ignore( sizeof( format_tag ) );
+  std::uint32_t version = 0;
+  is.read( reinterpret_cast< char* >( &version ), sizeof( version ) );
+  return version;
+}
+
 std::unique_ptr< index_t > index_t::deserialize( std::istream& is, const std::weak_ptr< collection >& col_ptr )
 {
   index_type type;
@@ -15,15 +32,15 @@ std::unique_ptr< index_t > index_t::deserialize( std::istream& is, const std::we
 
   if ( type == index_type::hnsw )
   {
-    auto params = indices::hnsw::params::deserialize( is );
-    auto index = std::make_unique< indices::hnsw::index >( col_ptr, params );
-    return index;
+    return indices::hnsw::index::deserialize( is, col_ptr );
   }
   else if ( type == index_type::ivf_flat )
   {
-    auto params = indices::ivf_flat::params::deserialize( is );
-    auto index = std::make_unique< indices::ivf_flat::index >( col_ptr, params );
-    return index;
+    return indices::ivf_flat::index::deserialize( is, col_ptr );
+  }
+  else if ( type == index_type::ivf_pq )
+  {
+    return indices::ivf_pq::index::deserialize( is, col_ptr );
   }
 
   return nullptr;
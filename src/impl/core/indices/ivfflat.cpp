@@ -3,11 +3,17 @@
 //
 
 #include <algorithm>
-#include <queue>
+#include <atomic>
+#include <cmath>
+#include <string>
+#include <unordered_set>
 
 #include "core/collection.h"
+#include "core/indices/euclidean.h"
 #include "core/indices/ivfflat.h"
 #include "core/utils/k_means.h"
+#include "core/utils/thread_pool.h"
+#include "core/utils/util.h"
 
 namespace vector_db::indices::ivf_flat
 {
@@ -18,146 +24,964 @@ index::index( wk_col_ptr _collection_ptr, const params& _params )
 {
 }
 
-void index::init() { build(); }
+void index::init()
+{
+  if ( restored_ )
+  {
+    restored_ = false;
+    reconcile();
+    return;
+  }
+  build();
+}
 
-void index::build()
+index::~index()
 {
-  auto col = collection_ptr_.lock();
-  if ( !col )
+  std::thread rebuilder;
+  {
+    std::lock_guard lock( rebuilder_mutex_ );
+    rebuilder.swap( rebuilder_ );
+  }
+  if ( !rebuilder.joinable() )
     return;
+  // the rebuilder may hold the last reference to the collection, and so be the one destroying this index
+  if ( rebuilder.get_id() == std::this_thread::get_id() )
+    rebuilder.detach();
+  else
+    rebuilder.join();
+}
 
-  std::unique_lock lock( mutex_ );
-  clusters_.clear();
-  vectors_since_rebuild_ = 0;
+void index::build()
+{
+  if ( const auto col = collection_ptr_.lock() )
+    build( *col );
+}
 
-  auto all_ids = col->get_all_vector_ids();
-  if ( all_ids.empty() )
-    return;
+void index::build( const collection& col )
+{
+  std::lock_guard build_lock( build_mutex_ );
+  {
+    std::unique_lock lock( mutex_ );
+    replay_log_.emplace();
+  }
 
-  std::vector< float_vector > vectors;
+  // 1. Train new lists on a snapshot, the current lists keep serving meanwhile
+  // in id order: the collection's hash order changes from run to run, and the training with it
+  const auto id_set = col.get_all_vector_ids();
+  std::vector< id_t > all_ids( id_set.begin(), id_set.end() );
+  std::sort( all_ids.begin(), all_ids.end() );
+
+  // rows are packed contiguously for k-means
+  std::vector< float > rows;
   std::vector< id_t > ids;
+  int dim = 0;
   for ( auto id : all_ids )
   {
-    auto vec = col->get_vector_by_id( id );
+    auto vec = col.get_vector_by_id( id );
     if ( vec )
     {
-      vectors.push_back( std::move( *vec ) );
+      if ( dim == 0 )
+      {
+        dim = vec->dimension_;
+        rows.reserve( all_ids.size() * dim );
+      }
+      rows.insert( rows.end(), vec->data_.get(), vec->data_.get() + dim );
       ids.push_back( id );
     }
   }
 
-  if ( vectors.empty() )
-    return;
+  std::vector< cluster > clusters;
+  std::unordered_map< id_t, std::pair< uint32_t, size_t >, hash > locations, spills;
+  double trained_error = 0.0;
+  sq8_quantizer sq8;
+  if ( !ids.empty() && ids.size() >= min_training_size() )
+  {
+    if ( params_.quantizer_ == quantizer_type::sq8 )
+      sq8.train( rows.data(), ids.size(), dim );
 
-  auto km_res = k_means( vectors, params_.k_, params_.dist_type_ );
+    const size_t sample_size = static_cast< size_t >( params_.training_sample_ ) * params_.k_;
+    auto km_res = k_means( rows.data(),
+                           ids.size(),
+                           dim,
+                           params_.k_,
+                           params_.dist_type_,
+                           sample_size,
+                           100,
+                           42,
+                           0,
+                           params_.max_list_imbalance_ );
 
-  clusters_.reserve( km_res.centroids.size() );
-  for ( auto& c : km_res.centroids )
-  {
-    cluster new_cluster;
-    new_cluster.centroid = std::move( c.centroid );
-    for ( auto idx : c.vector_ids )
+    const auto euclidean = distance::get_distance_instance( distance::dist_type::euclidean );
+    clusters.resize( km_res.centroids.size() );
+    locations.reserve( ids.size() );
+    for ( size_t j = 0; j < clusters.size(); ++j )
+    {
+      auto& c = km_res.centroids[ j ];
+      clusters[ j ].centroid = std::move( c.centroid );
+      clusters[ j ].vector_ids.reserve( c.vector_ids.size() );
+      if ( sq8.trained() )
+        clusters[ j ].codes.reserve( c.vector_ids.size() * dim );
+      else
+        clusters[ j ].data.reserve( c.vector_ids.size() * dim );
+      for ( auto idx : c.vector_ids )
+      {
+        locations[ ids[ idx ] ] = { static_cast< uint32_t >( j ), clusters[ j ].vector_ids.size() };
+        clusters[ j ].append( ids[ idx ], rows.data() + idx * dim, dim, sq8.trained() ? &sq8 : nullptr );
+        clusters[ j ].radius = std::max(
+            clusters[ j ].radius, euclidean->compute( rows.data() + idx * dim, clusters[ j ].centroid.data_.get(), dim ) );
+      }
+    }
+
+    if ( params_.spill_ && clusters.size() > 1 )
     {
-      new_cluster.vector_ids.push_back( ids[ idx ] );
+      // every row's second list is picked against the final centroids, then the copies are listed
+      std::vector< size_t > primary( ids.size() ), secondary( ids.size() );
+      for ( size_t j = 0; j < clusters.size(); ++j )
+        for ( auto idx : km_res.centroids[ j ].vector_ids )
+          primary[ idx ] = j;
+      const auto dist_fn = distance::get_distance_instance( params_.dist_type_ );
+      utils::parallel_for( ids.size(),
+                           0,
+                           [ & ]( const size_t begin, const size_t end )
+                           {
+                             std::vector< std::pair< double, size_t > > nearest;
+                             for ( size_t i = begin; i < end; ++i )
+                             {
+                               const float* row = rows.data() + i * dim;
+                               nearest.clear();
+                               for ( size_t j = 0; j < clusters.size(); ++j )
+                                 if ( j != primary[ i ] )
+                                   nearest.emplace_back( dist_fn->compute( row, clusters[ j ].centroid.data_.get(), dim ), j );
+                               const size_t kept = std::min( spill_candidates, nearest.size() );
+                               std::partial_sort( nearest.begin(), nearest.begin() + kept, nearest.end() );
+                               nearest.resize( kept );
+                               secondary[ i ] = spill_target( row, clusters[ primary[ i ] ], nearest, clusters );
+                             }
+                           } );
+      spills.reserve( ids.size() );
+      for ( size_t i = 0; i < ids.size(); ++i )
+      {
+        auto& c = clusters[ secondary[ i ] ];
+        spills[ ids[ i ] ] = { static_cast< uint32_t >( secondary[ i ] ), c.vector_ids.size() };
+        c.append( ids[ i ], rows.data() + i * dim, dim, sq8.trained() ? &sq8 : nullptr );
+        ++c.spilled;
+        c.radius = std::max( c.radius, euclidean->compute( rows.data() + i * dim, c.centroid.data_.get(), dim ) );
+      }
     }
-    clusters_.push_back( std::move( new_cluster ) );
+    trained_error = km_res.distance_sum / ids.size();
+  }
+  auto graph = link_centroids( clusters, dim );
+
+  // 2. Swap them in and replay what changed since the snapshot, searches see either lists whole. The old
+  // lists are freed once the lock is released.
+  std::unique_lock lock( mutex_ );
+  clusters_.swap( clusters );
+  locations_.swap( locations );
+  spills_.swap( spills );
+  graph_ = std::move( graph );
+  sq8_ = std::move( sq8 );
+  dim_ = clusters_.empty() ? 0 : dim;
+  trained_error_ = trained_error;
+  vectors_since_rebuild_ = 0;
+  added_error_sum_ = 0.0;
+  added_count_ = 0;
+
+  const auto log = std::move( *replay_log_ );
+  replay_log_.reset();
+  for ( const auto& [ added, removed ] : log )
+  {
+    for ( const auto id : removed )
+      remove_listed( id );
+    apply_added( added );
   }
 }
 
-bool index::search_for_top_k( const float_vector& query_vector, unsigned int k, std::vector< score_pair >& results )
+size_t index::min_training_size() const
 {
+  return static_cast< size_t >( params_.k_ ) * min_points_per_centroid;
+}
+
+bool index::can_train()
+{
+  {
+    std::lock_guard lock( rebuilder_mutex_ );
+    if ( rebuild_running_ )
+      return false;
+  }
+  const auto col = collection_ptr_.lock();  // sized before locking, searches lock the collection first
+  return col && col->size() >= std::max< size_t >( min_training_size(), 1 );
+}
+
+void index::schedule_background( const bool rebuild )
+{
+  std::lock_guard lock( rebuilder_mutex_ );
+  if ( rebuild_running_ )
+  {
+    // a rebuild replays the latest changes too, a maintenance pass is followed by the rebuild
+    rebuild_pending_ = rebuild_pending_ || rebuild;
+    return;
+  }
+  if ( rebuilder_.joinable() )
+    rebuilder_.join();
+  rebuild_running_ = true;
+  rebuild_pending_ = false;
+  rebuilder_ = std::thread(
+      [ this, rebuild ]
+      {
+        const auto col = collection_ptr_.lock();  // released last, as it may own this index
+        for ( bool rebuilding = rebuild;; rebuilding = true )
+        {
+          if ( col && rebuilding )
+            build( *col );
+          else if ( col )
+            maintain();
+          std::lock_guard rebuilder_lock( rebuilder_mutex_ );
+          if ( rebuilding || !rebuild_pending_ )
+          {
+            rebuild_running_ = false;
+            rebuild_pending_ = false;
+            return;
+          }
+          rebuild_pending_ = false;
+        }
+      } );
+}
+
+bool index::needs_maintenance() const
+{
+  if ( params_.split_factor_ <= 0.0f && params_.merge_factor_ <= 0.0f )
+    return false;
   std::shared_lock lock( mutex_ );
   if ( clusters_.empty() )
     return false;
+  const double mean = static_cast< double >( locations_.size() + spills_.size() ) / clusters_.size();
+  return std::any_of( clusters_.begin(),
+                      clusters_.end(),
+                      [ & ]( const cluster& c )
+                      {
+                        const size_t size = c.vector_ids.size();
+                        return ( params_.split_factor_ > 0.0f && size > split_factor() * mean && size - c.spilled > 1 )
+                               || ( params_.merge_factor_ > 0.0f && size < merge_factor() * mean && clusters_.size() > 1 );
+                      } );
+}
+
+void index::maintain()
+{
+  // cluster indices only change under build_mutex_: they hold across the unlocked 2-means below
+  std::lock_guard build_lock( build_mutex_ );
+  bool changed = false;
+  int dim = 0;
+  // the caller holds mutex_
+  const auto outgrown = [ this ]( const size_t j )
+  {
+    const double mean = static_cast< double >( locations_.size() + spills_.size() ) / clusters_.size();
+    const auto& c = clusters_[ j ];
+    return c.vector_ids.size() > split_factor() * mean && c.vector_ids.size() - c.spilled > 1;
+  };
+  {
+    std::unique_lock lock( mutex_ );
+    if ( clusters_.empty() )
+      return;
+    dim = dim_;
+    const double mean = static_cast< double >( locations_.size() + spills_.size() ) / clusters_.size();
+
+    // 1. Tiny lists are dissolved, the last cluster taking the place of each
+    if ( params_.merge_factor_ > 0.0f )
+    {
+      for ( size_t j = 0; j < clusters_.size() && clusters_.size() > 1; )
+      {
+        if ( clusters_[ j ].vector_ids.size() >= merge_factor() * mean )
+        {
+          ++j;
+          continue;
+        }
+        dissolve( j );
+        lists_merged_.fetch_add( 1, std::memory_order_relaxed );
+        changed = true;
+      }
+    }
+  }
+
+  // 2. Oversized lists are split around the centroids of a 2-means over a copy of their members, searches and
+  // updates carrying on meanwhile. Every split lowers the mean, so the lists are checked again until none is too
+  // large, but for the ones whose members can't be told apart.
+  std::unordered_set< size_t > unsplittable;
+  for ( std::vector< size_t > oversized;; oversized.clear() )
+  {
+    {
+      std::shared_lock lock( mutex_ );
+      if ( params_.split_factor_ > 0.0f )
+        for ( size_t j = 0; j < clusters_.size(); ++j )
+          if ( outgrown( j ) && !unsplittable.count( j ) )
+            oversized.push_back( j );
+    }
+    if ( oversized.empty() )
+      break;
+
+    for ( const auto j : oversized )
+    {
+      std::vector< float > rows;
+      {
+        std::shared_lock lock( mutex_ );
+        const auto& c = clusters_[ j ];
+        rows.resize( c.vector_ids.size() * dim );
+        for ( size_t m = 0; m < c.vector_ids.size(); ++m )
+          c.member( m, dim, quantizer(), rows.data() + m * dim );
+      }
+      const auto halves = k_means( rows.data(), rows.size() / dim, dim, 2, params_.dist_type_, 0, 25, 42, 1 );
+      std::unique_lock lock( mutex_ );
+      if ( halves.centroids.size() < 2
+           || !split( j, halves.centroids[ 0 ].centroid.data_.get(), halves.centroids[ 1 ].centroid.data_.get() ) )
+      {
+        unsplittable.insert( j );
+        continue;
+      }
+      lists_split_.fetch_add( 1, std::memory_order_relaxed );
+      changed = true;
+    }
+  }
+
+  // 3. The graph can't drop nodes: it is relinked over the clusters as they are now
+  if ( changed && params_.coarse_ == coarse_quantizer::graph )
+  {
+    proximity_graph graph;
+    {
+      std::shared_lock lock( mutex_ );
+      graph = link_centroids( clusters_, dim );
+    }
+    std::unique_lock lock( mutex_ );
+    graph_ = std::move( graph );
+  }
+}
+
+void index::dissolve( const size_t cluster_idx )
+{
+  // 1. Take the members out
+  const auto* sq8 = quantizer();
+  auto& c = clusters_[ cluster_idx ];
+  std::vector< std::pair< id_t, std::vector< float > > > primaries, copies;
+  while ( !c.vector_ids.empty() )
+  {
+    const size_t m = c.vector_ids.size() - 1;
+    const auto id = c.vector_ids[ m ];
+    std::vector< float > vec( dim_ );
+    c.member( m, dim_, sq8, vec.data() );
+    ( is_primary( id, cluster_idx ) ? primaries : copies ).emplace_back( id, std::move( vec ) );
+    remove_member( cluster_idx, m );
+  }
+
+  // 2. Drop the cluster, the last one moving into its place
+  const size_t last = clusters_.size() - 1;
+  if ( cluster_idx != last )
+  {
+    clusters_[ cluster_idx ] = std::move( clusters_[ last ] );
+    for ( const auto id : clusters_[ cluster_idx ].vector_ids )
+      location( id, last ).first = static_cast< uint32_t >( cluster_idx );
+  }
+  clusters_.pop_back();
+
+  // 3. The members join the nearest list left, their spilled copies being picked anew where they have to
+  for ( const auto& [ id, vec ] : primaries )
+  {
+    const size_t target = nearest_clusters( vec.data(), 1 ).front().second;
+    if ( const auto copy = spills_.find( id ); copy != spills_.end() && copy->second.first == target )
+      remove_member( target, copy->second.second );
+    append_member( target, id, vec.data() );
+    update_centroid( clusters_[ target ], vec.data(), 1 );
+    if ( params_.spill_ && !spills_.count( id ) )
+      spill( id, vec.data(), target );
+  }
+  for ( const auto& [ id, vec ] : copies )
+    spill( id, vec.data(), locations_.at( id ).first );
+}
+
+bool index::split( const size_t cluster_idx, const float* a, const float* b )
+{
+  distance::ptr dist_fn = distance::get_distance_instance( params_.dist_type_ );
+  const auto* sq8 = quantizer();
+  std::vector< float > vec( dim_ );
+  const auto& c = clusters_[ cluster_idx ];
+  std::vector< bool > to_b( c.vector_ids.size() );
+  size_t primaries_a = 0, primaries_b = 0;
+  for ( size_t m = 0; m < c.vector_ids.size(); ++m )
+  {
+    c.member( m, dim_, sq8, vec.data() );
+    to_b[ m ] = dist_fn->compute( vec.data(), b, dim_ ) < dist_fn->compute( vec.data(), a, dim_ );
+    if ( is_primary( c.vector_ids[ m ], cluster_idx ) )
+      ++( to_b[ m ] ? primaries_b : primaries_a );
+  }
+  if ( primaries_a == 0 || primaries_b == 0 )
+    return false;
+
+  const size_t target = clusters_.size();
+  clusters_.emplace_back();
+  clusters_[ target ].centroid = float_vector( dim_, b );
+  // walking backwards, the members swapped into freed places were seen already and stay
+  for ( size_t m = to_b.size(); m-- > 0; )
+  {
+    if ( !to_b[ m ] )
+      continue;
+    const auto id = clusters_[ cluster_idx ].vector_ids[ m ];
+    const bool spilled = !is_primary( id, cluster_idx );
+    clusters_[ cluster_idx ].member( m, dim_, sq8, vec.data() );
+    remove_member( cluster_idx, m );
+    append_member( target, id, vec.data(), spilled );
+  }
+  refit( cluster_idx );
+  refit( target );
+  return true;
+}
+
+void index::refit( const size_t cluster_idx )
+{
+  auto& c = clusters_[ cluster_idx ];
+  const auto* sq8 = quantizer();
+  std::vector< float > vec( dim_ );
+  std::vector< double > sum( dim_, 0.0 );
+  size_t primaries = 0;
+  for ( size_t m = 0; m < c.vector_ids.size(); ++m )
+  {
+    if ( !is_primary( c.vector_ids[ m ], cluster_idx ) )
+      continue;
+    c.member( m, dim_, sq8, vec.data() );
+    for ( int d = 0; d < dim_; ++d )
+      sum[ d ] += vec[ d ];
+    ++primaries;
+  }
+  if ( primaries > 0 )
+    for ( int d = 0; d < dim_; ++d )
+      c.centroid.data_[ d ] = static_cast< float >( sum[ d ] / primaries );
+
+  const auto euclidean = distance::get_distance_instance( distance::dist_type::euclidean );
+  c.radius = 0.0;
+  for ( size_t m = 0; m < c.vector_ids.size(); ++m )
+  {
+    c.member( m, dim_, sq8, vec.data() );
+    c.radius = std::max( c.radius, euclidean->compute( vec.data(), c.centroid.data_.get(), dim_ ) );
+  }
+  c.added_since_check = 0;
+}
+
+void index::wait_for_rebuild()
+{
+  std::thread rebuilder;
+  {
+    std::lock_guard lock( rebuilder_mutex_ );
+    rebuilder.swap( rebuilder_ );
+  }
+  if ( rebuilder.joinable() )
+    rebuilder.join();
+}
+
+bool index::trained() const
+{
+  std::shared_lock lock( mutex_ );
+  return !clusters_.empty();
+}
 
+void index::reconcile()
+{
   auto col = collection_ptr_.lock();
   if ( !col )
-    return false;
+    return;
 
-  distance::ptr dist_fn = distance::get_distance_instance( params_.dist_type_ );
+  const auto all_ids = col->get_all_vector_ids();
+  std::vector< id_t > joined, left;
+  bool untrained;
+  {
+    std::shared_lock lock( mutex_ );
+    untrained = clusters_.empty();
+    for ( const auto& [ id, _ ] : locations_ )
+      if ( !all_ids.count( id ) )
+        left.push_back( id );
+    for ( const auto id : all_ids )
+      if ( !locations_.count( id ) )
+        joined.push_back( id );
+  }
 
-  // 1. Find the top n_probe clusters
-  using cluster_dist = std::pair< double, size_t >;
-  std::priority_queue< cluster_dist, std::vector< cluster_dist >, std::greater<> > pq_clusters;
+  if ( untrained )
+  {
+    build();
+    return;
+  }
+  remove_vectors_incremental( left );
+  add_vectors_incremental( joined );
+}
 
-  for ( size_t i = 0; i < clusters_.size(); ++i )
+void index::serialize( std::ostream& os ) const
+{
+  write_format_version( os, params::format_version );
+  params_.serialize( os );
+
+  std::shared_lock lock( mutex_ );
+  const int dim = dim_;
+  const auto cluster_count = static_cast< uint32_t >( clusters_.size() );
+  os.write( reinterpret_cast< const char* >( &dim ), sizeof( dim ) );
+  os.write( reinterpret_cast< const char* >( &cluster_count ), sizeof( cluster_count ) );
+  for ( const auto& c : clusters_ )
   {
-    double d = dist_fn->compute( query_vector, clusters_[ i ].centroid );
-    pq_clusters.push( { d, i } );
+    os.write( reinterpret_cast< const char* >( c.centroid.data_.get() ), dim * sizeof( float ) );
+    os.write( reinterpret_cast< const char* >( &c.radius ), sizeof( c.radius ) );
+    const auto id_count = static_cast< uint64_t >( c.vector_ids.size() );
+    os.write( reinterpret_cast< const char* >( &id_count ), sizeof( id_count ) );
+    os.write( reinterpret_cast< const char* >( c.vector_ids.data() ), c.vector_ids.size() * sizeof( id_t ) );
+    os.write( reinterpret_cast< const char* >( c.data.data() ), c.data.size() * sizeof( float ) );
+    os.write( reinterpret_cast< const char* >( c.codes.data() ), c.codes.size() );
   }
+  os.write( reinterpret_cast< const char* >( &vectors_since_rebuild_ ), sizeof( vectors_since_rebuild_ ) );
+  os.write( reinterpret_cast< const char* >( &trained_error_ ), sizeof( trained_error_ ) );
+  os.write( reinterpret_cast< const char* >( &added_error_sum_ ), sizeof( added_error_sum_ ) );
+  os.write( reinterpret_cast< const char* >( &added_count_ ), sizeof( added_count_ ) );
+  if ( params_.quantizer_ == quantizer_type::sq8 )
+    sq8_.serialize( os );
+  if ( params_.spill_ )
+  {
+    // the copies' positions follow from their lists, only which ones are copies has to be kept
+    const auto spill_count = static_cast< uint64_t >( spills_.size() );
+    os.write( reinterpret_cast< const char* >( &spill_count ), sizeof( spill_count ) );
+    for ( const auto& [ id, location ] : spills_ )
+    {
+      os.write( reinterpret_cast< const char* >( &id ), sizeof( id ) );
+      os.write( reinterpret_cast< const char* >( &location.first ), sizeof( location.first ) );
+    }
+  }
+}
 
-  // 2. Search within these clusters
-  std::priority_queue< score_pair, std::vector< score_pair >, std::less<> > pq_results;
-  unsigned int probes = std::min< unsigned int >( params_.n_probe_, pq_clusters.size() );
+std::unique_ptr< index > index::deserialize( std::istream& is, wk_col_ptr _collection_ptr )
+{
+  const auto version = read_format_version( is );
+  if ( version > params::format_version )
+    throw std::runtime_error( "Unsupported IVF format version " + std::to_string( version ) );
+  auto _index = std::make_unique< index >( std::move( _collection_ptr ), params::deserialize( is, version ) );
+  // the params alone: init() trains the lists on the collection
+  if ( version == 0 )
+  {
+    if ( !is )
+      throw std::runtime_error( "Truncated IVF index" );
+    return _index;
+  }
 
-  for ( unsigned int i = 0; i < probes; ++i )
+  int dim;
+  uint32_t cluster_count;
+  is.read( reinterpret_cast< char* >( &dim ), sizeof( dim ) );
+  is.read( reinterpret_cast< char* >( &cluster_count ), sizeof( cluster_count ) );
+  if ( !is )
+    throw std::runtime_error( "Truncated IVF index" );
+  _index->dim_ = dim;
+  const bool coded = _index->params_.quantizer_ == quantizer_type::sq8;
+  _index->clusters_.resize( cluster_count );
+  std::vector< float > centroid( dim );
+  for ( auto& c : _index->clusters_ )
+  {
+    is.read( reinterpret_cast< char* >( centroid.data() ), dim * sizeof( float ) );
+    c.centroid = float_vector( dim, centroid.data() );
+    is.read( reinterpret_cast< char* >( &c.radius ), sizeof( c.radius ) );
+    uint64_t id_count;
+    is.read( reinterpret_cast< char* >( &id_count ), sizeof( id_count ) );
+    if ( !is )
+      throw std::runtime_error( "Truncated IVF index" );
+    c.vector_ids.resize( id_count );
+    is.read( reinterpret_cast< char* >( c.vector_ids.data() ), id_count * sizeof( id_t ) );
+    // an untrained sq8 index has no members to code
+    c.data.resize( coded ? 0 : id_count * dim );
+    c.codes.resize( coded ? id_count * dim : 0 );
+    is.read( reinterpret_cast< char* >( c.data.data() ), c.data.size() * sizeof( float ) );
+    is.read( reinterpret_cast< char* >( c.codes.data() ), c.codes.size() );
+  }
+  _index->graph_ = _index->link_centroids( _index->clusters_, dim );
+  is.read( reinterpret_cast< char* >( &_index->vectors_since_rebuild_ ), sizeof( _index->vectors_since_rebuild_ ) );
+  is.read( reinterpret_cast< char* >( &_index->trained_error_ ), sizeof( _index->trained_error_ ) );
+  is.read( reinterpret_cast< char* >( &_index->added_error_sum_ ), sizeof( _index->added_error_sum_ ) );
+  is.read( reinterpret_cast< char* >( &_index->added_count_ ), sizeof( _index->added_count_ ) );
+  if ( coded )
+    _index->sq8_ = sq8_quantizer::deserialize( is );
+  std::unordered_map< id_t, uint32_t, hash > spilled_to;
+  if ( _index->params_.spill_ )
   {
-    size_t cluster_idx = pq_clusters.top().second;
-    pq_clusters.pop();
+    uint64_t spill_count = 0;
+    is.read( reinterpret_cast< char* >( &spill_count ), sizeof( spill_count ) );
+    if ( !is )
+      throw std::runtime_error( "Truncated IVF index" );
+    spilled_to.reserve( spill_count );
+    for ( uint64_t i = 0; i < spill_count; ++i )
+    {
+      id_t id;
+      uint32_t cluster_idx;
+      is.read( reinterpret_cast< char* >( &id ), sizeof( id ) );
+      is.read( reinterpret_cast< char* >( &cluster_idx ), sizeof( cluster_idx ) );
+      spilled_to[ id ] = cluster_idx;
+    }
+  }
+  if ( !is )
+    throw std::runtime_error( "Truncated IVF index" );
 
-    for ( auto id : clusters_[ cluster_idx ].vector_ids )
+  for ( uint32_t j = 0; j < cluster_count; ++j )
+  {
+    auto& c = _index->clusters_[ j ];
+    for ( size_t m = 0; m < c.vector_ids.size(); ++m )
     {
-      auto vec = col->get_vector_by_id( id );
-      if ( vec )
+      const auto it = spilled_to.find( c.vector_ids[ m ] );
+      if ( it != spilled_to.end() && it->second == j )
       {
-        double d = dist_fn->compute( query_vector, *vec );
-        pq_results.emplace( d, id_vector{ id, std::make_unique< float_vector >( std::move( *vec ) ) } );
-        if ( pq_results.size() > k )
-          pq_results.pop();
+        _index->spills_[ c.vector_ids[ m ] ] = { j, m };
+        ++c.spilled;
       }
+      else
+        _index->locations_[ c.vector_ids[ m ] ] = { j, m };
     }
   }
 
-  results.clear();
-  while ( !pq_results.empty() )
+  _index->restored_ = true;
+  return _index;
+}
+
+std::unique_ptr< stats_t > index::get_stats() const
+{
+  auto _stats = std::make_unique< stats >();
+  _stats->queries_ = queries_.load( std::memory_order_relaxed );
+  _stats->totals_.distance_computations_ = distance_computations_.load( std::memory_order_relaxed );
+  _stats->totals_.lists_probed_ = lists_probed_.load( std::memory_order_relaxed );
+  _stats->lists_split_ = lists_split_.load( std::memory_order_relaxed );
+  _stats->lists_merged_ = lists_merged_.load( std::memory_order_relaxed );
+
+  std::shared_lock lock( mutex_ );
+  _stats->list_count_ = clusters_.size();
+  for ( const auto& c : clusters_ )
   {
-    results.push_back( std::move( const_cast< score_pair& >( pq_results.top() ) ) );
-    pq_results.pop();
+    const size_t size = c.vector_ids.size();
+    _stats->vector_count_ += size;
+    _stats->largest_list_ = std::max( _stats->largest_list_, size );
+    size_t bucket = 0;
+    while ( ( size_t{ 1 } << bucket ) <= size )
+      ++bucket;
+    if ( _stats->list_size_histogram_.size() <= bucket )
+      _stats->list_size_histogram_.resize( bucket + 1, 0 );
+    ++_stats->list_size_histogram_[ bucket ];
   }
-  std::reverse( results.begin(), results.end() );
-
-  return !results.empty();
+  return _stats;
 }
 
-void index::on_vectors_added( const std::vector< id_t >& new_ids )
+bool index::search_for_top_k( const float_vector& query_vector,
+                              unsigned int k,
+                              std::vector< score_pair >& results,
+                              const search_params_t& search_params )
 {
+  std::shared_lock lock( mutex_ );
   if ( clusters_.empty() )
   {
-    build();
-    return;
+    // too few vectors to train on yet
+    lock.unlock();
+    return euclidean::index( collection_ptr_, params_.dist_type_ ).search_for_top_k( query_vector, k, results, search_params );
   }
 
-  vectors_since_rebuild_ += new_ids.size();
-  if ( vectors_since_rebuild_ >= params_.rebuild_threshold_ )
+  auto col = collection_ptr_.lock();
+  if ( !col )
+    return false;
+
+  distance::ptr dist_fn = distance::get_distance_instance( params_.dist_type_ );
+
+  // 1. Rank the clusters by centroid distance. The flat scan scores every centroid, and orders them lazily,
+  // n_probe at a time. The graph only returns its best coarse_ef_ candidates, in order.
+  const unsigned int n_probe = search_params.n_probe_.value_or( params_.n_probe_ );
+  const size_t distance = search_params.prefetch_distance_.value_or( params_.prefetch_distance_ );
+  std::vector< std::pair< double, size_t > > ranked;
+  size_t sorted = 0;  // ranked[0, sorted) is in order
+  uint64_t coarse_computations = 0;
+  if ( graph_ready() )
   {
-    build();
+    const size_t ef = std::max< size_t >( params_.coarse_ef_, n_probe );
+    for ( const auto& [ d, j ] : graph_.search( query_vector.data_.get(), ef, ef, centroid_point(), coarse_computations ) )
+      ranked.emplace_back( d, j );
+    sorted = ranked.size();
   }
   else
   {
-    add_vectors_incremental( new_ids );
+    const size_t centroid_bytes = query_vector.dimension_ * sizeof( float );
+    for ( size_t i = 0; i < std::min( distance, clusters_.size() ); ++i )
+      utils::prefetch( clusters_[ i ].centroid.data_.get(), centroid_bytes );
+    ranked.resize( clusters_.size() );
+    for ( size_t i = 0; i < clusters_.size(); ++i )
+    {
+      if ( distance > 0 && i + distance < clusters_.size() )
+        utils::prefetch( clusters_[ i + distance ].centroid.data_.get(), centroid_bytes );
+      ranked[ i ] = { dist_fn->compute( query_vector, clusters_[ i ].centroid ), i };
+    }
+    coarse_computations = clusters_.size();
+  }
+
+  // 2. Stream through the probed lists, keeping the best `candidates` (distance, id) in a max-heap. With
+  // sq8 the distances are asymmetric ones, between the query and the codes.
+  const float rerank_factor = search_params.rerank_factor_.value_or( params_.rerank_factor_ );
+  const size_t candidates
+      = rerank_factor > 0.0f ? std::max< size_t >( k, static_cast< size_t >( std::ceil( k * rerank_factor ) ) ) : k;
+  // a spilled vector is scanned in both its lists, with the same distance: the second time it is dropped. The
+  // ids a heap holds are then kept in a set next to it.
+  const bool dedupe = !spills_.empty();
+  struct heap_t
+  {
+    std::vector< std::pair< double, id_t > > entries;
+    std::unordered_set< id_t, hash > ids;  // with dedupe only
+  };
+  const auto make_heap = [ candidates, dedupe ]
+  {
+    heap_t heap;
+    heap.entries.reserve( candidates + 1 );
+    if ( dedupe )
+      heap.ids.reserve( candidates + 1 );
+    return heap;
+  };
+  heap_t top = make_heap();
+  const auto offer = [ candidates, dedupe ]( heap_t& heap, const double d, const id_t id )
+  {
+    auto& entries = heap.entries;
+    const bool fits = entries.size() < candidates;
+    if ( !fits && !( std::make_pair( d, id ) < entries.front() ) )
+      return;
+    if ( dedupe && !heap.ids.insert( id ).second )
+      return;
+    if ( fits )
+    {
+      entries.emplace_back( d, id );
+      std::push_heap( entries.begin(), entries.end() );
+      return;
+    }
+    std::pop_heap( entries.begin(), entries.end() );
+    if ( dedupe )
+      heap.ids.erase( entries.back().second );
+    entries.back() = { d, id };
+    std::push_heap( entries.begin(), entries.end() );
+  };
+  const auto* sq8 = quantizer();
+  const size_t row_bytes = dim_ * ( sq8 ? sizeof( std::uint8_t ) : sizeof( float ) );
+  const auto row_address = [ & ]( const cluster& c, const size_t m ) -> const void*
+  { return sq8 ? static_cast< const void* >( c.code( m, dim_ ) ) : c.row( m, dim_ ); };
+  // scans `c` into `heap`, the head of `following` (if any) loading meanwhile
+  const auto scan = [ & ]( const cluster& c, const cluster* following, heap_t& heap )
+  {
+    if ( distance > 0 && following )
+      utils::prefetch( row_address( *following, 0 ), std::min( following->vector_ids.size(), distance ) * row_bytes );
+    const size_t size = c.vector_ids.size();
+    for ( size_t m = 0; m < size; ++m )
+    {
+      if ( distance > 0 && m + distance < size )
+        utils::prefetch( row_address( c, m + distance ), row_bytes );
+      const auto id = c.vector_ids[ m ];
+      if ( search_params.accepts_ && !search_params.accepts_( id ) )
+        continue;
+      offer( heap,
+             sq8 ? sq8->distance( params_.dist_type_, query_vector.data_.get(), c.code( m, dim_ ) )
+                 : dist_fn->compute( query_vector.data_.get(), c.row( m, dim_ ), dim_ ),
+             id );
+    }
+  };
+  const unsigned int probes = std::min< size_t >( n_probe, ranked.size() );
+
+  // Adaptive probing: a member of a list is at least (centroid distance - radius) away from the query, by the
+  // triangle inequality. Once the k-th best is closer than that, the list can be skipped, and once it is closer
+  // than (centroid distance - largest radius), so can every list after it.
+  const bool bounded = params_.adaptive_probe_ && params_.dist_type_ == distance::dist_type::euclidean;
+  double max_radius = 0.0;
+  if ( bounded )
+    for ( const auto& c : clusters_ )
+      max_radius = std::max( max_radius, c.radius );
+  const size_t budget = params_.probe_budget_;
+  size_t scanned = 0;
+  unsigned int probed = 0;
+  size_t next = 0;  // in ranked
+  // the next cluster in centroid order, ranked being ordered a chunk of probes at a time
+  const auto next_ranked = [ & ]()
+  {
+    if ( next == sorted )
+    {
+      const size_t end = std::min( ranked.size(), sorted + probes );
+      std::partial_sort( ranked.begin() + sorted, ranked.begin() + end, ranked.end() );
+      sorted = end;
+    }
+    return ranked[ next++ ];
+  };
+  const auto following = [ & ]() { return next < sorted ? &clusters_[ ranked[ next ].second ] : nullptr; };
+
+  if ( bounded )
+  {
+    while ( probed < probes && candidates > 0 && next < ranked.size() )
+    {
+      if ( budget > 0 && scanned >= budget )
+        break;
+      const auto [ centroid_dist, cluster_idx ] = next_ranked();
+      const auto& c = clusters_[ cluster_idx ];
+      if ( top.entries.size() == candidates )
+      {
+        if ( centroid_dist - max_radius > top.entries.front().first )
+          break;
+        if ( centroid_dist - c.radius > top.entries.front().first )
+          continue;
+      }
+      ++probed;
+      scanned += c.vector_ids.size();
+      scan( c, probed < probes ? following() : nullptr, top );
+    }
+  }
+  else
+  {
+    // the lists are known upfront, and split across threads when there is enough to scan
+    std::vector< const cluster* > lists;
+    while ( lists.size() < probes && candidates > 0 && next < ranked.size() && ( budget == 0 || scanned < budget ) )
+    {
+      lists.push_back( &clusters_[ next_ranked().second ] );
+      scanned += lists.back()->vector_ids.size();
+    }
+    probed = static_cast< unsigned int >( lists.size() );
+
+    // the helpers come from the shared pool, so concurrent queries together never scan on more threads than it has
+    auto& pool = utils::thread_pool::shared();
+    unsigned int threads = 1;
+    if ( params_.parallel_scan_threshold_ > 0 && scanned >= params_.parallel_scan_threshold_ )
+      threads = params_.scan_threads_ > 0 ? params_.scan_threads_ : pool.size() + 1;
+    threads = static_cast< unsigned int >( std::min< size_t >( threads, lists.size() ) );
+    if ( threads <= 1 )
+    {
+      for ( size_t i = 0; i < lists.size(); ++i )
+        scan( *lists[ i ], i + 1 < lists.size() ? lists[ i + 1 ] : nullptr, top );
+    }
+    else
+    {
+      // every thread claims lists one at a time into a heap of its own, merged into top once it runs out
+      std::atomic< size_t > claimed{ 0 };
+      std::mutex merge_mutex;
+      const std::function< void() > work = [ & ]
+      {
+        heap_t local = make_heap();
+        for ( size_t i = claimed++; i < lists.size(); i = claimed++ )
+          scan( *lists[ i ], nullptr, local );
+        std::lock_guard merge_lock( merge_mutex );
+        for ( const auto& [ d, id ] : local.entries )
+          offer( top, d, id );
+      };
+      pool.run( threads - 1, work );
+    }
+  }
+  std::sort_heap( top.entries.begin(), top.entries.end() );
+  const uint64_t computations = coarse_computations + scanned + ( rerank_factor > 0.0f ? top.entries.size() : 0 );
+  queries_.fetch_add( 1, std::memory_order_relaxed );
+  distance_computations_.fetch_add( computations, std::memory_order_relaxed );
+  lists_probed_.fetch_add( probed, std::memory_order_relaxed );
+  if ( search_params.stats_ )
+  {
+    search_params.stats_->distance_computations_ += computations;
+    search_params.stats_->lists_probed_ += probed;
+  }
+
+  // only the winners are copied out of the collection, re-ranked on the full vectors if asked for
+  results.clear();
+  results.reserve( top.entries.size() );
+  for ( const auto& [ d, id ] : top.entries )
+  {
+    auto vec = col->get_vector_by_id( id );
+    if ( vec )
+    {
+      const double score = rerank_factor > 0.0f ? dist_fn->compute( query_vector, *vec ) : d;
+      results.emplace_back( score, id_vector{ id, std::make_unique< float_vector >( std::move( *vec ) ) } );
+    }
   }
+  if ( rerank_factor > 0.0f )
+  {
+    std::sort( results.begin(),
+               results.end(),
+               []( const score_pair& a, const score_pair& b ) { return a.first < b.first; } );
+    if ( results.size() > k )
+      results.erase( results.begin() + k, results.end() );
+  }
+
+  return !results.empty();
 }
 
-void index::on_vectors_removed( const std::vector< id_t >& removed_ids )
+void index::on_vectors_added( const std::vector< id_t >& new_ids )
 {
-  if ( clusters_.empty() )
+  add_vectors_incremental( new_ids );
+  if ( !trained() )
   {
+    if ( can_train() )
+      schedule_rebuild();
     return;
   }
 
-  vectors_since_rebuild_ += removed_ids.size();
-  if ( vectors_since_rebuild_ >= params_.rebuild_threshold_ )
-  {
-    build();
-  }
-  else
+  if ( drifted( new_ids.size() ) )
+    schedule_rebuild();
+  else if ( needs_maintenance() )
+    schedule_background( false );
+}
+
+void index::on_vectors_removed( const std::vector< id_t >& removed_ids )
+{
+  remove_vectors_incremental( removed_ids );
+  if ( !trained() )
+    return;
+
+  if ( drifted( removed_ids.size() ) )
+    schedule_rebuild();
+  else if ( needs_maintenance() )
+    schedule_background( false );
+}
+
+bool index::drifted( const size_t changes )
+{
+  std::unique_lock lock( mutex_ );
+  vectors_since_rebuild_ += changes;
+  if ( vectors_since_rebuild_ < params_.rebuild_threshold_ )
+    return false;
+
+  // each window of changes is judged on its own
+  const bool drifted = added_count_ > 0
+                       && added_error_sum_ / added_count_
+                              > trained_error_ + std::abs( trained_error_ ) * params_.drift_threshold_;
+  vectors_since_rebuild_ = 0;
+  added_error_sum_ = 0.0;
+  added_count_ = 0;
+  return drifted || params_.drift_threshold_ <= 0.0f;
+}
+
+proximity_graph index::link_centroids( const std::vector< cluster >& clusters, const int dim ) const
+{
+  if ( params_.coarse_ != coarse_quantizer::graph )
+    return {};
+  proximity_graph graph( params_.dist_type_, dim );
+  const auto point = [ & ]( const uint32_t j ) { return static_cast< const float* >( clusters[ j ].centroid.data_.get() ); };
+  for ( size_t j = 0; j < clusters.size(); ++j )
+    graph.insert( point );
+  return graph;
+}
+
+std::vector< std::pair< double, size_t > > index::nearest_clusters( const float* vec, const size_t count ) const
+{
+  std::vector< std::pair< double, size_t > > nearest;
+  if ( graph_ready() )
   {
-    remove_vectors_incremental( removed_ids );
+    uint64_t computations = 0;
+    for ( const auto& [ d, j ] :
+          graph_.search( vec, count, std::max< size_t >( params_.coarse_ef_, count ), centroid_point(), computations ) )
+      nearest.emplace_back( d, j );
+    return nearest;
   }
+
+  distance::ptr dist_fn = distance::get_distance_instance( params_.dist_type_ );
+  nearest.reserve( clusters_.size() );
+  for ( size_t j = 0; j < clusters_.size(); ++j )
+    nearest.emplace_back( dist_fn->compute( vec, clusters_[ j ].centroid.data_.get(), dim_ ), j );
+  const size_t kept = std::min( count, nearest.size() );
+  std::partial_sort( nearest.begin(), nearest.begin() + kept, nearest.end() );
+  nearest.resize( kept );
+  return nearest;
 }
 
-size_t index::find_nearest_cluster( const float_vector& vec ) const
+std::pair< size_t, double > index::find_nearest_cluster( const float_vector& vec ) const
 {
+  if ( graph_ready() )
+  {
+    const auto nearest = nearest_clusters( vec.data_.get(), 1 );
+    if ( !nearest.empty() )
+      return { nearest.front().second, nearest.front().first };
+  }
+
   distance::ptr dist_fn = distance::get_distance_instance( params_.dist_type_ );
   size_t nearest_idx = 0;
   double min_dist = std::numeric_limits< double >::max();
@@ -172,7 +996,7 @@ size_t index::find_nearest_cluster( const float_vector& vec ) const
     }
   }
 
-  return nearest_idx;
+  return { nearest_idx, min_dist };
 }
 
 void index::add_vectors_incremental( const std::vector< id_t >& new_ids )
@@ -180,36 +1004,255 @@ void index::add_vectors_incremental( const std::vector< id_t >& new_ids )
   auto col = collection_ptr_.lock();
   if ( !col )
     return;
+  {
+    // untrained and no build to log for: a build started later snapshots these vectors
+    std::shared_lock lock( mutex_ );
+    if ( clusters_.empty() && !replay_log_ )
+      return;
+  }
+
+  // copied before locking, searches lock the collection first
+  std::vector< std::pair< id_t, float_vector > > vectors;
+  vectors.reserve( new_ids.size() );
+  for ( auto id : new_ids )
+    if ( auto vec = col->get_vector_by_id( id ); vec )
+      vectors.emplace_back( id, std::move( *vec ) );
 
   std::unique_lock lock( mutex_ );
+  if ( replay_log_ )
+    replay_log_->push_back( { vectors, {} } );
+  apply_added( vectors );
+}
 
-  for ( auto id : new_ids )
+void index::apply_added( const std::vector< std::pair< id_t, float_vector > >& vectors )
+{
+  if ( clusters_.empty() )
+    return;
+
+  std::vector< size_t > affected;
+  for ( const auto& [ id, vec ] : vectors )
   {
-    auto vec = col->get_vector_by_id( id );
-    if ( vec )
-    {
-      size_t cluster_idx = find_nearest_cluster( *vec );
-      clusters_[ cluster_idx ].vector_ids.push_back( id );
-    }
+    remove_listed( id );
+    if ( vec.dimension_ != dim_ )
+      continue;
+    const auto [ cluster_idx, d ] = find_nearest_cluster( vec );
+    append_member( cluster_idx, id, vec.data_.get() );
+    auto& c = clusters_[ cluster_idx ];
+    update_centroid( c, vec.data_.get(), 1 );
+    if ( c.added_since_check++ == 0 )
+      affected.push_back( cluster_idx );
+    if ( params_.spill_ )
+      spill( id, vec.data_.get(), cluster_idx );
+    added_error_sum_ += d;
+    ++added_count_;
+  }
+
+  // the centroids moved: members of the clusters that grew enough may now belong to a neighbour
+  for ( const auto cluster_idx : affected )
+  {
+    auto& c = clusters_[ cluster_idx ];
+    if ( c.added_since_check >= reassign_fraction * ( c.vector_ids.size() - c.spilled ) )
+      reassign( cluster_idx );
   }
 }
 
-void index::remove_vectors_incremental( const std::vector< id_t >& removed_ids )
+void index::update_centroid( cluster& c, const float* vec, const int sign )
 {
-  std::unique_lock lock( mutex_ );
+  // running mean over the members, vec being already (still) counted in vector_ids. Spilled copies don't count.
+  const auto n = static_cast< double >( c.vector_ids.size() - c.spilled );
+  if ( sign < 0 && n <= 1 )
+  {
+    if ( c.spilled == 0 )
+      c.radius = 0.0;
+    return;  // the last member leaves: the centroid stays put for future vectors
+  }
+  const double rate = sign > 0 ? 1.0 / n : -1.0 / ( n - 1 );
+  // the centroid moves by |rate| * |vec - centroid|, and so at most does any member's distance to it
+  const double offset = distance::get_distance_instance( distance::dist_type::euclidean )
+                            ->compute( vec, c.centroid.data_.get(), c.centroid.dimension_ );
+  for ( int d = 0; d < c.centroid.dimension_; ++d )
+    c.centroid.data_[ d ] += static_cast< float >( rate * ( vec[ d ] - c.centroid.data_[ d ] ) );
+  if ( sign > 0 )
+    c.radius = n == 1 && c.spilled == 0 ? 0.0 : std::max( c.radius + rate * offset, ( 1.0 - rate ) * offset );
+  else
+    c.radius -= rate * offset;
+}
 
-  for ( auto id : removed_ids )
+void index::reassign( const size_t cluster_idx )
+{
+  distance::ptr dist_fn = distance::get_distance_instance( params_.dist_type_ );
+  auto& c = clusters_[ cluster_idx ];
+  c.added_since_check = 0;
+
+  auto neighbours = nearest_clusters( c.centroid.data_.get(), reassign_candidates + 1 );
+  neighbours.erase( std::remove_if( neighbours.begin(),
+                                    neighbours.end(),
+                                    [ & ]( const auto& neighbour ) { return neighbour.second == cluster_idx; } ),
+                    neighbours.end() );
+  if ( neighbours.size() > reassign_candidates )
+    neighbours.resize( reassign_candidates );
+
+  const auto* sq8 = quantizer();
+  std::vector< float > vec( dim_ );
+  for ( size_t m = 0; m < c.vector_ids.size(); )
   {
-    for ( auto& cluster : clusters_ )
+    const auto id = c.vector_ids[ m ];
+    if ( c.spilled > 0 && !is_primary( id, cluster_idx ) )
     {
-      auto it = std::find( cluster.vector_ids.begin(), cluster.vector_ids.end(), id );
-      if ( it != cluster.vector_ids.end() )
+      ++m;  // a spilled copy stays where it was picked to be
+      continue;
+    }
+    c.member( m, dim_, sq8, vec.data() );
+    const float* row = vec.data();
+    double best_dist = dist_fn->compute( row, c.centroid.data_.get(), dim_ );
+    size_t best = cluster_idx;
+    for ( const auto& [ _, j ] : neighbours )
+    {
+      const double d = dist_fn->compute( row, clusters_[ j ].centroid.data_.get(), dim_ );
+      if ( d < best_dist )
       {
-        cluster.vector_ids.erase( it );
-        break;
+        best_dist = d;
+        best = j;
       }
     }
+    if ( best == cluster_idx || c.vector_ids.size() - c.spilled == 1 )
+    {
+      ++m;
+      continue;
+    }
+
+    update_centroid( c, vec.data(), -1 );
+    remove_member( cluster_idx, m );
+    // the vector now lives where its copy was: the copy goes, and a new one is picked
+    const auto copy = spills_.find( id );
+    const bool respill = copy != spills_.end() && copy->second.first == best;
+    if ( respill )
+      remove_member( best, copy->second.second );
+    append_member( best, id, vec.data() );
+    update_centroid( clusters_[ best ], vec.data(), 1 );
+    if ( respill )
+      spill( id, vec.data(), best );
   }
+
+  // the bound only grows as the centroid moves, the members just went through tighten it again
+  const auto euclidean = distance::get_distance_instance( distance::dist_type::euclidean );
+  c.radius = 0.0;
+  for ( size_t m = 0; m < c.vector_ids.size(); ++m )
+  {
+    c.member( m, dim_, sq8, vec.data() );
+    c.radius = std::max( c.radius, euclidean->compute( vec.data(), c.centroid.data_.get(), dim_ ) );
+  }
+}
+
+void index::append_member( const size_t cluster_idx, const id_t id, const float* vec, const bool spilled )
+{
+  auto& c = clusters_[ cluster_idx ];
+  ( spilled ? spills_ : locations_ )[ id ] = { static_cast< uint32_t >( cluster_idx ), c.vector_ids.size() };
+  c.append( id, vec, dim_, quantizer() );
+  if ( spilled )
+    ++c.spilled;
+}
+
+void index::remove_member( const size_t cluster_idx, const size_t m )
+{
+  auto& c = clusters_[ cluster_idx ];
+  const auto id = c.vector_ids[ m ];
+  if ( is_primary( id, cluster_idx ) )
+    locations_.erase( id );
+  else
+  {
+    spills_.erase( id );
+    --c.spilled;
+  }
+  c.swap_remove( m, dim_ );
+  if ( m < c.vector_ids.size() )
+    location( c.vector_ids[ m ], cluster_idx ).second = m;
+}
+
+std::pair< uint32_t, size_t >& index::location( const id_t id, const size_t cluster_idx )
+{
+  // an id is listed at most once per cluster, as its primary member or as a spilled copy
+  const auto it = locations_.find( id );
+  return it != locations_.end() && it->second.first == cluster_idx ? it->second : spills_.at( id );
+}
+
+void index::remove_listed( const id_t id )
+{
+  const auto it = locations_.find( id );
+  if ( it == locations_.end() )
+    return;
+  const auto [ cluster_idx, m ] = it->second;
+  auto& c = clusters_[ cluster_idx ];
+  std::vector< float > vec( dim_ );
+  c.member( m, dim_, quantizer(), vec.data() );
+  update_centroid( c, vec.data(), -1 );
+  remove_member( cluster_idx, m );
+  if ( const auto spill = spills_.find( id ); spill != spills_.end() )
+    remove_member( spill->second.first, spill->second.second );
+}
+
+size_t index::spill_target( const float* vec,
+                            const cluster& primary,
+                            const std::vector< std::pair< double, size_t > >& candidates,
+                            const std::vector< cluster >& clusters ) const
+{
+  const int dim = primary.centroid.dimension_;
+  std::vector< float > residual( dim );
+  double residual_norm = 0.0;
+  for ( int d = 0; d < dim; ++d )
+  {
+    residual[ d ] = vec[ d ] - primary.centroid.data_[ d ];
+    residual_norm += static_cast< double >( residual[ d ] ) * residual[ d ];
+  }
+
+  size_t best = candidates.front().second;
+  double best_loss = std::numeric_limits< double >::max();
+  for ( const auto& [ _, j ] : candidates )
+  {
+    const float* centroid = clusters[ j ].centroid.data_.get();
+    double dist = 0.0, parallel = 0.0;
+    for ( int d = 0; d < dim; ++d )
+    {
+      const double diff = vec[ d ] - centroid[ d ];
+      dist += diff * diff;
+      parallel += residual[ d ] * diff;
+    }
+    const double loss = dist + ( residual_norm > 0.0 ? params_.spill_lambda_ * parallel * parallel / residual_norm : 0.0 );
+    if ( loss < best_loss )
+    {
+      best_loss = loss;
+      best = j;
+    }
+  }
+  return best;
+}
+
+void index::spill( const id_t id, const float* vec, const size_t primary )
+{
+  auto candidates = nearest_clusters( vec, spill_candidates + 1 );
+  candidates.erase( std::remove_if( candidates.begin(),
+                                    candidates.end(),
+                                    [ & ]( const auto& candidate ) { return candidate.second == primary; } ),
+                    candidates.end() );
+  if ( candidates.empty() )
+    return;
+  const size_t target = spill_target( vec, clusters_[ primary ], candidates, clusters_ );
+  append_member( target, id, vec, true );
+  auto& c = clusters_[ target ];
+  c.radius = std::max(
+      c.radius,
+      distance::get_distance_instance( distance::dist_type::euclidean )->compute( vec, c.centroid.data_.get(), dim_ ) );
+}
+
+void index::remove_vectors_incremental( const std::vector< id_t >& removed_ids )
+{
+  std::unique_lock lock( mutex_ );
+  if ( clusters_.empty() && !replay_log_ )
+    return;
+  if ( replay_log_ )
+    replay_log_->push_back( { {}, removed_ids } );
+  for ( auto id : removed_ids )
+    remove_listed( id );
 }
 
-}  // namespace vector_db::indices::ivf_flat
\ No newline at end of file
+}  // namespace vector_db::indices::ivf_flat
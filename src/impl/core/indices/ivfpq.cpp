@@ -0,0 +1,847 @@
+//
+// IVF-PQ: inverted lists of product quantized residuals.
+//
+#include "core/indices/ivfpq.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+#if defined( __SSSE3__ )
+#include <immintrin.h>
+#endif
+
+#include "core/collection.h"
+#include "core/indices/euclidean.h"
+#include "core/utils/k_means.h"
+#include "core/utils/util.h"
+
+namespace vector_db::indices::ivf_pq
+{
+
+namespace
+{
+double squared_l2( const float* a, const float* b, const size_t dim )
+{
+  double sum = 0.0;
+  for ( size_t d = 0; d < dim; ++d )
+  {
+    const double diff = static_cast< double >( a[ d ] ) - b[ d ];
+    sum += diff * diff;
+  }
+  return sum;
+}
+
+double dot( const float* a, const float* b, const size_t dim )
+{
+  double sum = 0.0;
+  for ( size_t d = 0; d < dim; ++d )
+    sum += static_cast< double >( a[ d ] ) * b[ d ];
+  return sum;
+}
+
+// Adds up, for each of the 32 members of a fast-scan block, the 8-bit table entries its codes pick.
+// `codes` and `table` both hold 16 bytes per sub-quantizer. The SSSE3 path needs TARGET_ARCH x86-64-v2 or
+// later, the default on x86-64; other targets take the scalar loop.
+void scan_block( const std::uint8_t* codes, const std::uint8_t* table, const size_t sub_quantizers, std::uint16_t* sums )
+{
+#if defined( __SSSE3__ )
+  // the 16 entry tables fit a register: one shuffle looks up 16 codes at once
+  const __m128i low_nibble = _mm_set1_epi8( 0x0f );
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc[ 4 ] = { zero, zero, zero, zero };
+  for ( size_t j = 0; j < sub_quantizers; ++j )
+  {
+    const __m128i lut = _mm_loadu_si128( reinterpret_cast< const __m128i* >( table + j * 16 ) );
+    const __m128i block = _mm_loadu_si128( reinterpret_cast< const __m128i* >( codes + j * 16 ) );
+    const __m128i low = _mm_shuffle_epi8( lut, _mm_and_si128( block, low_nibble ) );
+    const __m128i high = _mm_shuffle_epi8( lut, _mm_and_si128( _mm_srli_epi16( block, 4 ), low_nibble ) );
+    acc[ 0 ] = _mm_add_epi16( acc[ 0 ], _mm_unpacklo_epi8( low, zero ) );
+    acc[ 1 ] = _mm_add_epi16( acc[ 1 ], _mm_unpackhi_epi8( low, zero ) );
+    acc[ 2 ] = _mm_add_epi16( acc[ 2 ], _mm_unpacklo_epi8( high, zero ) );
+    acc[ 3 ] = _mm_add_epi16( acc[ 3 ], _mm_unpackhi_epi8( high, zero ) );
+  }
+  for ( int i = 0; i < 4; ++i )
+    _mm_storeu_si128( reinterpret_cast< __m128i* >( sums + i * 8 ), acc[ i ] );
+#else
+  std::fill( sums, sums + 32, 0 );
+  for ( size_t j = 0; j < sub_quantizers; ++j )
+  {
+    const std::uint8_t* lut = table + j * 16;
+    const std::uint8_t* block = codes + j * 16;
+    for ( size_t i = 0; i < 16; ++i )
+    {
+      sums[ i ] += lut[ block[ i ] & 0x0f ];
+      sums[ i + 16 ] += lut[ block[ i ] >> 4 ];
+    }
+  }
+#endif
+}
+}  // namespace
+
+void index::lists::encode( const float* residual, std::uint8_t* code ) const
+{
+  for ( size_t j = 0; j < sub_quantizers(); ++j )
+  {
+    const size_t width = offsets[ j + 1 ] - offsets[ j ];
+    const size_t entries = codebooks[ j ].size() / width;
+    const float* sub = residual + offsets[ j ];
+    size_t best = 0;
+    double best_dist = std::numeric_limits< double >::max();
+    for ( size_t e = 0; e < entries; ++e )
+    {
+      const double d = squared_l2( sub, codebooks[ j ].data() + e * width, width );
+      if ( d < best_dist )
+      {
+        best_dist = d;
+        best = e;
+      }
+    }
+    code[ j ] = static_cast< std::uint8_t >( best );
+  }
+}
+
+std::uint8_t index::lists::get_code( const cluster& c, const size_t m, const size_t j ) const
+{
+  if ( !fast_scan )
+    return c.codes[ m * sub_quantizers() + j ];
+  const std::uint8_t byte = c.codes[ ( m / block_size * sub_quantizers() + j ) * 16 + m % 16 ];
+  return m % block_size < 16 ? byte & 0x0f : byte >> 4;
+}
+
+void index::lists::set_code( cluster& c, const size_t m, const size_t j, const std::uint8_t code ) const
+{
+  if ( !fast_scan )
+  {
+    c.codes[ m * sub_quantizers() + j ] = code;
+    return;
+  }
+  auto& byte = c.codes[ ( m / block_size * sub_quantizers() + j ) * 16 + m % 16 ];
+  if ( m % block_size < 16 )
+    byte = static_cast< std::uint8_t >( ( byte & 0xf0 ) | code );
+  else
+    byte = static_cast< std::uint8_t >( ( byte & 0x0f ) | ( code << 4 ) );
+}
+
+void index::lists::append( const size_t cluster_idx, const id_t id, const std::uint8_t* code, const float norm )
+{
+  auto& c = clusters[ cluster_idx ];
+  const size_t m = c.vector_ids.size();
+  locations[ id ] = { static_cast< uint32_t >( cluster_idx ), m };
+  c.vector_ids.push_back( id );
+  if ( with_norms )
+    c.norms.push_back( norm );
+  if ( !fast_scan )
+    c.codes.resize( c.codes.size() + sub_quantizers() );
+  else if ( m % block_size == 0 )
+    c.codes.resize( c.codes.size() + sub_quantizers() * 16, 0 );
+  for ( size_t j = 0; j < sub_quantizers(); ++j )
+    set_code( c, m, j, code[ j ] );
+}
+
+void index::lists::remove( const size_t cluster_idx, const size_t m )
+{
+  auto& c = clusters[ cluster_idx ];
+  const size_t last = c.vector_ids.size() - 1;
+  locations.erase( c.vector_ids[ m ] );
+  if ( m != last )
+  {
+    c.vector_ids[ m ] = c.vector_ids[ last ];
+    if ( with_norms )
+      c.norms[ m ] = c.norms[ last ];
+    for ( size_t j = 0; j < sub_quantizers(); ++j )
+      set_code( c, m, j, get_code( c, last, j ) );
+    locations[ c.vector_ids[ m ] ].second = m;
+  }
+  c.vector_ids.pop_back();
+  if ( with_norms )
+    c.norms.pop_back();
+  if ( !fast_scan )
+  {
+    c.codes.resize( last * sub_quantizers() );
+    return;
+  }
+  // the padding of a block stays zeroed
+  for ( size_t j = 0; j < sub_quantizers(); ++j )
+    set_code( c, last, j, 0 );
+  if ( last % block_size == 0 )
+    c.codes.resize( c.codes.size() - sub_quantizers() * 16 );
+}
+
+void index::lists::remove_listed( const id_t id )
+{
+  const auto it = locations.find( id );
+  if ( it != locations.end() )
+    remove( it->second.first, it->second.second );
+}
+
+index::index( wk_col_ptr _collection_ptr, const params& _params )
+    : index_t( std::move( _collection_ptr ) )
+    , params_( _params )
+{
+  if ( params_.m_ == 0 || params_.nbits_ == 0 || params_.nbits_ > 8 )
+    throw std::invalid_argument( "IVF-PQ needs at least one sub-quantizer and 1 to 8 bits per code" );
+  // the 16 bit accumulators of the fast scan hold up to 257 table entries of 255
+  if ( params_.fast_scan_ && ( params_.nbits_ != 4 || params_.m_ > 256 ) )
+    throw std::invalid_argument( "IVF-PQ fast scan needs 4-bit codes and at most 256 sub-quantizers" );
+}
+
+void index::init()
+{
+  if ( restored_ )
+  {
+    restored_ = false;
+    reconcile();
+    return;
+  }
+  build();
+}
+
+index::~index()
+{
+  std::thread rebuilder;
+  {
+    std::lock_guard lock( rebuilder_mutex_ );
+    rebuilder.swap( rebuilder_ );
+  }
+  if ( !rebuilder.joinable() )
+    return;
+  // the rebuilder may hold the last reference to the collection, and so be the one destroying this index
+  if ( rebuilder.get_id() == std::this_thread::get_id() )
+    rebuilder.detach();
+  else
+    rebuilder.join();
+}
+
+void index::schedule_rebuild()
+{
+  std::lock_guard lock( rebuilder_mutex_ );
+  // a running rebuild replays the latest changes too
+  if ( rebuild_running_ )
+    return;
+  if ( rebuilder_.joinable() )
+    rebuilder_.join();
+  rebuild_running_ = true;
+  rebuilder_ = std::thread(
+      [ this ]
+      {
+        const auto col = collection_ptr_.lock();  // released last, as it may own this index
+        if ( col )
+          build( *col );
+        std::lock_guard rebuilder_lock( rebuilder_mutex_ );
+        rebuild_running_ = false;
+      } );
+}
+
+void index::wait_for_rebuild()
+{
+  std::thread rebuilder;
+  {
+    std::lock_guard lock( rebuilder_mutex_ );
+    rebuilder.swap( rebuilder_ );
+  }
+  if ( rebuilder.joinable() )
+    rebuilder.join();
+}
+
+size_t index::min_training_size() const
+{
+  return static_cast< size_t >( params_.k_ ) * min_points_per_centroid;
+}
+
+void index::build()
+{
+  if ( const auto col = collection_ptr_.lock() )
+    build( *col );
+}
+
+void index::build( const collection& col )
+{
+  std::lock_guard build_lock( build_mutex_ );
+  {
+    std::unique_lock lock( mutex_ );
+    replay_log_.emplace();
+  }
+
+  // 1. Snapshot, packed contiguously for k-means
+  // in id order: the collection's hash order changes from run to run, and the training with it
+  const auto id_set = col.get_all_vector_ids();
+  std::vector< id_t > all_ids( id_set.begin(), id_set.end() );
+  std::sort( all_ids.begin(), all_ids.end() );
+  std::vector< float > rows;
+  std::vector< id_t > ids;
+  int dim = 0;
+  for ( auto id : all_ids )
+  {
+    auto vec = col.get_vector_by_id( id );
+    if ( vec )
+    {
+      if ( dim == 0 )
+      {
+        dim = vec->dimension_;
+        rows.reserve( all_ids.size() * dim );
+      }
+      rows.insert( rows.end(), vec->data_.get(), vec->data_.get() + dim );
+      ids.push_back( id );
+    }
+  }
+
+  lists next;
+  next.fast_scan = params_.fast_scan_;
+  next.with_norms = params_.dist_type_ == distance::dist_type::cosine;
+  double trained_error = 0.0;
+  if ( !ids.empty() && ids.size() >= min_training_size() )
+  {
+    const size_t count = ids.size();
+    next.dim = dim;
+
+    // 2. Coarse quantizer
+    auto coarse = k_means( rows.data(),
+                           count,
+                           dim,
+                           params_.k_,
+                           params_.dist_type_,
+                           static_cast< size_t >( params_.training_sample_ ) * params_.k_ );
+    trained_error = coarse.distance_sum / count;
+    std::vector< uint32_t > assignment( count );
+    next.clusters.resize( coarse.centroids.size() );
+    for ( size_t c = 0; c < next.clusters.size(); ++c )
+    {
+      for ( const auto row : coarse.centroids[ c ].vector_ids )
+        assignment[ row ] = static_cast< uint32_t >( c );
+      next.clusters[ c ].centroid = std::move( coarse.centroids[ c ].centroid );
+    }
+
+    // 3. Residuals, in place
+    std::vector< float > norms( next.with_norms ? count : 0 );
+    for ( size_t i = 0; i < count; ++i )
+    {
+      float* row = rows.data() + i * dim;
+      if ( next.with_norms )
+        norms[ i ] = static_cast< float >( std::sqrt( dot( row, row, dim ) ) );
+      const float* centroid = next.clusters[ assignment[ i ] ].centroid.data_.get();
+      for ( int d = 0; d < dim; ++d )
+        row[ d ] -= centroid[ d ];
+    }
+
+    // 4. One codebook per slice of the residuals
+    const size_t sub_quantizers = std::min< size_t >( params_.m_, dim );
+    const size_t entries = codebook_size();
+    next.offsets.resize( sub_quantizers + 1 );
+    for ( size_t j = 0; j <= sub_quantizers; ++j )
+      next.offsets[ j ] = j * dim / sub_quantizers;
+    next.codebooks.resize( sub_quantizers );
+    std::vector< float > slice;
+    for ( size_t j = 0; j < sub_quantizers; ++j )
+    {
+      const size_t width = next.offsets[ j + 1 ] - next.offsets[ j ];
+      slice.resize( count * width );
+      for ( size_t i = 0; i < count; ++i )
+        std::copy_n( rows.data() + i * dim + next.offsets[ j ], width, slice.data() + i * width );
+      const auto pq = k_means( slice.data(),
+                               count,
+                               static_cast< int >( width ),
+                               static_cast< unsigned int >( entries ),
+                               distance::dist_type::euclidean,
+                               static_cast< size_t >( params_.training_sample_ ) * entries );
+      auto& codebook = next.codebooks[ j ];
+      codebook.reserve( entries * width );
+      for ( const auto& entry : pq.centroids )
+        codebook.insert( codebook.end(), entry.centroid.data_.get(), entry.centroid.data_.get() + width );
+      // fewer vectors than entries: the spare entries repeat the first one, no code picks them
+      while ( codebook.size() < entries * width )
+        codebook.insert( codebook.end(), codebook.begin(), codebook.begin() + width );
+    }
+
+    // 5. Codes
+    next.locations.reserve( count );
+    std::vector< std::uint8_t > code( sub_quantizers );
+    for ( size_t i = 0; i < count; ++i )
+    {
+      next.encode( rows.data() + i * dim, code.data() );
+      next.append( assignment[ i ], ids[ i ], code.data(), next.with_norms ? norms[ i ] : 0.0f );
+    }
+  }
+
+  // 6. Swap them in and replay what changed since the snapshot. The old lists are freed once the lock
+  // is released.
+  std::unique_lock lock( mutex_ );
+  std::swap( lists_, next );
+  trained_count_ = lists_.locations.size();
+  trained_error_ = trained_error;
+  vectors_since_rebuild_ = 0;
+  added_error_sum_ = 0.0;
+  added_count_ = 0;
+  const auto log = std::move( *replay_log_ );
+  replay_log_.reset();
+  for ( const auto& [ added, removed ] : log )
+  {
+    for ( const auto id : removed )
+      lists_.remove_listed( id );
+    apply_added( added );
+  }
+}
+
+void index::reconcile()
+{
+  auto col = collection_ptr_.lock();
+  if ( !col )
+    return;
+
+  const auto all_ids = col->get_all_vector_ids();
+  std::vector< id_t > joined, left;
+  bool untrained;
+  {
+    std::shared_lock lock( mutex_ );
+    untrained = lists_.clusters.empty();
+    for ( const auto& [ id, _ ] : lists_.locations )
+      if ( !all_ids.count( id ) )
+        left.push_back( id );
+    for ( const auto id : all_ids )
+      if ( !lists_.locations.count( id ) )
+        joined.push_back( id );
+  }
+
+  if ( untrained )
+  {
+    build();
+    return;
+  }
+  remove_vectors_incremental( left );
+  add_vectors_incremental( joined );
+}
+
+bool index::trained() const
+{
+  std::shared_lock lock( mutex_ );
+  return !lists_.clusters.empty();
+}
+
+std::pair< size_t, double > index::find_nearest_cluster( const float* vec ) const
+{
+  distance::ptr dist_fn = distance::get_distance_instance( params_.dist_type_ );
+  size_t nearest = 0;
+  double min_dist = std::numeric_limits< double >::max();
+  for ( size_t c = 0; c < lists_.clusters.size(); ++c )
+  {
+    const double d = dist_fn->compute( vec, lists_.clusters[ c ].centroid.data_.get(), lists_.dim );
+    if ( d < min_dist )
+    {
+      min_dist = d;
+      nearest = c;
+    }
+  }
+  return { nearest, min_dist };
+}
+
+void index::serialize( std::ostream& os ) const
+{
+  write_format_version( os, params::format_version );
+  params_.serialize( os );
+
+  std::shared_lock lock( mutex_ );
+  const int dim = lists_.dim;
+  const auto sub_quantizers = static_cast< uint32_t >( lists_.sub_quantizers() );
+  os.write( reinterpret_cast< const char* >( &dim ), sizeof( dim ) );
+  os.write( reinterpret_cast< const char* >( &sub_quantizers ), sizeof( sub_quantizers ) );
+  for ( const auto& codebook : lists_.codebooks )
+    os.write( reinterpret_cast< const char* >( codebook.data() ), codebook.size() * sizeof( float ) );
+
+  const auto cluster_count = static_cast< uint32_t >( lists_.clusters.size() );
+  os.write( reinterpret_cast< const char* >( &cluster_count ), sizeof( cluster_count ) );
+  for ( const auto& c : lists_.clusters )
+  {
+    os.write( reinterpret_cast< const char* >( c.centroid.data_.get() ), dim * sizeof( float ) );
+    const auto id_count = static_cast< uint64_t >( c.vector_ids.size() );
+    const auto code_bytes = static_cast< uint64_t >( c.codes.size() );
+    os.write( reinterpret_cast< const char* >( &id_count ), sizeof( id_count ) );
+    os.write( reinterpret_cast< const char* >( &code_bytes ), sizeof( code_bytes ) );
+    os.write( reinterpret_cast< const char* >( c.vector_ids.data() ), id_count * sizeof( id_t ) );
+    os.write( reinterpret_cast< const char* >( c.codes.data() ), code_bytes );
+    os.write( reinterpret_cast< const char* >( c.norms.data() ), c.norms.size() * sizeof( float ) );
+  }
+
+  os.write( reinterpret_cast< const char* >( &trained_count_ ), sizeof( trained_count_ ) );
+  os.write( reinterpret_cast< const char* >( &vectors_since_rebuild_ ), sizeof( vectors_since_rebuild_ ) );
+  os.write( reinterpret_cast< const char* >( &trained_error_ ), sizeof( trained_error_ ) );
+  os.write( reinterpret_cast< const char* >( &added_error_sum_ ), sizeof( added_error_sum_ ) );
+  os.write( reinterpret_cast< const char* >( &added_count_ ), sizeof( added_count_ ) );
+}
+
+std::unique_ptr< index > index::deserialize( std::istream& is, wk_col_ptr _collection_ptr )
+{
+  // IVF-PQ payloads were versioned from the start
+  const auto version = read_format_version( is );
+  if ( version != params::format_version )
+    throw std::runtime_error( "Unsupported IVF-PQ format version " + std::to_string( version ) );
+  auto _index = std::make_unique< index >( std::move( _collection_ptr ), params::deserialize( is ) );
+  auto& lists = _index->lists_;
+  lists.fast_scan = _index->params_.fast_scan_;
+  lists.with_norms = _index->params_.dist_type_ == distance::dist_type::cosine;
+
+  int dim;
+  uint32_t sub_quantizers;
+  is.read( reinterpret_cast< char* >( &dim ), sizeof( dim ) );
+  is.read( reinterpret_cast< char* >( &sub_quantizers ), sizeof( sub_quantizers ) );
+  if ( !is || dim < 0 || sub_quantizers > static_cast< uint32_t >( dim ) )
+    throw std::runtime_error( "Truncated IVF-PQ index" );
+  lists.dim = dim;
+  if ( sub_quantizers > 0 )
+  {
+    lists.offsets.resize( sub_quantizers + 1 );
+    for ( size_t j = 0; j <= sub_quantizers; ++j )
+      lists.offsets[ j ] = j * dim / sub_quantizers;
+  }
+  lists.codebooks.resize( sub_quantizers );
+  for ( size_t j = 0; j < sub_quantizers; ++j )
+  {
+    lists.codebooks[ j ].resize( _index->codebook_size() * ( lists.offsets[ j + 1 ] - lists.offsets[ j ] ) );
+    is.read( reinterpret_cast< char* >( lists.codebooks[ j ].data() ), lists.codebooks[ j ].size() * sizeof( float ) );
+  }
+
+  uint32_t cluster_count;
+  is.read( reinterpret_cast< char* >( &cluster_count ), sizeof( cluster_count ) );
+  if ( !is )
+    throw std::runtime_error( "Truncated IVF-PQ index" );
+  lists.clusters.resize( cluster_count );
+  std::vector< float > centroid( dim );
+  for ( uint32_t c = 0; c < cluster_count; ++c )
+  {
+    auto& cl = lists.clusters[ c ];
+    is.read( reinterpret_cast< char* >( centroid.data() ), dim * sizeof( float ) );
+    cl.centroid = float_vector( dim, centroid.data() );
+    uint64_t id_count, code_bytes;
+    is.read( reinterpret_cast< char* >( &id_count ), sizeof( id_count ) );
+    is.read( reinterpret_cast< char* >( &code_bytes ), sizeof( code_bytes ) );
+    if ( !is )
+      throw std::runtime_error( "Truncated IVF-PQ index" );
+    cl.vector_ids.resize( id_count );
+    cl.codes.resize( code_bytes );
+    cl.norms.resize( lists.with_norms ? id_count : 0 );
+    is.read( reinterpret_cast< char* >( cl.vector_ids.data() ), id_count * sizeof( id_t ) );
+    is.read( reinterpret_cast< char* >( cl.codes.data() ), code_bytes );
+    is.read( reinterpret_cast< char* >( cl.norms.data() ), cl.norms.size() * sizeof( float ) );
+    for ( size_t m = 0; m < id_count; ++m )
+      lists.locations[ cl.vector_ids[ m ] ] = { c, m };
+  }
+  is.read( reinterpret_cast< char* >( &_index->trained_count_ ), sizeof( _index->trained_count_ ) );
+  is.read( reinterpret_cast< char* >( &_index->vectors_since_rebuild_ ), sizeof( _index->vectors_since_rebuild_ ) );
+  is.read( reinterpret_cast< char* >( &_index->trained_error_ ), sizeof( _index->trained_error_ ) );
+  is.read( reinterpret_cast< char* >( &_index->added_error_sum_ ), sizeof( _index->added_error_sum_ ) );
+  is.read( reinterpret_cast< char* >( &_index->added_count_ ), sizeof( _index->added_count_ ) );
+  if ( !is )
+    throw std::runtime_error( "Truncated IVF-PQ index" );
+
+  _index->restored_ = true;
+  return _index;
+}
+
+bool index::search_for_top_k( const float_vector& query_vector,
+                              unsigned int k,
+                              std::vector< score_pair >& results,
+                              const search_params_t& search_params )
+{
+  std::shared_lock lock( mutex_ );
+  results.clear();
+  if ( lists_.clusters.empty() )
+  {
+    // too few vectors to train on yet
+    lock.unlock();
+    return euclidean::index( collection_ptr_, params_.dist_type_ ).search_for_top_k( query_vector, k, results, search_params );
+  }
+  if ( query_vector.dimension_ != lists_.dim )
+    return false;
+
+  auto col = collection_ptr_.lock();
+  if ( !col )
+    return false;
+
+  distance::ptr dist_fn = distance::get_distance_instance( params_.dist_type_ );
+  const float* query = query_vector.data_.get();
+  const int dim = lists_.dim;
+  const size_t sub_quantizers = lists_.sub_quantizers();
+  const size_t entries = codebook_size();
+  const bool euclidean = params_.dist_type_ == distance::dist_type::euclidean;
+
+  // 1. Nearest n_probe centroids
+  std::vector< std::pair< double, size_t > > coarse( lists_.clusters.size() );
+  for ( size_t c = 0; c < coarse.size(); ++c )
+    coarse[ c ] = { dist_fn->compute( query, lists_.clusters[ c ].centroid.data_.get(), dim ), c };
+  const size_t probes = std::min< size_t >( search_params.n_probe_.value_or( params_.n_probe_ ), coarse.size() );
+  std::partial_sort( coarse.begin(), coarse.begin() + probes, coarse.end() );
+
+  // 2. Distance tables: table[j * entries + e] scores entry e of sub-quantizer j. With euclidean they hold
+  // squared distances to the query's residual, so they depend on the list; otherwise they hold dot
+  // products with the query, the centroid's share being added separately.
+  std::vector< float > table( sub_quantizers * entries );
+  const auto fill_table = [ & ]( const float* centroid )
+  {
+    for ( size_t j = 0; j < sub_quantizers; ++j )
+    {
+      const size_t begin = lists_.offsets[ j ], width = lists_.offsets[ j + 1 ] - begin;
+      for ( size_t e = 0; e < entries; ++e )
+      {
+        const float* entry = lists_.codebooks[ j ].data() + e * width;
+        double value = 0.0;
+        for ( size_t d = 0; d < width; ++d )
+        {
+          if ( euclidean )
+          {
+            const double diff = static_cast< double >( query[ begin + d ] ) - centroid[ begin + d ] - entry[ d ];
+            value += diff * diff;
+          }
+          else
+            value += static_cast< double >( query[ begin + d ] ) * entry[ d ];
+        }
+        table[ j * entries + e ] = static_cast< float >( value );
+      }
+    }
+  };
+  if ( !euclidean )
+    fill_table( nullptr );
+  const double query_norm = lists_.with_norms ? std::sqrt( dot( query, query, dim ) ) : 0.0;
+
+  // 3. Scan, keeping the best `candidates` (estimate, id) in a max-heap
+  const float rerank_factor = search_params.rerank_factor_.value_or( params_.rerank_factor_ );
+  const size_t candidates
+      = rerank_factor > 0.0f ? std::max< size_t >( k, static_cast< size_t >( std::ceil( k * rerank_factor ) ) ) : k;
+  std::vector< std::pair< double, id_t > > top;
+  top.reserve( candidates + 1 );
+  const auto offer = [ & ]( const double d, const id_t id )
+  {
+    if ( top.size() < candidates )
+    {
+      top.emplace_back( d, id );
+      std::push_heap( top.begin(), top.end() );
+    }
+    else if ( d < top.front().first )
+    {
+      std::pop_heap( top.begin(), top.end() );
+      top.back() = { d, id };
+      std::push_heap( top.begin(), top.end() );
+    }
+  };
+
+  const size_t distance = search_params.prefetch_distance_.value_or( params_.prefetch_distance_ );
+  std::vector< std::uint8_t > table8( lists_.fast_scan ? sub_quantizers * 16 : 0 );
+  std::uint16_t sums[ block_size ];
+  uint64_t scanned = 0;
+  for ( size_t p = 0; p < probes && candidates > 0; ++p )
+  {
+    const auto& c = lists_.clusters[ coarse[ p ].second ];
+    double base = 0.0;  // the centroid's share of the dot product
+    if ( euclidean )
+      fill_table( c.centroid.data_.get() );
+    else
+      base = dot( query, c.centroid.data_.get(), dim );
+
+    // from the summed table entries to the distance of the metric
+    const auto finish = [ & ]( const double estimate, const size_t m )
+    {
+      if ( euclidean )
+        return std::sqrt( std::max( 0.0, estimate ) );
+      if ( !lists_.with_norms )
+        return base + estimate;
+      if ( query_norm == 0.0 || c.norms[ m ] == 0.0f )
+        return 1.0;
+      return 1.0 - ( base + estimate ) / ( query_norm * c.norms[ m ] );
+    };
+
+    const size_t size = c.vector_ids.size();
+    scanned += size;
+    if ( !lists_.fast_scan )
+    {
+      for ( size_t m = 0; m < size; ++m )
+      {
+        if ( distance > 0 && m + distance < size )
+          utils::prefetch( c.codes.data() + ( m + distance ) * sub_quantizers, sub_quantizers );
+        const auto id = c.vector_ids[ m ];
+        if ( search_params.accepts_ && !search_params.accepts_( id ) )
+          continue;
+        const std::uint8_t* code = c.codes.data() + m * sub_quantizers;
+        double estimate = 0.0;
+        for ( size_t j = 0; j < sub_quantizers; ++j )
+          estimate += table[ j * entries + code[ j ] ];
+        offer( finish( estimate, m ), id );
+      }
+      continue;
+    }
+
+    // Fast scan: every sub-table is shifted to start at 0, then all are scaled to 8 bits by one factor
+    double bias = 0.0;
+    float range = 0.0f;
+    std::vector< float > lows( sub_quantizers );
+    for ( size_t j = 0; j < sub_quantizers; ++j )
+    {
+      const auto [ low, high ] = std::minmax_element( table.begin() + j * 16, table.begin() + ( j + 1 ) * 16 );
+      lows[ j ] = *low;
+      bias += *low;
+      range = std::max( range, *high - *low );
+    }
+    const double scale = range > 0.0f ? 255.0 / range : 0.0;
+    for ( size_t j = 0; j < sub_quantizers; ++j )
+      for ( size_t e = 0; e < 16; ++e )
+        table8[ j * 16 + e ] = static_cast< std::uint8_t >( std::lround( ( table[ j * 16 + e ] - lows[ j ] ) * scale ) );
+
+    const size_t block_bytes = sub_quantizers * 16;
+    for ( size_t b = 0; b * block_size < size; ++b )
+    {
+      if ( distance > 0 && ( b + distance ) * block_size < size )
+        utils::prefetch( c.codes.data() + ( b + distance ) * block_bytes, block_bytes );
+      scan_block( c.codes.data() + b * block_bytes, table8.data(), sub_quantizers, sums );
+      const size_t lanes = std::min( block_size, size - b * block_size );
+      for ( size_t lane = 0; lane < lanes; ++lane )
+      {
+        const size_t m = b * block_size + lane;
+        const auto id = c.vector_ids[ m ];
+        if ( search_params.accepts_ && !search_params.accepts_( id ) )
+          continue;
+        const double estimate = bias + ( scale > 0.0 ? sums[ lane ] / scale : 0.0 );
+        offer( finish( estimate, m ), id );
+      }
+    }
+  }
+  std::sort_heap( top.begin(), top.end() );
+
+  // 4. Optional re-rank on the full vectors, then only the winners are copied out of the collection
+  if ( rerank_factor > 0.0f )
+  {
+    for ( const auto& [ _, id ] : top )
+    {
+      auto vec = col->get_vector_by_id( id );
+      if ( vec )
+      {
+        const double d = dist_fn->compute( query_vector, *vec );
+        results.emplace_back( d, id_vector{ id, std::make_unique< float_vector >( std::move( *vec ) ) } );
+      }
+    }
+    std::sort( results.begin(),
+               results.end(),
+               []( const score_pair& a, const score_pair& b ) { return a.first < b.first; } );
+    if ( results.size() > k )
+      results.erase( results.begin() + k, results.end() );
+  }
+  else
+  {
+    results.reserve( top.size() );
+    for ( const auto& [ d, id ] : top )
+    {
+      auto vec = col->get_vector_by_id( id );
+      if ( vec )
+        results.emplace_back( d, id_vector{ id, std::make_unique< float_vector >( std::move( *vec ) ) } );
+    }
+  }
+
+  if ( search_params.stats_ )
+  {
+    search_params.stats_->distance_computations_ += coarse.size() + scanned + ( rerank_factor > 0.0f ? top.size() : 0 );
+    search_params.stats_->lists_probed_ += probes;
+  }
+
+  return !results.empty();
+}
+
+void index::on_vectors_added( const std::vector< id_t >& new_ids )
+{
+  add_vectors_incremental( new_ids );
+  if ( needs_rebuild( new_ids.size() ) )
+    schedule_rebuild();
+}
+
+void index::on_vectors_removed( const std::vector< id_t >& removed_ids )
+{
+  remove_vectors_incremental( removed_ids );
+  // removals never make an untrained index trainable, and the collection is still locked here
+  if ( !trained() )
+    return;
+  if ( needs_rebuild( removed_ids.size() ) )
+    schedule_rebuild();
+}
+
+bool index::needs_rebuild( const size_t changes )
+{
+  if ( !trained() )
+  {
+    const auto col = collection_ptr_.lock();  // sized before locking, searches lock the collection first
+    return col && col->size() >= std::max< size_t >( min_training_size(), 1 );
+  }
+
+  std::unique_lock lock( mutex_ );
+  if ( lists_.locations.size() >= retrain_growth * trained_count_ )
+    return true;
+  vectors_since_rebuild_ += changes;
+  if ( vectors_since_rebuild_ < params_.rebuild_threshold_ )
+    return false;
+
+  // each window of changes is judged on its own
+  const bool drifted = added_count_ > 0
+                       && added_error_sum_ / added_count_
+                              > trained_error_ + std::abs( trained_error_ ) * params_.drift_threshold_;
+  vectors_since_rebuild_ = 0;
+  added_error_sum_ = 0.0;
+  added_count_ = 0;
+  return drifted || params_.drift_threshold_ <= 0.0f;
+}
+
+void index::add_vectors_incremental( const std::vector< id_t >& new_ids )
+{
+  auto col = collection_ptr_.lock();
+  if ( !col )
+    return;
+  {
+    // untrained and no build to log for: a build started later snapshots these vectors
+    std::shared_lock lock( mutex_ );
+    if ( lists_.clusters.empty() && !replay_log_ )
+      return;
+  }
+
+  // copied before locking, searches lock the collection first
+  std::vector< std::pair< id_t, float_vector > > vectors;
+  vectors.reserve( new_ids.size() );
+  for ( auto id : new_ids )
+    if ( auto vec = col->get_vector_by_id( id ); vec )
+      vectors.emplace_back( id, std::move( *vec ) );
+
+  std::unique_lock lock( mutex_ );
+  if ( replay_log_ )
+    replay_log_->push_back( { vectors, {} } );
+  apply_added( vectors );
+}
+
+void index::apply_added( const std::vector< std::pair< id_t, float_vector > >& vectors )
+{
+  if ( lists_.clusters.empty() )
+    return;
+
+  const int dim = lists_.dim;
+  std::vector< float > residual( dim );
+  std::vector< std::uint8_t > code( lists_.sub_quantizers() );
+  for ( const auto& [ id, vec ] : vectors )
+  {
+    lists_.remove_listed( id );
+    if ( vec.dimension_ != dim )
+      continue;
+    const float* row = vec.data_.get();
+    const auto [ cluster_idx, error ] = find_nearest_cluster( row );
+    added_error_sum_ += error;
+    ++added_count_;
+    const float* centroid = lists_.clusters[ cluster_idx ].centroid.data_.get();
+    for ( int d = 0; d < dim; ++d )
+      residual[ d ] = row[ d ] - centroid[ d ];
+    lists_.encode( residual.data(), code.data() );
+    const float norm = lists_.with_norms ? static_cast< float >( std::sqrt( dot( row, row, dim ) ) ) : 0.0f;
+    lists_.append( cluster_idx, id, code.data(), norm );
+  }
+}
+
+void index::remove_vectors_incremental( const std::vector< id_t >& removed_ids )
+{
+  std::unique_lock lock( mutex_ );
+  if ( replay_log_ )
+    replay_log_->push_back( { {}, removed_ids } );
+  for ( auto id : removed_ids )
+    lists_.remove_listed( id );
+}
+
+}  // namespace vector_db::indices::ivf_pq
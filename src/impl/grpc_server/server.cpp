@@ -6,6 +6,7 @@
 
 #include "configuration/provider.h"
 #include "core/indices/ivfflat.h"
+#include "core/indices/ivfpq.h"
 #include "grpc_server/util.h"
 #include "logger/logger.h"
 
@@ -306,13 +307,42 @@ struct server::search_handler : public rpc_base< search_handler, SearchRequest,
       responder_.Finish( response_, status_, this );
       return;
     }
+    if ( ( request_.has_efsearch() && request_.efsearch() == 0 ) || ( request_.has_nprobe() && request_.nprobe() == 0 )
+         || ( request_.has_rerankfactor() && request_.rerankfactor() < 1.0f ) )
+    {
+      logger_->warn( "Search failed: invalid search params" );
+      status_ = grpc::Status( grpc::StatusCode::INVALID_ARGUMENT,
+                              "efSearch and nProbe must be greater than 0, rerankFactor at least 1." );
+      state_ = state::PROCESSED;
+      responder_.Finish( response_, status_, this );
+      return;
+    }
     db_worker_pool_->submit(
         [ this ]()
         {
           try
           {
             float_vector _query{ request_.queryvector_size(), request_.queryvector().data() };
-            const auto result = db_ptr_->get_nearest_k( request_.collectionname(), _query, request_.top_k() );
+            search_params_t _search_params;
+            if ( request_.has_efsearch() )
+              _search_params.ef_search_ = request_.efsearch();
+            if ( request_.has_nprobe() )
+              _search_params.n_probe_ = request_.nprobe();
+            if ( request_.has_rerankfactor() )
+              _search_params.rerank_factor_ = request_.rerankfactor();
+            if ( request_.has_prefetchdistance() )
+              _search_params.prefetch_distance_ = request_.prefetchdistance();
+            if ( request_.has_filter() )
+            {
+              auto& _filter = _search_params.filter_.emplace();
+              for ( const auto& _term : request_.filter().terms() )
+                _filter.terms_.push_back( { _term.key(), { _term.values().begin(), _term.values().end() } } );
+            }
+            query_stats _stats;
+            if ( request_.withstats() )
+              _search_params.stats_ = &_stats;
+            const auto result = db_ptr_->get_nearest_k(
+                request_.collectionname(), _query, request_.top_k(), request_.indexname(), _search_params );
             status_ = status_to_grpc_status( result.status_ );
             if ( result.is_success() && result.has_payload() )
             {
@@ -326,6 +356,8 @@ struct server::search_handler : public rpc_base< search_handler, SearchRequest,
                 for ( size_t it = 0; it < _vector_ptr->dimension_; ++it )
                   _new_vector->add_values( _vector_ptr->data_[ it ] );
               }
+              if ( request_.withstats() )
+                db_query_stats_to_proto( _stats, response_.mutable_stats() );
               logger_->info( "Search response: found {} results", result.value().size() );
             }
             else
@@ -516,6 +548,18 @@ struct server::add_index_handler : public rpc_base< add_index_handler, AddIndexR
                                                        static_cast< unsigned int >( req_params.m() ),
                                                        static_cast< unsigned int >( req_params.efconstruction() ),
                                                        static_cast< unsigned int >( req_params.efsearch() ) };
+                  if ( req_params.has_searchpending() )
+                    hnsw_params.search_pending_ = req_params.searchpending();
+                  if ( req_params.has_prefetchdistance() )
+                    hnsw_params.prefetch_distance_ = req_params.prefetchdistance();
+                  if ( req_params.has_reorder() )
+                    hnsw_params.reorder_ = req_params.reorder();
+                  if ( req_params.has_extendcandidates() )
+                    hnsw_params.extend_candidates_ = req_params.extendcandidates();
+                  if ( req_params.has_keepprunedconnections() )
+                    hnsw_params.keep_pruned_connections_ = req_params.keepprunedconnections();
+                  if ( req_params.has_quantizer() )
+                    hnsw_params.quantizer_ = proto_to_db_quantizer( req_params.quantizer() );
                 }
 
                 auto _status = db_ptr_->add_index( collection_name, index_name, index_type::hnsw, &hnsw_params );
@@ -534,6 +578,38 @@ struct server::add_index_handler : public rpc_base< add_index_handler, AddIndexR
                                                           static_cast< unsigned int >( req_params.k() ),
                                                           static_cast< unsigned int >( req_params.nprobe() ),
                                                           static_cast< size_t >( req_params.rebuildthreshold() ) };
+                  if ( req_params.has_prefetchdistance() )
+                    ivf_params.prefetch_distance_ = req_params.prefetchdistance();
+                  if ( req_params.has_driftthreshold() )
+                    ivf_params.drift_threshold_ = req_params.driftthreshold();
+                  if ( req_params.has_trainingsample() )
+                    ivf_params.training_sample_ = req_params.trainingsample();
+                  if ( req_params.has_quantizer() )
+                    ivf_params.quantizer_ = proto_to_db_quantizer( req_params.quantizer() );
+                  if ( req_params.has_rerankfactor() )
+                    ivf_params.rerank_factor_ = req_params.rerankfactor();
+                  if ( req_params.has_adaptiveprobe() )
+                    ivf_params.adaptive_probe_ = req_params.adaptiveprobe();
+                  if ( req_params.has_probebudget() )
+                    ivf_params.probe_budget_ = req_params.probebudget();
+                  if ( req_params.has_coarsequantizer() )
+                    ivf_params.coarse_ = proto_to_db_coarse( req_params.coarsequantizer() );
+                  if ( req_params.has_coarseef() )
+                    ivf_params.coarse_ef_ = req_params.coarseef();
+                  if ( req_params.has_parallelscanthreshold() )
+                    ivf_params.parallel_scan_threshold_ = req_params.parallelscanthreshold();
+                  if ( req_params.has_scanthreads() )
+                    ivf_params.scan_threads_ = req_params.scanthreads();
+                  if ( req_params.has_maxlistimbalance() )
+                    ivf_params.max_list_imbalance_ = req_params.maxlistimbalance();
+                  if ( req_params.has_spill() )
+                    ivf_params.spill_ = req_params.spill();
+                  if ( req_params.has_spilllambda() )
+                    ivf_params.spill_lambda_ = req_params.spilllambda();
+                  if ( req_params.has_splitfactor() )
+                    ivf_params.split_factor_ = req_params.splitfactor();
+                  if ( req_params.has_mergefactor() )
+                    ivf_params.merge_factor_ = req_params.mergefactor();
                 }
 
                 auto _status = db_ptr_->add_index( collection_name, index_name, index_type::ivf_flat, &ivf_params );
@@ -542,6 +618,37 @@ struct server::add_index_handler : public rpc_base< add_index_handler, AddIndexR
                 responder_.Finish( response_, status_, this );
                 break;
               }
+              case vector_db::IndexType::IVF_PQ:
+              {
+                auto ivf_pq_params = indices::ivf_pq::params();
+                if ( request_.has_ivfpqparams() )
+                {
+                  auto& req_params = request_.ivfpqparams();
+                  ivf_pq_params = indices::ivf_pq::params{ proto_to_db_dist( req_params.distancetype() ),
+                                                           static_cast< unsigned int >( req_params.k() ),
+                                                           static_cast< unsigned int >( req_params.nprobe() ),
+                                                           static_cast< unsigned int >( req_params.m() ),
+                                                           static_cast< unsigned int >( req_params.nbits() ) };
+                  if ( req_params.has_fastscan() )
+                    ivf_pq_params.fast_scan_ = req_params.fastscan();
+                  if ( req_params.has_rerankfactor() )
+                    ivf_pq_params.rerank_factor_ = req_params.rerankfactor();
+                  if ( req_params.has_trainingsample() )
+                    ivf_pq_params.training_sample_ = req_params.trainingsample();
+                  if ( req_params.has_prefetchdistance() )
+                    ivf_pq_params.prefetch_distance_ = req_params.prefetchdistance();
+                  if ( req_params.has_rebuildthreshold() )
+                    ivf_pq_params.rebuild_threshold_ = req_params.rebuildthreshold();
+                  if ( req_params.has_driftthreshold() )
+                    ivf_pq_params.drift_threshold_ = req_params.driftthreshold();
+                }
+
+                auto _status = db_ptr_->add_index( collection_name, index_name, index_type::ivf_pq, &ivf_pq_params );
+                status_ = status_to_grpc_status( _status );
+                state_ = state::PROCESSED;
+                responder_.Finish( response_, status_, this );
+                break;
+              }
               default:
                 status_ = grpc::Status( grpc::StatusCode::INVALID_ARGUMENT, "Unknown index type" );
                 state_ = state::PROCESSED;
@@ -607,6 +714,12 @@ struct server::get_index_handler : public rpc_base< get_index_handler, IndexPara
                   _params->set_m( hnsw_params->M_ );
                   _params->set_efconstruction( hnsw_params->ef_construction_ );
                   _params->set_efsearch( hnsw_params->ef_search_ );
+                  _params->set_searchpending( hnsw_params->search_pending_ );
+                  _params->set_prefetchdistance( hnsw_params->prefetch_distance_ );
+                  _params->set_reorder( hnsw_params->reorder_ );
+                  _params->set_extendcandidates( hnsw_params->extend_candidates_ );
+                  _params->set_keepprunedconnections( hnsw_params->keep_pruned_connections_ );
+                  _params->set_quantizer( db_quantizer_to_proto( hnsw_params->quantizer_ ) );
                   break;
                 }
                 case vector_db::index_type::ivf_flat:
@@ -617,6 +730,39 @@ struct server::get_index_handler : public rpc_base< get_index_handler, IndexPara
                   _params->set_k( ivf_params->k_ );
                   _params->set_nprobe( ivf_params->n_probe_ );
                   _params->set_rebuildthreshold( ivf_params->rebuild_threshold_ );
+                  _params->set_prefetchdistance( ivf_params->prefetch_distance_ );
+                  _params->set_driftthreshold( ivf_params->drift_threshold_ );
+                  _params->set_trainingsample( ivf_params->training_sample_ );
+                  _params->set_quantizer( db_quantizer_to_proto( ivf_params->quantizer_ ) );
+                  _params->set_rerankfactor( ivf_params->rerank_factor_ );
+                  _params->set_adaptiveprobe( ivf_params->adaptive_probe_ );
+                  _params->set_probebudget( ivf_params->probe_budget_ );
+                  _params->set_coarsequantizer( db_coarse_to_proto( ivf_params->coarse_ ) );
+                  _params->set_coarseef( ivf_params->coarse_ef_ );
+                  _params->set_parallelscanthreshold( ivf_params->parallel_scan_threshold_ );
+                  _params->set_scanthreads( ivf_params->scan_threads_ );
+                  _params->set_maxlistimbalance( ivf_params->max_list_imbalance_ );
+                  _params->set_spill( ivf_params->spill_ );
+                  _params->set_spilllambda( ivf_params->spill_lambda_ );
+                  _params->set_splitfactor( ivf_params->split_factor_ );
+                  _params->set_mergefactor( ivf_params->merge_factor_ );
+                  break;
+                }
+                case vector_db::index_type::ivf_pq:
+                {
+                  auto* ivf_pq_params = dynamic_cast< const vector_db::indices::ivf_pq::params* >( result.value().second );
+                  auto _params = response_.mutable_ivfpqparams();
+                  _params->set_distancetype( db_dist_to_proto( ivf_pq_params->dist_type_ ) );
+                  _params->set_k( ivf_pq_params->k_ );
+                  _params->set_nprobe( ivf_pq_params->n_probe_ );
+                  _params->set_m( ivf_pq_params->m_ );
+                  _params->set_nbits( ivf_pq_params->nbits_ );
+                  _params->set_fastscan( ivf_pq_params->fast_scan_ );
+                  _params->set_rerankfactor( ivf_pq_params->rerank_factor_ );
+                  _params->set_trainingsample( ivf_pq_params->training_sample_ );
+                  _params->set_prefetchdistance( ivf_pq_params->prefetch_distance_ );
+                  _params->set_rebuildthreshold( ivf_pq_params->rebuild_threshold_ );
+                  _params->set_driftthreshold( ivf_pq_params->drift_threshold_ );
                   break;
                 }
                 case vector_db::index_type::unknown:
@@ -638,6 +784,139 @@ struct server::get_index_handler : public rpc_base< get_index_handler, IndexPara
   }
 };
 
+struct server::get_index_stats_handler : public rpc_base< get_index_stats_handler, IndexStatsRequest, IndexStatsResponse >
+{
+  grpc::ServerAsyncResponseWriter< IndexStatsResponse > responder_;
+  grpc::Status status_{};
+
+  get_index_stats_handler( vectorService::AsyncService* s, grpc::ServerCompletionQueue* q, database* db, worker_pool* pool )
+      : rpc_base( s, q, db, pool )
+      , responder_( &server_ctx_ )
+  {
+    service_->RequestGetIndexStats( &server_ctx_, &request_, &responder_, cq_, cq_, this );
+  }
+
+  void handle_unknown_error() override
+  {
+    state_ = state::PROCESSED;
+    responder_.Finish( response_, grpc::Status( grpc::StatusCode::INTERNAL, "Internal error" ), this );
+  }
+
+  void process() override
+  {
+    if ( request_.collectionname().empty() || request_.indexname().empty() )
+    {
+      status_ = grpc::Status( grpc::StatusCode::INVALID_ARGUMENT, "Collection/Index name cannot be empty." );
+      state_ = state::PROCESSED;
+      responder_.Finish( response_, status_, this );
+      return;
+    }
+
+    db_worker_pool_->submit(
+        [ this ]()
+        {
+          try
+          {
+            auto result = db_ptr_->get_index_stats( request_.collectionname(), request_.indexname() );
+            status_ = status_to_grpc_status( result.status_ );
+            // indices keeping no stats answer with an empty response
+            if ( result.is_success() && result.has_payload() && result.value().second )
+            {
+              switch ( result.value().first )
+              {
+                case vector_db::index_type::hnsw:
+                {
+                  auto* hnsw_stats = dynamic_cast< const vector_db::indices::hnsw::stats* >( result.value().second.get() );
+                  auto _stats = response_.mutable_hnswstats();
+                  _stats->set_queries( hnsw_stats->queries_ );
+                  db_query_stats_to_proto( hnsw_stats->totals_, _stats->mutable_searchtotals() );
+                  _stats->set_inserts( hnsw_stats->inserts_ );
+                  _stats->set_insertspersec( hnsw_stats->inserts_per_sec_ );
+                  _stats->set_prunededges( hnsw_stats->pruned_edges_ );
+                  for ( const auto degree : hnsw_stats->average_degree_ )
+                    _stats->add_averagedegree( degree );
+                  _stats->set_livecount( hnsw_stats->live_count_ );
+                  _stats->set_slotcount( hnsw_stats->slot_count_ );
+                  break;
+                }
+                case vector_db::index_type::ivf_flat:
+                {
+                  auto* ivf_stats = dynamic_cast< const vector_db::indices::ivf_flat::stats* >( result.value().second.get() );
+                  auto _stats = response_.mutable_ivfflatstats();
+                  _stats->set_queries( ivf_stats->queries_ );
+                  db_query_stats_to_proto( ivf_stats->totals_, _stats->mutable_searchtotals() );
+                  _stats->set_listcount( ivf_stats->list_count_ );
+                  _stats->set_vectorcount( ivf_stats->vector_count_ );
+                  _stats->set_largestlist( ivf_stats->largest_list_ );
+                  for ( const auto lists : ivf_stats->list_size_histogram_ )
+                    _stats->add_listsizehistogram( lists );
+                  _stats->set_listssplit( ivf_stats->lists_split_ );
+                  _stats->set_listsmerged( ivf_stats->lists_merged_ );
+                  break;
+                }
+                default:
+                  break;
+              }
+            }
+            state_ = state::PROCESSED;
+            responder_.Finish( response_, status_, this );
+          }
+          catch ( std::exception& e )
+          {
+            logger_->error( "Get index stats error: {}", e.what() );
+            handle_unknown_error();
+          }
+        } );
+  }
+};
+
+struct server::retrain_index_handler : public rpc_base< retrain_index_handler, RetrainIndexRequest, EmptyResponse >
+{
+  grpc::ServerAsyncResponseWriter< EmptyResponse > responder_;
+
+  retrain_index_handler( vectorService::AsyncService* s, grpc::ServerCompletionQueue* q, database* db, worker_pool* pool )
+      : rpc_base( s, q, db, pool )
+      , responder_( &server_ctx_ )
+  {
+    service_->RequestRetrainIndex( &server_ctx_, &request_, &responder_, cq_, cq_, this );
+  }
+
+  void handle_unknown_error() override
+  {
+    state_ = state::PROCESSED;
+    responder_.Finish( response_, grpc::Status( grpc::StatusCode::INTERNAL, "Internal error" ), this );
+  }
+
+  void process() override
+  {
+    logger_->info( "Retrain index request: collection {}, index {}", request_.collectionname(), request_.indexname() );
+    if ( request_.collectionname().empty() || request_.indexname().empty() )
+    {
+      status_ = grpc::Status( grpc::StatusCode::INVALID_ARGUMENT, "Collection/Index name cannot be empty." );
+      state_ = state::PROCESSED;
+      responder_.Finish( response_, status_, this );
+      return;
+    }
+    db_worker_pool_->submit(
+        [ this ]
+        {
+          try
+          {
+            const auto _status = db_ptr_->retrain_index( request_.collectionname(), request_.indexname() );
+            status_ = status_to_grpc_status( _status );
+            logger_->info< int >( "Retrain index response: code {}", status_.error_code() );
+          }
+          catch ( std::exception& e )
+          {
+            logger_->error( "Retrain index error: {}", e.what() );
+            status_ = grpc::Status( grpc::StatusCode::INTERNAL, "Internal error" );
+          }
+          state_ = state::PROCESSED;
+          responder_.Finish( response_, status_, this );
+        } );
+  }
+};
+
 server::server()
 {
   const auto config_provider_ = config_provider::get_instance();
@@ -683,7 +962,9 @@ void server::start()
                      stream_upsert_handler,
                      delete_vector_handler,
                      add_index_handler,
-                     get_index_handler >();
+                     get_index_handler,
+                     get_index_stats_handler,
+                     retrain_index_handler >();
 
   // Start CQ polling thread
   logger_->info( "Starting {} Completion Queue worker threads", num_of_thread_ );
@@ -40,6 +40,9 @@ class collection
   std::unordered_map< std::string, index_ptr > indices_;
   std::shared_ptr< details::logger_impl > logger_;
 
+  // search_params with its metadata filter bound to vectors_, for callers holding vec_mutex_
+  search_params_t bind_filter( const search_params_t& search_params ) const;
+
 public:
   explicit collection( unsigned int dimension, const std::string& name );
 
@@ -49,11 +52,21 @@ public:
   int remove_vectors( const std::vector< id_t >& ids );
 
   std::unordered_set< id_t, hash > get_all_vector_ids() const;
+  // number of vectors held
+  size_t size() const;
 
   bool search_for_top_k( const float_vector& query_vector,
                          unsigned int k,
                          std::vector< score_pair >& results,
-                         const std::string& index_name = "" );
+                         const std::string& index_name = "",
+                         const search_params_t& search_params = {} );
+
+  // top-k of every query, under a single acquisition of the collection's locks
+  bool search_for_top_k_batch( const std::vector< float_vector >& queries,
+                               unsigned int k,
+                               std::vector< std::vector< score_pair > >& results,
+                               const std::string& index_name = "",
+                               const search_params_t& search_params = {} );
 
   bool add_index( const std::string& name, index_type, params_t* params );
 
@@ -62,6 +75,12 @@ public:
 
   std::pair< index_type, const params_t* > get_index_params( const std::string& index_name ) const;
 
+  // false when the index does not exist
+  bool retrain_index( const std::string& index_name );
+
+  // null stats when the index does not exist or keeps none
+  std::pair< index_type, std::unique_ptr< stats_t > > get_index_stats( const std::string& index_name ) const;
+
   void serialize( std::ostream& os ) const;
   static std::shared_ptr< collection > deserialize( std::istream& is );
 };
@@ -37,7 +37,16 @@ public:
 
   result< std::vector< score_pair > > get_nearest_k( const std::string& collection_name,
                                                        const float_vector& query,
-                                                       unsigned int k );
+                                                       unsigned int k,
+                                                       const std::string& index_name = "",
+                                                       const search_params_t& search_params = {} );
+
+  // get_nearest_k for many queries at once, results[i] answering queries[i]
+  result< std::vector< std::vector< score_pair > > > get_nearest_k_batch( const std::string& collection_name,
+                                                                          const std::vector< float_vector >& queries,
+                                                                          unsigned int k,
+                                                                          const std::string& index_name = "",
+                                                                          const search_params_t& search_params = {} );
 
   status delete_vectors( const std::string& collection_name, const std::vector< id_t >& _ids );
 
@@ -45,6 +54,11 @@ public:
 
   result< std::pair< index_type, const params_t* >> get_index_params( const std::string& collection_name, const std::string& index_name );
 
+  status retrain_index( const std::string& collection_name, const std::string& index_name );
+
+  result< std::pair< index_type, std::unique_ptr< stats_t > > > get_index_stats( const std::string& collection_name,
+                                                                                const std::string& index_name );
+
   status save();
   status load();
 };
@@ -3,6 +3,7 @@
 //
 #pragma once
 #include "float_vector.h"
+#include "utils/simd.h"
 #include "utils/util.h"
 
 namespace vector_db::distance
@@ -18,7 +19,12 @@ enum class dist_type : uint8_t
 
 struct distance_t
 {
-  virtual double compute( const float_vector& a, const float_vector& b ) = 0;
+  // raw rows of `dim` floats, used by indices that keep their vectors in contiguous storage
+  virtual double compute( const float* a, const float* b, std::size_t dim ) = 0;
+  double compute( const float_vector& a, const float_vector& b )
+  {
+    return compute( a.data_.get(), b.data_.get(), static_cast< std::size_t >( a.dimension_ ) );
+  }
   virtual ~distance_t() = default;
 };
 
@@ -29,15 +35,10 @@ struct euclidean
     , utils::singleton< euclidean >
 {
   friend utils::singleton< euclidean >;
-  double compute( const float_vector& a, const float_vector& b ) override
+  using distance_t::compute;
+  double compute( const float* a, const float* b, const std::size_t dim ) override
   {
-    double distance = 0.0;
-    for ( unsigned int i = 0; i < static_cast< unsigned int >( a.dimension_ ); ++i )
-    {
-      const double diff = static_cast< double >( a.data_[ i ] ) - static_cast< double >( b.data_[ i ] );
-      distance += diff * diff;
-    }
-    return std::sqrt( distance );
+    return std::sqrt( static_cast< double >( simd::squared_l2( a, b, dim ) ) );
   }
 };
 
@@ -46,24 +47,18 @@ struct cosine
     , utils::singleton< cosine >
 {
   friend utils::singleton< cosine >;
-  double compute( const float_vector& a, const float_vector& b ) override
+  using distance_t::compute;
+  double compute( const float* a, const float* b, const std::size_t dim ) override
   {
-    double dot_product = 0.0, mag_a = 0.0, mag_b = 0.0;
-    for ( unsigned int i = 0; i < static_cast< unsigned int >( a.dimension_ ); ++i )
-    {
-      const auto av = static_cast< double >( a.data_[ i ] );
-      const auto bv = static_cast< double >( b.data_[ i ] );
-      dot_product += av * bv;
-      mag_a += av * av;
-      mag_b += bv * bv;
-    }
-    mag_a = std::sqrt( mag_a );
-    mag_b = std::sqrt( mag_b );
+    float ab, aa, bb;
+    simd::dot_and_norms( a, b, dim, ab, aa, bb );
+    const double mag_a = std::sqrt( static_cast< double >( aa ) );
+    const double mag_b = std::sqrt( static_cast< double >( bb ) );
     if ( mag_a == 0.0 || mag_b == 0.0 )
     {
       return 1.0;
     }
-    return 1.0 - ( dot_product / ( mag_a * mag_b ) );
+    return 1.0 - ( ab / ( mag_a * mag_b ) );
   }
 };
 
@@ -72,12 +67,10 @@ struct inner_product
     , utils::singleton< inner_product >
 {
   friend utils::singleton< inner_product >;
-  double compute( const float_vector& a, const float_vector& b ) override
+  using distance_t::compute;
+  double compute( const float* a, const float* b, const std::size_t dim ) override
   {
-    double dot_product = 0.0;
-    for ( unsigned int i = 0; i < static_cast< unsigned int >( a.dimension_ ); ++i )
-      dot_product += static_cast< double >( a.data_[ i ] ) * static_cast< double >( b.data_[ i ] );
-    return dot_product;
+    return simd::dot( a, b, dim );
   }
 };
 
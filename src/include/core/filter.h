@@ -0,0 +1,44 @@
+//
+// Metadata predicates for filtered searches
+//
+#pragma once
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace vector_db
+{
+
+// Conjunction of terms, each one matching when the vector's metadata maps `key_` to any of `values_`.
+// An empty filter matches everything.
+struct metadata_filter
+{
+  struct term
+  {
+    std::string key_;
+    std::vector< std::string > values_;
+  };
+  std::vector< term > terms_;
+
+  bool matches( const std::vector< std::pair< std::string, std::string > >* metadata ) const
+  {
+    for ( const auto& [ key, values ] : terms_ )
+    {
+      if ( !metadata )
+        return false;
+      const bool found = std::any_of( metadata->begin(),
+                                      metadata->end(),
+                                      [ & ]( const auto& entry )
+                                      {
+                                        return entry.first == key
+                                               && std::find( values.begin(), values.end(), entry.second ) != values.end();
+                                      } );
+      if ( !found )
+        return false;
+    }
+    return true;
+  }
+};
+
+}  // namespace vector_db
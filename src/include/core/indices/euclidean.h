@@ -2,18 +2,25 @@
 // Created by Vivek Yamsani on 18/12/25.
 //
 #pragma once
+#include "core/distance.h"
 #include "core/indices/index.h"
 namespace vector_db::indices::euclidean
 {
 
+// Exhaustive scan of the collection. Euclidean by default; the IVF indices scan with their own metric
+// until they have enough vectors to train on.
 class index : public index_t
 {
   using index_t::wk_col_ptr;
+  distance::dist_type dist_type_;
 
 public:
-  explicit index( const wk_col_ptr& col_ptr );
+  explicit index( const wk_col_ptr& col_ptr, distance::dist_type dist_type = distance::dist_type::euclidean );
   void serialize(std::ostream& os) const override {}
-  bool search_for_top_k( const float_vector& query_vector, unsigned int k, std::vector< score_pair >& results ) override;
+  bool search_for_top_k( const float_vector& query_vector,
+                         unsigned int k,
+                         std::vector< score_pair >& results,
+                         const search_params_t& search_params = {} ) override;
 };
 
 }  // namespace vector_db::indices::euclidean
\ No newline at end of file
@@ -2,10 +2,16 @@
 // Created by Vivek Yamsani on 14/12/25.
 //
 #pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <mutex>
 #include <queue>
 #include <set>
 #include <shared_mutex>
+#include <thread>
 #include <unordered_set>
 #include <utility>
 #include <vector>
@@ -13,6 +19,8 @@
 #include "core/distance.h"
 #include "core/float_vector.h"
 #include "core/indices/index.h"
+#include "core/utils/neighbor_selection.h"
+#include "core/utils/quantizer.h"
 #include "core/utils/splitmix_hash.h"
 
 namespace vector_db::indices::hnsw
@@ -27,6 +35,15 @@ struct params : params_t
   unsigned int ef_construction_;  // candidate list size during construction
   unsigned int ef_search_;        // candidate list size during search
   double ml_;                     // layer selection multiplier
+  bool search_pending_{ true };   // brute-force the not yet linked vectors during search
+  unsigned int prefetch_distance_{ 2 };  // neighbours prefetched ahead of the one being scored, 0 disables
+  bool reorder_{ true };                 // renumber slots in graph order after bulk builds and heavy churn
+  bool extend_candidates_{ false };       // also consider the candidates' neighbours when selecting links
+  bool keep_pruned_connections_{ true };  // fill up neighbour lists with pruned candidates
+  quantizer_type quantizer_{ quantizer_type::none };  // codes searches traverse with, re-ranked on full vectors
+
+  // version 0 held the first four params only, and no graph
+  static constexpr std::uint32_t format_version = 1;
 
   explicit params( const distance::dist_type _dist_type = distance::dist_type::cosine,
                    const unsigned int _m = 16,
@@ -59,9 +76,16 @@ struct params : params_t
     os.write( reinterpret_cast< const char* >( &M_ ), sizeof( M_ ) );
     os.write( reinterpret_cast< const char* >( &ef_construction_ ), sizeof( ef_construction_ ) );
     os.write( reinterpret_cast< const char* >( &ef_search_ ), sizeof( ef_search_ ) );
+    os.write( reinterpret_cast< const char* >( &search_pending_ ), sizeof( search_pending_ ) );
+    os.write( reinterpret_cast< const char* >( &prefetch_distance_ ), sizeof( prefetch_distance_ ) );
+    os.write( reinterpret_cast< const char* >( &reorder_ ), sizeof( reorder_ ) );
+    os.write( reinterpret_cast< const char* >( &extend_candidates_ ), sizeof( extend_candidates_ ) );
+    os.write( reinterpret_cast< const char* >( &keep_pruned_connections_ ), sizeof( keep_pruned_connections_ ) );
+    os.write( reinterpret_cast< const char* >( &quantizer_ ), sizeof( quantizer_ ) );
   }
 
-  static params deserialize( std::istream& is )
+  // the fields a payload of `version` lacks keep their defaults
+  static params deserialize( std::istream& is, const std::uint32_t version = format_version )
   {
     distance::dist_type dist_type;
     unsigned int M, ef_construction, ef_search;
@@ -69,13 +93,34 @@ struct params : params_t
     is.read( reinterpret_cast< char* >( &M ), sizeof( M ) );
     is.read( reinterpret_cast< char* >( &ef_construction ), sizeof( ef_construction ) );
     is.read( reinterpret_cast< char* >( &ef_search ), sizeof( ef_search ) );
-    return params( dist_type, M, ef_construction, ef_search );
+    params p( dist_type, M, ef_construction, ef_search );
+    if ( version == 0 )
+      return p;
+    is.read( reinterpret_cast< char* >( &p.search_pending_ ), sizeof( p.search_pending_ ) );
+    is.read( reinterpret_cast< char* >( &p.prefetch_distance_ ), sizeof( p.prefetch_distance_ ) );
+    is.read( reinterpret_cast< char* >( &p.reorder_ ), sizeof( p.reorder_ ) );
+    is.read( reinterpret_cast< char* >( &p.extend_candidates_ ), sizeof( p.extend_candidates_ ) );
+    is.read( reinterpret_cast< char* >( &p.keep_pruned_connections_ ), sizeof( p.keep_pruned_connections_ ) );
+    is.read( reinterpret_cast< char* >( &p.quantizer_ ), sizeof( p.quantizer_ ) );
+    return p;
   }
 
-  std::unique_ptr< params_t > clone() const override
-  {
-    return std::make_unique< params >( dist_type_, M_, ef_construction_, ef_search_ );
-  }
+  std::unique_ptr< params_t > clone() const override { return std::make_unique< params >( *this ); }
+};
+
+struct stats : stats_t
+{
+  // searches
+  std::uint64_t queries_{ 0 };
+  query_stats totals_;  // summed over all queries
+
+  // build
+  std::uint64_t inserts_{ 0 };       // vectors linked into the graph, updates included
+  double inserts_per_sec_{ 0.0 };    // over the time spent linking them
+  std::uint64_t pruned_edges_{ 0 };  // candidate links dropped by neighbour selection
+  std::vector< double > average_degree_;  // average_degree_[level] = mean neighbour count of the live nodes on `level`
+  std::size_t live_count_{ 0 };
+  std::size_t slot_count_{ 0 };
 };
 
 // Layered HNSW graph index for KNN over float_vector
@@ -83,69 +128,264 @@ class index : public index_t
 {
   using col_ptr = std::shared_ptr< collection >;
   using index_t::wk_col_ptr;
-  using cand_t = std::pair< double, id_t >;
+  using slot_t = std::uint32_t;
+  using cand_t = std::pair< double, slot_t >;
   using cand_set_t = std::set< cand_t >;
   using id_set = std::unordered_set< id_t, hash >;
-  using id_map = std::unordered_map< id_t, int, hash >;
-  using visited_map_t = std::unordered_map< id_t, bool, hash >;
-  using neighbours_t = std::unordered_map< id_t, id_set, hash >;
+  using slot_map = std::unordered_map< id_t, slot_t, hash >;
+  using links_t = std::vector< slot_t >;
+
+  // read-only view over one neighbour list
+  struct links_view
+  {
+    const slot_t* begin_;
+    const slot_t* end_;
+    const slot_t* begin() const { return begin_; }
+    const slot_t* end() const { return end_; }
+    size_t size() const { return end_ - begin_; }
+    slot_t operator[]( size_t i ) const { return begin_[ i ]; }
+  };
+  using vector_map = std::unordered_map< id_t, float_vector, hash >;
+
+  // max number of pending vectors linked per exclusive lock acquisition of the indexer
+  static constexpr size_t indexer_batch_size = 16;
+  // neighbour lists are repaired once this many deletes per live node (1 / ratio) have piled up
+  static constexpr size_t repair_ratio = 20;
+  // with params_.reorder_, the slots are renumbered once this many inserts, reuses and deletes per live node
+  // (1 / ratio) have piled up since the last time
+  static constexpr size_t reorder_ratio = 2;
+  // filtered searches: slots sampled to estimate the filter's selectivity, the estimated number of
+  // matches under which they are scanned instead, and the selectivity under which traversal hops over
+  // rejected nodes to their neighbours
+  static constexpr size_t filter_sample_size = 128;
+  static constexpr double brute_force_matches = 256;
+  static constexpr double two_hop_selectivity = 0.3;
+  // hops on this layer and above are counted together
+  static constexpr size_t tracked_layers = 16;
+  // the quantizer trains once the index holds this many vectors: the ranges of a handful of them would clamp
+  // every later vector
+  static constexpr size_t min_quantizer_sample = 1000;
+
+  struct layer_filter
+  {
+    const std::function< bool( id_t ) >* accepts_;  // nodes it rejects never enter the result, null accepts all
+    bool two_hop_;                                   // rejected nodes are hopped over, not scored
+  };
 
-  mutable std::shared_mutex mutex_;
+  // Per-thread working memory of search_layer, kept across calls so that a search allocates nothing once
+  // warmed up. A slot is visited when its mark equals the current epoch, so resetting is a bump.
+  struct layer_scratch
+  {
+    std::vector< std::uint16_t > marks_;
+    std::uint16_t epoch_{ 0 };
+    std::vector< cand_t > candidates_;  // min-heap on distance
+    std::vector< cand_t > result_;      // max-heap on distance
+
+    void reset( size_t slots );
+    bool visit( slot_t slot );
+  };
+
+  mutable std::shared_mutex mutex_;  // guards the graph
+  mutable std::mutex pending_mutex_;  // guards to_be_inserted_, to_be_removed_, in_flight_ and stop_indexer_
+  std::condition_variable pending_cv_;
+  std::thread indexer_;
+  bool stop_indexer_{ false };
 
   params params_;
 
-  id_set inserted_;
-  id_set to_be_inserted_;
+  vector_map to_be_inserted_;  // upserted vectors waiting for the indexer
   id_set to_be_removed_;
-  id_map node_levels_;                      // max level for each node
-  std::vector< neighbours_t > neighbours_;  // neighbours_[level][node] = neighbors of `node` in the `level`
-  id_t entry_point_ = 0;                    // global entry point (node with max level)
-  int max_layer_ = -1;                      // highest layer in the graph
+  size_t in_flight_{ 0 };  // changes the indexer took off the queues and is still applying
+
+  // Nodes live in dense slots. Deleted slots stay in the graph (and traversable) until their former
+  // neighbours are repaired in bulk every now and then. Only then may a new id reuse them: until the
+  // repair, the edges into a deleted slot still lead to its old region. Re-inserting the deleted id
+  // itself updates its slot in place.
+  int dim_{ 0 };
+  std::vector< float > data_;                  // data_[slot * dim_, (slot + 1) * dim_) = vector of `slot`
+  std::vector< id_t > slot_ids_;               // slot -> id
+  slot_map id_to_slot_;                        // id -> slot, for live and not yet reused deleted slots
+  std::vector< slot_t > links0_;               // layer 0 adjacency, a block of [count, M0_ neighbours] per slot
+  std::vector< std::vector< links_t > > upper_links_;  // upper_links_[slot][level - 1] = neighbours in `level`
+  std::vector< std::uint8_t > deleted_;        // 1 if the slot's vector was removed
+  std::vector< slot_t > free_slots_;           // deleted slots no live node links to since the last repair()
+  size_t live_count_{ 0 };
+  size_t deleted_since_repair_{ 0 };
+  size_t changed_since_reorder_{ 0 };
+  std::uint64_t generation_{ 0 };  // bumped by every clear, a renumbering prepared across one is dropped
+  slot_t entry_point_ = 0;  // global entry point (node with max level)
+  int max_layer_ = -1;      // highest layer in the graph
+
+  // with params_.quantizer_ set, searches traverse these codes and only re-rank on data_
+  sq8_quantizer sq8_;                  // trained once min_quantizer_sample vectors are linked or queued
+  std::vector< std::uint8_t > codes_;  // codes_[slot * dim_, (slot + 1) * dim_) = code of `slot`
+
+  // search counters, flushed once per query
+  std::atomic< std::uint64_t > queries_{ 0 };
+  std::atomic< std::uint64_t > distance_computations_{ 0 };
+  std::atomic< std::uint64_t > nodes_expanded_{ 0 };
+  std::atomic< std::uint64_t > visited_{ 0 };
+  std::array< std::atomic< std::uint64_t >, tracked_layers > hops_per_layer_{};
+
+  // build counters, only updated under the exclusive graph lock
+  std::uint64_t inserts_{ 0 };
+  std::chrono::nanoseconds insert_time_{ 0 };
+  std::uint64_t pruned_edges_{ 0 };
+
+  // set when the graph was loaded from disk: init() then only re-queues what was pending at save time
+  bool restored_{ false };
+  std::vector< id_t > restored_pending_;
 
 public:
   index() = delete;
 
   explicit index( wk_col_ptr _collection_ptr, const params& _params = params( distance::dist_type::cosine ) );
+  ~index() override;
 
   void clear();
 
   void init() override;
 
-  // Search top-k neighbors for a query
-  void search_knn( const float_vector& query, unsigned int k, std::vector< score_pair >& result );
+  // Search top-k neighbors for a query, exploring at least `ef_search` candidates on layer 0. Quantized
+  // indices re-rank the best k * `rerank_factor` of them (all when unset) against the full vectors.
+  // Filtered searches only return accepted vectors, and scan them directly when very few are.
+  void search_knn( const float_vector& query,
+                   unsigned int k,
+                   std::vector< score_pair >& result,
+                   const search_params_t& search_params = {} );
 
-  bool search_for_top_k( const float_vector& query_vector, unsigned int k, std::vector< score_pair >& results ) override;
+  // search_knn for many queries at once: the graph and the collection are locked once for the whole batch
+  // and the queries are spread over the calling thread and up to `threads` - 1 workers of the shared
+  // thread pool (all of them when 0). The pool's workers keep their scratch space from one batch to the
+  // next.
+  void search_knn_batch( const std::vector< float_vector >& queries,
+                         unsigned int k,
+                         std::vector< std::vector< score_pair > >& results,
+                         const search_params_t& search_params = {},
+                         unsigned int threads = 0 );
+
+  bool search_for_top_k( const float_vector& query_vector,
+                         unsigned int k,
+                         std::vector< score_pair >& results,
+                         const search_params_t& search_params = {} ) override;
+
+  bool search_for_top_k_batch( const std::vector< float_vector >& queries,
+                               unsigned int k,
+                               std::vector< std::vector< score_pair > >& results,
+                               const search_params_t& search_params = {} ) override;
 
   index_type get_index_type() const override { return index_type::hnsw; }
 
   const params* get_params() const override { return &params_; }
 
-  void serialize( std::ostream& os ) const override { params_.serialize( os ); }
+  std::unique_ptr< stats_t > get_stats() const override;
 
-  // Incremental update hooks; for now we invalidate and rebuild lazily
+  // format version and params, followed by the graph and the ids still pending, see deserialize()
+  void serialize( std::ostream& os ) const override;
+  static std::unique_ptr< index > deserialize( std::istream& is, wk_col_ptr _collection_ptr );
+
+  // Incremental update hooks; changes are queued and linked into the graph by the background indexer
   void on_vectors_added( const std::vector< id_t >& new_ids ) override;
   void on_vectors_removed( const std::vector< id_t >& removed_ids ) override;
 
+  // number of queued insertions and removals the indexer has not applied yet
+  size_t pending() const;
+
+  // number of slots in the graph, live or deleted
+  size_t slot_count() const;
+
 private:
   void no_lock_clear();
 
-  cand_set_t search_layer( const float_vector& query,
-                           const id_set& entry_points,
+  void start_indexer();
+  void stop_indexer();
+  void indexer_loop();
+
+  const float* row( slot_t slot ) const { return data_.data() + static_cast< size_t >( slot ) * dim_; }
+  int level_of( slot_t slot ) const { return static_cast< int >( upper_links_[ slot ].size() ); }
+  unsigned int max_links( int level ) const { return level == 0 ? params_.M0_ : params_.M_; }
+  const slot_t* links0_block( slot_t slot ) const { return links0_.data() + static_cast< size_t >( slot ) * ( params_.M0_ + 1 ); }
+  const std::uint8_t* code( slot_t slot ) const { return codes_.data() + static_cast< size_t >( slot ) * dim_; }
+  bool quantized() const { return params_.quantizer_ == quantizer_type::sq8 && sq8_.trained(); }
+  // trains on copies of the vectors, touching no index state; empty without vectors
+  static sq8_quantizer train_quantizer( const std::vector< const float_vector* >& sample );
+  // installs `quantizer` and encodes every slot with it. The caller holds the graph lock exclusively.
+  void adopt_quantizer( sq8_quantizer&& quantizer );
+  // whether sq8_ is trained, read under the shared graph lock
+  bool has_quantizer() const;
+  // copies of the live and queued vectors, or none while there are fewer than min_quantizer_sample
+  std::vector< float_vector > quantizer_sample() const;
+  void encode( slot_t slot );
+  links_view links( slot_t slot, int level ) const;
+  void set_links( slot_t slot, int level, const links_t& neighbours );
+
+  // `result` only ever holds live, accepted slots, the others are still expanded. `use_codes` scores
+  // against the quantized codes instead of the full vectors. The work done is added to `stats` if set.
+  // `prefetch_distance` overrides params_.prefetch_distance_.
+  cand_set_t search_layer( const float* query,
+                           const links_t& entry_points,
                            unsigned int ef,
-                           unsigned int layer,
-                           const col_ptr& col );
+                           int level,
+                           bool use_codes = false,
+                           const layer_filter& filter = {},
+                           query_stats* stats = nullptr,
+                           std::optional< unsigned int > prefetch_distance = std::nullopt ) const;
+
+  // Ids and distances of the k nearest graph and pending vectors, best first. The caller holds the graph
+  // lock; concurrent calls are safe. The work done is added to the search counters and to `stats`.
+  std::vector< std::pair< double, id_t > > search_ids( const float_vector& query,
+                                                       unsigned int k,
+                                                       const search_params_t& search_params,
+                                                       query_stats& stats );
 
-  void insert( id_t id, const col_ptr& col );
+  // fraction of a sample of the live slots whose ids `accepts` lets through
+  double estimate_selectivity( const std::function< bool( id_t ) >& accepts ) const;
 
-  void build( const col_ptr& col );
+  void upsert( id_t id, const float_vector& vec );
+  void insert( id_t id, const float_vector& vec );
+  void update( slot_t slot, const float_vector& vec );
+  void remove( id_t id );
+
+  // find neighbours for `slot` from the entry point down, and link them in both directions
+  void link( slot_t slot );
+  void connect( slot_t slot, int level, const cand_set_t& candidates );
+
+  // replace links to deleted slots with links to their live neighbours, then compact()
+  void repair();
+  // Drop the deleted slots at the end and clear the links of the others, which new ids reuse. Only valid
+  // right after repair(), once no live node links to a deleted slot.
+  void compact();
+
+  // The graph with its live slots renumbered in BFS order over layer 0, so that neighbours sit close in
+  // memory. Deleted slots are dropped on the way.
+  struct layout
+  {
+    std::vector< float > data_;
+    std::vector< std::uint8_t > codes_;
+    std::vector< id_t > slot_ids_;
+    slot_map id_to_slot_;
+    std::vector< slot_t > links0_;
+    std::vector< std::vector< links_t > > upper_links_;
+    slot_t entry_point_ = 0;
+    int max_layer_ = -1;
+  };
+  // reads the graph only: the indexer builds it under the shared lock while searches go on
+  layout reordered() const;
+  void adopt( layout&& renumbered );
+  void reorder() { adopt( reordered() ); }
+  // the indexer's renumbering: prepared under a shared lock, swapped in under an exclusive one
+  void reorder_in_background( std::unique_lock< std::shared_mutex >& lock );
 
-  // compute distance using vectors stored in the owning collection via weak ptr
-  // arguments are internal indices
-  double dist( id_t _a, id_t _b, const col_ptr& col ) const;
-  double dist( const float_vector& q, id_t _b, const col_ptr& col ) const;
+  double dist( slot_t _a, slot_t _b ) const;
+  double dist( const float* q, slot_t _b ) const;
 
   int generate_random_level() const;
 
-  cand_set_t select_neighbors_heuristic( const cand_set_t& candidates, unsigned int no_of_cand ) const;
+  // vector_db::select_neighbors_heuristic over `candidates`, widened to their live neighbours on `level` with
+  // params_.extend_candidates_
+  std::vector< cand_t > select_neighbors_heuristic( slot_t base,
+                                                    const cand_set_t& candidates,
+                                                    unsigned int no_of_cand,
+                                                    int level ) const;
 };
 }  // namespace vector_db::indices::hnsw
@@ -3,9 +3,12 @@
 //
 #pragma once
 #include <cstdint>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <vector>
 
+#include "core/filter.h"
 #include "core/float_vector.h"
 #include "logger/logger.h"
 
@@ -18,9 +21,56 @@ enum class index_type : std::uint8_t
 {
   ivf_flat = 0,
   hnsw = 1,
+  ivf_pq = 2,
   unknown = 255
 };
 
+// Work done by one search. Each index only fills the counters that apply to it.
+struct query_stats
+{
+  std::uint64_t distance_computations_{ 0 };
+  std::uint64_t nodes_expanded_{ 0 };         // hnsw: nodes whose neighbour lists were scanned
+  std::uint64_t visited_{ 0 };                // hnsw: nodes marked visited, over all layers
+  std::vector< std::uint64_t > hops_per_layer_;  // hnsw: hops_per_layer_[level] = nodes expanded on `level`
+  std::uint64_t lists_probed_{ 0 };           // ivf: inverted lists scanned
+
+  void merge( const query_stats& other )
+  {
+    distance_computations_ += other.distance_computations_;
+    nodes_expanded_ += other.nodes_expanded_;
+    visited_ += other.visited_;
+    lists_probed_ += other.lists_probed_;
+    if ( hops_per_layer_.size() < other.hops_per_layer_.size() )
+      hops_per_layer_.resize( other.hops_per_layer_.size(), 0 );
+    for ( size_t level = 0; level < other.hops_per_layer_.size(); ++level )
+      hops_per_layer_[ level ] += other.hops_per_layer_[ level ];
+  }
+};
+
+// Per-query overrides of an index's search parameters; unset fields fall back to the index params.
+// Each index only honours the knobs that apply to it.
+struct search_params_t
+{
+  std::optional< unsigned int > ef_search_;  // hnsw: candidate list size
+  std::optional< unsigned int > n_probe_;    // ivf: number of clusters to scan
+  std::optional< float > rerank_factor_;     // indices with an exact re-rank stage: re-rank k * factor candidates
+  std::optional< unsigned int > prefetch_distance_;  // rows or codes prefetched ahead of the one being scored
+  std::optional< metadata_filter > filter_;  // only vectors whose metadata matches are returned
+
+  // filter_ bound to the collection's metadata, set by the collection before the index is searched
+  std::function< bool( id_t ) > accepts_;
+
+  // when set, the work done by the search is added to it
+  query_stats* stats_{ nullptr };
+};
+
+// Index payloads open with format_tag and a format version, then the params. Those written before
+// versioning open with the params, whose first byte (the metric) is never format_tag.
+inline constexpr std::uint8_t format_tag = 0xf0;
+void write_format_version( std::ostream& os, std::uint32_t version );
+// the version of the payload, 0 for one written before versioning
+std::uint32_t read_format_version( std::istream& is );
+
 struct params_t
 {
   virtual ~params_t() = default;
@@ -28,6 +78,12 @@ struct params_t
   virtual std::unique_ptr< params_t > clone() const = 0;
 };
 
+// Snapshot of the counters an index keeps about its searches and its build, since it was built or loaded
+struct stats_t
+{
+  virtual ~stats_t() = default;
+};
+
 class index_t
 {
 public:
@@ -54,11 +110,32 @@ public:
   virtual ~index_t() = default;
 
   virtual void init() {}
-  virtual bool search_for_top_k( const float_vector& query_vector, unsigned int k, std::vector< score_pair >& results ) = 0;
+  // retrain whatever the index learned from the data (e.g. centroids) on the current vectors
+  virtual void retrain() {}
+  virtual bool search_for_top_k( const float_vector& query_vector,
+                                 unsigned int k,
+                                 std::vector< score_pair >& results,
+                                 const search_params_t& search_params = {} ) = 0;
+  // Searches every query in turn, results[i] being the top-k of queries[i]. Indices that can share locks
+  // and scratch space between the queries override it.
+  virtual bool search_for_top_k_batch( const std::vector< float_vector >& queries,
+                                       const unsigned int k,
+                                       std::vector< std::vector< score_pair > >& results,
+                                       const search_params_t& search_params = {} )
+  {
+    results.clear();
+    results.resize( queries.size() );
+    bool success = true;
+    for ( size_t i = 0; i < queries.size(); ++i )
+      success = search_for_top_k( queries[ i ], k, results[ i ], search_params ) && success;
+    return success;
+  }
   virtual index_type get_index_type() const { return index_type::unknown; }
 
   virtual const params_t* get_params() const { return nullptr; }
 
+  virtual std::unique_ptr< stats_t > get_stats() const { return nullptr; }
+
   // Serialization
   virtual void serialize( std::ostream& os ) const = 0;
   static std::unique_ptr< index_t > deserialize( std::istream& is, const std::weak_ptr< collection >& col_ptr );
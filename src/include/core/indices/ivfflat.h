@@ -3,20 +3,67 @@
 //
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <optional>
 #include <shared_mutex>
+#include <thread>
+#include <unordered_map>
 
 #include "core/distance.h"
+#include "core/utils/proximity_graph.h"
+#include "core/utils/quantizer.h"
+#include "core/utils/splitmix_hash.h"
 #include "index.h"
 
 namespace vector_db::indices::ivf_flat
 {
 
+// how the lists to probe are picked
+enum class coarse_quantizer : std::uint8_t
+{
+  flat = 0,   // every centroid is scored, only the probed ones are sorted
+  graph = 1,  // a graph over the centroids is searched, for a large k_
+};
+
 struct params : params_t
 {
   distance::dist_type dist_type_{ distance::dist_type::euclidean };
   unsigned int k_{ 100 };             // number of clusters
   unsigned int n_probe_{ 10 };        // number of clusters to search
-  size_t rebuild_threshold_{ 1000 };  // rebuild after this many changes
+  size_t rebuild_threshold_{ 1000 };  // check for drift after this many changes
+  unsigned int prefetch_distance_{ 2 };  // centroids / clusters prefetched ahead of the one being scanned, 0 disables
+  float drift_threshold_{ 0.2f };  // retrain once vectors land this much further from their centroid than at training, 0 always
+  unsigned int training_sample_{ 256 };  // k-means trains on this many vectors per cluster, 0 on all of them
+  quantizer_type quantizer_{ quantizer_type::none };  // sq8: lists hold 8-bit codes instead of the vectors
+  float rerank_factor_{ 0.0f };  // re-rank k * factor candidates on the full vectors, 0 returns the scanned distances
+  // euclidean: lists that can't hold a vector closer than the k-th best so far are skipped, and probing stops once
+  // no further list can. n_probe_ then only caps the probed lists.
+  bool adaptive_probe_{ false };
+  size_t probe_budget_{ 0 };  // probing stops once this many vectors were scanned, 0 never
+  coarse_quantizer coarse_{ coarse_quantizer::flat };
+  unsigned int coarse_ef_{ 64 };  // graph: candidate lists of the centroid search, at least n_probe_ long
+  // a search that has at least this many vectors to scan splits its lists across scan_threads_ threads, 0 never.
+  // Adaptive searches stay on one thread, their bound tightens list after list. The searching thread is joined by
+  // workers of the shared thread pool, which all concurrent searches draw from.
+  size_t parallel_scan_threshold_{ 0 };
+  unsigned int scan_threads_{ 0 };  // the searching thread and every pool worker when 0
+  // balanced k-means: builds cap every list at this multiple (at least 1) of the mean list size, 0 leaves them
+  // as k-means finds them
+  float max_list_imbalance_{ 0.0f };
+  // SOAR: every vector is also listed in a second cluster, chosen so that its residual to that centroid is close
+  // to orthogonal to the one to its own. A query the first list ranks badly then likely finds it in the second.
+  bool spill_{ false };
+  float spill_lambda_{ 1.0f };  // spill_: weight of the second residual's component along the first one
+  // Maintenance, run in the background after updates: a list that outgrew split_factor_ (at least 2) times the mean
+  // list size is split in two by a local 2-means, and one that shrank below merge_factor_ (at most 0.5) times the
+  // mean is dissolved into its neighbours. 0 disables either.
+  float split_factor_{ 0.0f };
+  float merge_factor_{ 0.0f };
+
+  // version 0 held the first four params only, and no lists
+  static constexpr std::uint32_t format_version = 1;
 
   explicit params( distance::dist_type dist_type = distance::dist_type::euclidean,
                    unsigned int k = 100,
@@ -35,9 +82,26 @@ struct params : params_t
     os.write( reinterpret_cast< const char* >( &k_ ), sizeof( k_ ) );
     os.write( reinterpret_cast< const char* >( &n_probe_ ), sizeof( n_probe_ ) );
     os.write( reinterpret_cast< const char* >( &rebuild_threshold_ ), sizeof( rebuild_threshold_ ) );
+    os.write( reinterpret_cast< const char* >( &prefetch_distance_ ), sizeof( prefetch_distance_ ) );
+    os.write( reinterpret_cast< const char* >( &drift_threshold_ ), sizeof( drift_threshold_ ) );
+    os.write( reinterpret_cast< const char* >( &training_sample_ ), sizeof( training_sample_ ) );
+    os.write( reinterpret_cast< const char* >( &quantizer_ ), sizeof( quantizer_ ) );
+    os.write( reinterpret_cast< const char* >( &rerank_factor_ ), sizeof( rerank_factor_ ) );
+    os.write( reinterpret_cast< const char* >( &adaptive_probe_ ), sizeof( adaptive_probe_ ) );
+    os.write( reinterpret_cast< const char* >( &probe_budget_ ), sizeof( probe_budget_ ) );
+    os.write( reinterpret_cast< const char* >( &coarse_ ), sizeof( coarse_ ) );
+    os.write( reinterpret_cast< const char* >( &coarse_ef_ ), sizeof( coarse_ef_ ) );
+    os.write( reinterpret_cast< const char* >( &parallel_scan_threshold_ ), sizeof( parallel_scan_threshold_ ) );
+    os.write( reinterpret_cast< const char* >( &scan_threads_ ), sizeof( scan_threads_ ) );
+    os.write( reinterpret_cast< const char* >( &max_list_imbalance_ ), sizeof( max_list_imbalance_ ) );
+    os.write( reinterpret_cast< const char* >( &spill_ ), sizeof( spill_ ) );
+    os.write( reinterpret_cast< const char* >( &spill_lambda_ ), sizeof( spill_lambda_ ) );
+    os.write( reinterpret_cast< const char* >( &split_factor_ ), sizeof( split_factor_ ) );
+    os.write( reinterpret_cast< const char* >( &merge_factor_ ), sizeof( merge_factor_ ) );
   }
 
-  static params deserialize( std::istream& is )
+  // the fields a payload of `version` lacks keep their defaults
+  static params deserialize( std::istream& is, const std::uint32_t version = format_version )
   {
     distance::dist_type dist_type;
     unsigned int k, n_probe;
@@ -46,13 +110,47 @@ struct params : params_t
     is.read( reinterpret_cast< char* >( &k ), sizeof( k ) );
     is.read( reinterpret_cast< char* >( &n_probe ), sizeof( n_probe ) );
     is.read( reinterpret_cast< char* >( &rebuild_threshold ), sizeof( rebuild_threshold ) );
-    return params( dist_type, k, n_probe, rebuild_threshold );
+    params p( dist_type, k, n_probe, rebuild_threshold );
+    if ( version == 0 )
+      return p;
+    is.read( reinterpret_cast< char* >( &p.prefetch_distance_ ), sizeof( p.prefetch_distance_ ) );
+    is.read( reinterpret_cast< char* >( &p.drift_threshold_ ), sizeof( p.drift_threshold_ ) );
+    is.read( reinterpret_cast< char* >( &p.training_sample_ ), sizeof( p.training_sample_ ) );
+    is.read( reinterpret_cast< char* >( &p.quantizer_ ), sizeof( p.quantizer_ ) );
+    is.read( reinterpret_cast< char* >( &p.rerank_factor_ ), sizeof( p.rerank_factor_ ) );
+    is.read( reinterpret_cast< char* >( &p.adaptive_probe_ ), sizeof( p.adaptive_probe_ ) );
+    is.read( reinterpret_cast< char* >( &p.probe_budget_ ), sizeof( p.probe_budget_ ) );
+    is.read( reinterpret_cast< char* >( &p.coarse_ ), sizeof( p.coarse_ ) );
+    is.read( reinterpret_cast< char* >( &p.coarse_ef_ ), sizeof( p.coarse_ef_ ) );
+    is.read( reinterpret_cast< char* >( &p.parallel_scan_threshold_ ), sizeof( p.parallel_scan_threshold_ ) );
+    is.read( reinterpret_cast< char* >( &p.scan_threads_ ), sizeof( p.scan_threads_ ) );
+    is.read( reinterpret_cast< char* >( &p.max_list_imbalance_ ), sizeof( p.max_list_imbalance_ ) );
+    is.read( reinterpret_cast< char* >( &p.spill_ ), sizeof( p.spill_ ) );
+    is.read( reinterpret_cast< char* >( &p.spill_lambda_ ), sizeof( p.spill_lambda_ ) );
+    is.read( reinterpret_cast< char* >( &p.split_factor_ ), sizeof( p.split_factor_ ) );
+    is.read( reinterpret_cast< char* >( &p.merge_factor_ ), sizeof( p.merge_factor_ ) );
+    return p;
   }
 
-  std::unique_ptr< params_t > clone() const override
-  {
-    return std::make_unique< params >( dist_type_, k_, n_probe_, rebuild_threshold_ );
-  }
+  std::unique_ptr< params_t > clone() const override { return std::make_unique< params >( *this ); }
+};
+
+struct stats : stats_t
+{
+  // searches, since the index was created or loaded
+  std::uint64_t queries_{ 0 };
+  query_stats totals_;  // summed over all queries
+
+  // lists
+  std::size_t list_count_{ 0 };
+  std::size_t vector_count_{ 0 };  // listed vectors, spilled copies included
+  std::size_t largest_list_{ 0 };
+  // list_size_histogram_[0] = empty lists, list_size_histogram_[b] = lists of [2^(b - 1), 2^b) vectors
+  std::vector< std::uint64_t > list_size_histogram_;
+
+  // maintenance, since the index was created or loaded
+  std::uint64_t lists_split_{ 0 };
+  std::uint64_t lists_merged_{ 0 };
 };
 
 class index : public index_t
@@ -61,35 +159,222 @@ class index : public index_t
   mutable std::shared_mutex mutex_;
   params params_;
 
+  // An inverted list: the members' vectors (or their sq8 codes) are stored inline, row after row, so that
+  // a probe streams through one contiguous block
   struct cluster
   {
-    float_vector centroid;
+    float_vector centroid;  // kept at the mean of the members as vectors come and go
     std::vector< id_t > vector_ids;
+    std::vector< float > data;  // data[m * dim, (m + 1) * dim) = vector of vector_ids[m]
+    std::vector< std::uint8_t > codes;  // sq8: codes[m * dim, (m + 1) * dim) = code of vector_ids[m], data stays empty
+    size_t added_since_check{ 0 };  // members added since they were last checked for a closer cluster
+    double radius{ 0.0 };  // bounds the euclidean distance of every member to the centroid
+    size_t spilled{ 0 };   // spill_: members that are second copies, left out of the centroid's mean
+
+    const float* row( const size_t m, const int dim ) const { return data.data() + m * dim; }
+    const std::uint8_t* code( const size_t m, const int dim ) const { return codes.data() + m * dim; }
+    // the vector is coded with `sq8` when set
+    void append( const id_t id, const float* vec, const int dim, const sq8_quantizer* sq8 )
+    {
+      vector_ids.push_back( id );
+      if ( !sq8 )
+      {
+        data.insert( data.end(), vec, vec + dim );
+        return;
+      }
+      codes.resize( codes.size() + dim );
+      sq8->encode( vec, codes.data() + codes.size() - dim );
+    }
+    // member m's vector, decoded with `sq8` when set
+    void member( const size_t m, const int dim, const sq8_quantizer* sq8, float* out ) const
+    {
+      if ( sq8 )
+        sq8->decode( code( m, dim ), out );
+      else
+        std::copy( row( m, dim ), row( m, dim ) + dim, out );
+    }
+    // O(1): the last member takes the place of member m
+    void swap_remove( const size_t m, const int dim )
+    {
+      const size_t last = vector_ids.size() - 1;
+      if ( m != last )
+      {
+        vector_ids[ m ] = vector_ids[ last ];
+        if ( !data.empty() )
+          std::copy( data.begin() + last * dim, data.end(), data.begin() + m * dim );
+        if ( !codes.empty() )
+          std::copy( codes.begin() + last * dim, codes.end(), codes.begin() + m * dim );
+      }
+      vector_ids.pop_back();
+      if ( !data.empty() )
+        data.resize( last * dim );
+      if ( !codes.empty() )
+        codes.resize( last * dim );
+    }
   };
 
+  // a cluster's members are checked for a closer cluster once it grew by this fraction, against the
+  // centroids of this many of its nearest clusters
+  static constexpr double reassign_fraction = 0.1;
+  static constexpr size_t reassign_candidates = 8;
+  // spill_: the second list is the best of this many clusters nearest to the vector
+  static constexpr size_t spill_candidates = 8;
+
+  int dim_{ 0 };
+  sq8_quantizer sq8_;  // with params_.quantizer_ set, trained by every build on the vectors it clusters
   std::vector< cluster > clusters_;
+  // coarse_ == graph: links over the centroids, made by every build (and load) as the clusters are fixed
+  // until the next one
+  proximity_graph graph_;
+  // where each listed id sits: its cluster and its position in that cluster's list
+  std::unordered_map< id_t, std::pair< uint32_t, size_t >, hash > locations_;
+  std::unordered_map< id_t, std::pair< uint32_t, size_t >, hash > spills_;  // spill_: same, for the second copies
   size_t vectors_since_rebuild_{ 0 };
 
+  // Drift: mean distance of the trained vectors to their centroid, against that of the vectors assigned
+  // since the last check
+  double trained_error_{ 0.0 };
+  double added_error_sum_{ 0.0 };
+  size_t added_count_{ 0 };
+
+  // set when the lists were loaded from disk: init() then only reconciles them with the collection
+  bool restored_{ false };
+
+  // A build trains new lists on a snapshot of the collection while the current ones keep serving. The
+  // changes made in the meantime are logged, and replayed onto the new lists once they are swapped in.
+  struct change
+  {
+    std::vector< std::pair< id_t, float_vector > > added;
+    std::vector< id_t > removed;
+  };
+  std::mutex build_mutex_;                               // one build at a time
+  std::optional< std::vector< change > > replay_log_;  // set while a build runs, guarded by mutex_
+
+  // search counters, flushed once per query
+  std::atomic< std::uint64_t > queries_{ 0 };
+  std::atomic< std::uint64_t > distance_computations_{ 0 };
+  std::atomic< std::uint64_t > lists_probed_{ 0 };
+  // maintenance counters
+  std::atomic< std::uint64_t > lists_split_{ 0 };
+  std::atomic< std::uint64_t > lists_merged_{ 0 };
+
+  // drift triggered rebuilds and maintenance passes run here, off the upserting thread
+  std::mutex rebuilder_mutex_;  // guards rebuilder_, rebuild_running_ and rebuild_pending_
+  std::thread rebuilder_;
+  bool rebuild_running_{ false };  // a rebuild or a maintenance pass
+  bool rebuild_pending_{ false };  // asked for during a maintenance pass, runs right after it
+
 public:
   index() = delete;
   explicit index( wk_col_ptr _collection_ptr, const params& _params = params() );
+  ~index() override;
 
   void init() override;
-  bool search_for_top_k( const float_vector& query_vector, unsigned int k, std::vector< score_pair >& results ) override;
+  bool search_for_top_k( const float_vector& query_vector,
+                         unsigned int k,
+                         std::vector< score_pair >& results,
+                         const search_params_t& search_params = {} ) override;
   index_type get_index_type() const override { return index_type::ivf_flat; }
 
   const params* get_params() const override { return &params_; }
 
-  void serialize( std::ostream& os ) const override { params_.serialize( os ); }
+  std::unique_ptr< stats_t > get_stats() const override;
+
+  // params followed by the centroids, the inverted lists with their vectors or codes, the drift counters,
+  // the sq8 quantizer if any and the lists of the spilled copies, see deserialize()
+  void serialize( std::ostream& os ) const override;
+  static std::unique_ptr< index > deserialize( std::istream& is, wk_col_ptr _collection_ptr );
+
+  // retrain the centroids on the current vectors and reassign them
+  void retrain() override { build(); }
+
+  // blocks until the background rebuild or maintenance pass, if one is running, has been swapped in
+  void wait_for_rebuild();
 
   void on_vectors_added( const std::vector< id_t >& new_ids ) override;
   void on_vectors_removed( const std::vector< id_t >& removed_ids ) override;
 
 private:
+  // trains on the collection, or leaves the index untrained while it holds fewer than min_training_size()
+  // vectors. Searches scan the collection exhaustively until then.
   void build();
+  void build( const collection& col );
+  size_t min_training_size() const;
+  // an untrained index is trained in the background once the collection holds min_training_size() vectors,
+  // unless a build is running already: that one replays the vectors added meanwhile
+  bool can_train();
+  // starts a rebuild (or else a maintenance pass) in the background unless one is running already. A rebuild
+  // asked for during a maintenance pass follows it.
+  void schedule_background( bool rebuild );
+  void schedule_rebuild() { schedule_background( true ); }
+  // the clamped maintenance factors: splitting and dissolving lists closer to the mean size would cascade
+  double split_factor() const { return std::max( 2.0, static_cast< double >( params_.split_factor_ ) ); }
+  double merge_factor() const { return std::min( 0.5, static_cast< double >( params_.merge_factor_ ) ); }
+  // true when a list is out of the bounds split_factor_ and merge_factor_ set
+  bool needs_maintenance() const;
+  // dissolves the lists under merge_factor_ then splits the ones over split_factor_, each split's 2-means running
+  // unlocked on a copy of its list
+  void maintain();
+  // moves the members of `cluster_idx` to their nearest other lists and drops it, the last cluster taking its
+  // place. The caller holds mutex_ exclusively.
+  void dissolve( size_t cluster_idx );
+  // moves the members of `cluster_idx` closer to `b` than to `a` into a new cluster, both lists then being
+  // refitted; false, leaving the list as it is, when either side would hold no primary member. The caller holds
+  // mutex_ exclusively.
+  bool split( size_t cluster_idx, const float* a, const float* b );
+  // sets the centroid to the mean of the primary members and the radius to the farthest member
+  void refit( size_t cluster_idx );
+  bool trained() const;
+  // drop listed ids that left the collection and assign the ones that joined it since the save
+  void reconcile();
   void add_vectors_incremental( const std::vector< id_t >& new_ids );
+  // assign the vectors to their nearest cluster, moving its centroid along (mini-batch k-means). An id that
+  // is already listed is an update: it leaves its old cluster first. The caller holds mutex_ exclusively.
+  void apply_added( const std::vector< std::pair< id_t, float_vector > >& vectors );
+  // move the members of `cluster_idx` that got closer to a neighbouring cluster over there
+  void reassign( size_t cluster_idx );
+  // shift the centroid of `c` for `vec` joining (+1) or leaving (-1) it
+  static void update_centroid( cluster& c, const float* vec, int sign );
+  // list maintenance that keeps locations_ and spills_ in step; the centroids are left to the caller
+  void append_member( size_t cluster_idx, id_t id, const float* vec, bool spilled = false );
+  void remove_member( size_t cluster_idx, size_t m );
+  // the entry of locations_ or spills_ of the copy of `id` listed in `cluster_idx`
+  std::pair< uint32_t, size_t >& location( id_t id, size_t cluster_idx );
+  bool is_primary( const id_t id, const size_t cluster_idx ) const
+  {
+    const auto it = locations_.find( id );
+    return it != locations_.end() && it->second.first == cluster_idx;
+  }
+  // takes `id` out of its lists and its centroid, if it is listed
+  void remove_listed( id_t id );
+  // spill_: the cluster among `candidates` (the primary one left out) that lists `vec` besides `primary`, the one
+  // minimising |vec - c|^2 + spill_lambda_ * <r, vec - c>^2 / |r|^2 with r = vec - primary.centroid
+  size_t spill_target( const float* vec,
+                       const cluster& primary,
+                       const std::vector< std::pair< double, size_t > >& candidates,
+                       const std::vector< cluster >& clusters ) const;
+  // spill_: lists a second copy of `id`, whose primary list is `primary`, if there is another cluster
+  void spill( id_t id, const float* vec, size_t primary );
   void remove_vectors_incremental( const std::vector< id_t >& removed_ids );
-  size_t find_nearest_cluster( const float_vector& vec ) const;
+  // counts `changes` more changes; true once rebuild_threshold_ of them have piled up and the new vectors
+  // drifted away from the centroids
+  bool drifted( size_t changes );
+  // the quantizer the lists are coded with, null when they hold the vectors
+  const sq8_quantizer* quantizer() const
+  {
+    return params_.quantizer_ == quantizer_type::sq8 && sq8_.trained() ? &sq8_ : nullptr;
+  }
+  // links the centroids of `clusters` when the params ask for a graph
+  proximity_graph link_centroids( const std::vector< cluster >& clusters, int dim ) const;
+  bool graph_ready() const { return params_.coarse_ == coarse_quantizer::graph && graph_.size() == clusters_.size(); }
+  proximity_graph::point_fn centroid_point() const
+  {
+    return [ this ]( const uint32_t j ) { return static_cast< const float* >( clusters_[ j ].centroid.data_.get() ); };
+  }
+  // the (up to) `count` clusters nearest to `vec` with their centroid distance, nearest first
+  std::vector< std::pair< double, size_t > > nearest_clusters( const float* vec, size_t count ) const;
+  // nearest cluster and the distance to its centroid
+  std::pair< size_t, double > find_nearest_cluster( const float_vector& vec ) const;
 };
 
 }  // namespace vector_db::indices::ivf_flat
\ No newline at end of file
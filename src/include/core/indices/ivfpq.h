@@ -0,0 +1,223 @@
+//
+// IVF index whose inverted lists hold product quantized residuals.
+//
+#pragma once
+
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "core/distance.h"
+#include "core/utils/splitmix_hash.h"
+#include "index.h"
+
+namespace vector_db::indices::ivf_pq
+{
+
+struct params : params_t
+{
+  distance::dist_type dist_type_{ distance::dist_type::euclidean };
+  unsigned int k_{ 100 };       // number of clusters
+  unsigned int n_probe_{ 10 };  // number of clusters to search
+  unsigned int m_{ 8 };         // sub-quantizers, each coding dim / m dimensions of the residual (at most dim)
+  unsigned int nbits_{ 8 };     // bits per sub-quantizer code, 1 to 8
+  bool fast_scan_{ false };     // 4-bit codes only: lists are scanned block-wise with 8-bit lookup tables
+  float rerank_factor_{ 0.0f };  // re-rank k * factor candidates on the full vectors, 0 returns approximate distances
+  unsigned int training_sample_{ 256 };  // vectors per centroid the quantizers train on, 0 on all of them
+  unsigned int prefetch_distance_{ 2 };  // codes prefetched ahead of the one being scanned, 0 disables
+  size_t rebuild_threshold_{ 1000 };     // check for drift after this many changes
+  float drift_threshold_{ 0.2f };  // retrain once vectors land this much further from their centroid than at training, 0 always
+
+  static constexpr std::uint32_t format_version = 1;
+
+  explicit params( distance::dist_type dist_type = distance::dist_type::euclidean,
+                   unsigned int k = 100,
+                   unsigned int n_probe = 10,
+                   unsigned int m = 8,
+                   unsigned int nbits = 8 )
+      : dist_type_( dist_type )
+      , k_( k )
+      , n_probe_( n_probe )
+      , m_( m )
+      , nbits_( nbits )
+  {
+  }
+
+  void serialize( std::ostream& os ) const override
+  {
+    os.write( reinterpret_cast< const char* >( &dist_type_ ), sizeof( dist_type_ ) );
+    os.write( reinterpret_cast< const char* >( &k_ ), sizeof( k_ ) );
+    os.write( reinterpret_cast< const char* >( &n_probe_ ), sizeof( n_probe_ ) );
+    os.write( reinterpret_cast< const char* >( &m_ ), sizeof( m_ ) );
+    os.write( reinterpret_cast< const char* >( &nbits_ ), sizeof( nbits_ ) );
+    os.write( reinterpret_cast< const char* >( &fast_scan_ ), sizeof( fast_scan_ ) );
+    os.write( reinterpret_cast< const char* >( &rerank_factor_ ), sizeof( rerank_factor_ ) );
+    os.write( reinterpret_cast< const char* >( &training_sample_ ), sizeof( training_sample_ ) );
+    os.write( reinterpret_cast< const char* >( &prefetch_distance_ ), sizeof( prefetch_distance_ ) );
+    os.write( reinterpret_cast< const char* >( &rebuild_threshold_ ), sizeof( rebuild_threshold_ ) );
+    os.write( reinterpret_cast< const char* >( &drift_threshold_ ), sizeof( drift_threshold_ ) );
+  }
+
+  static params deserialize( std::istream& is )
+  {
+    distance::dist_type dist_type;
+    unsigned int k, n_probe, m, nbits;
+    is.read( reinterpret_cast< char* >( &dist_type ), sizeof( dist_type ) );
+    is.read( reinterpret_cast< char* >( &k ), sizeof( k ) );
+    is.read( reinterpret_cast< char* >( &n_probe ), sizeof( n_probe ) );
+    is.read( reinterpret_cast< char* >( &m ), sizeof( m ) );
+    is.read( reinterpret_cast< char* >( &nbits ), sizeof( nbits ) );
+    params p( dist_type, k, n_probe, m, nbits );
+    is.read( reinterpret_cast< char* >( &p.fast_scan_ ), sizeof( p.fast_scan_ ) );
+    is.read( reinterpret_cast< char* >( &p.rerank_factor_ ), sizeof( p.rerank_factor_ ) );
+    is.read( reinterpret_cast< char* >( &p.training_sample_ ), sizeof( p.training_sample_ ) );
+    is.read( reinterpret_cast< char* >( &p.prefetch_distance_ ), sizeof( p.prefetch_distance_ ) );
+    is.read( reinterpret_cast< char* >( &p.rebuild_threshold_ ), sizeof( p.rebuild_threshold_ ) );
+    is.read( reinterpret_cast< char* >( &p.drift_threshold_ ), sizeof( p.drift_threshold_ ) );
+    return p;
+  }
+
+  std::unique_ptr< params_t > clone() const override { return std::make_unique< params >( *this ); }
+};
+
+// Vectors are assigned to their nearest coarse centroid, and their residual to it is split into m
+// sub-vectors, each coded as the index of its nearest centroid in a per sub-quantizer codebook. A search
+// builds, for every probed list, a table of the distance from the query's residual sub-vectors to every
+// codebook entry, so that a code is scored with m table lookups.
+//
+// Unlike ivf_flat, the centroids don't follow incremental updates: the codes are relative to them.
+// retrain() re-trains both quantizers on the current vectors, and a background rebuild does so once the
+// vectors doubled since the last training or drifted away from the centroids. Until the collection holds
+// k * min_points_per_centroid vectors nothing is trained and searches scan it exhaustively.
+class index : public index_t
+{
+  using index_t::wk_col_ptr;
+  mutable std::shared_mutex mutex_;
+  params params_;
+
+  // fast-scan: vectors are coded in blocks of block_size. For every sub-quantizer a block holds 16 bytes,
+  // byte i carrying the code of member i in its low nibble and that of member i + 16 in its high nibble.
+  static constexpr size_t block_size = 32;
+
+  struct cluster
+  {
+    float_vector centroid;
+    std::vector< id_t > vector_ids;
+    std::vector< std::uint8_t > codes;  // m codes per member, or m * 16 bytes per block with fast-scan
+    std::vector< float > norms;         // cosine: norm of every member
+  };
+
+  // The trained quantizers and the lists coded against them. A build fills new ones, then swaps them in.
+  struct lists
+  {
+    bool fast_scan{ false };
+    bool with_norms{ false };
+    int dim{ 0 };
+    // sub-quantizer j codes dimensions [offsets[j], offsets[j + 1]) of the residual as the nearest of the
+    // entries of codebooks[j], stored row after row
+    std::vector< size_t > offsets;
+    std::vector< std::vector< float > > codebooks;
+    std::vector< cluster > clusters;
+    // where each listed id sits: its cluster and its position in that cluster's list
+    std::unordered_map< id_t, std::pair< uint32_t, size_t >, hash > locations;
+
+    size_t sub_quantizers() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+    // nearest codebook entry of every residual sub-vector
+    void encode( const float* residual, std::uint8_t* code ) const;
+    std::uint8_t get_code( const cluster& c, size_t m, size_t j ) const;
+    void set_code( cluster& c, size_t m, size_t j, std::uint8_t code ) const;
+    void append( size_t cluster_idx, id_t id, const std::uint8_t* code, float norm );
+    // O(1): the last member takes the place of member m
+    void remove( size_t cluster_idx, size_t m );
+    void remove_listed( id_t id );
+  };
+  lists lists_;
+
+  // the lists are retrained once they hold retrain_growth times the vectors the quantizers trained on
+  static constexpr size_t retrain_growth = 2;
+  size_t trained_count_{ 0 };
+  size_t vectors_since_rebuild_{ 0 };
+
+  // Drift: mean distance of the trained vectors to their centroid, against that of the vectors assigned
+  // since the last check
+  double trained_error_{ 0.0 };
+  double added_error_sum_{ 0.0 };
+  size_t added_count_{ 0 };
+
+  // set when the lists were loaded from disk: init() then only reconciles them with the collection
+  bool restored_{ false };
+
+  // A build trains on a snapshot of the collection while the current lists keep serving. The changes
+  // made in the meantime are logged, and replayed once the new lists are swapped in.
+  struct change
+  {
+    std::vector< std::pair< id_t, float_vector > > added;
+    std::vector< id_t > removed;
+  };
+  std::mutex build_mutex_;                               // one build at a time
+  std::optional< std::vector< change > > replay_log_;  // set while a build runs, guarded by mutex_
+
+  // growth and drift triggered rebuilds run here, off the upserting thread
+  std::mutex rebuilder_mutex_;  // guards rebuilder_ and rebuild_running_
+  std::thread rebuilder_;
+  bool rebuild_running_{ false };
+
+public:
+  index() = delete;
+  // throws std::invalid_argument on parameters the quantizer can't honour
+  explicit index( wk_col_ptr _collection_ptr, const params& _params = params() );
+  ~index() override;
+
+  void init() override;
+  bool search_for_top_k( const float_vector& query_vector,
+                         unsigned int k,
+                         std::vector< score_pair >& results,
+                         const search_params_t& search_params = {} ) override;
+  index_type get_index_type() const override { return index_type::ivf_pq; }
+
+  const params* get_params() const override { return &params_; }
+
+  // format version and params, followed by the codebooks, the centroids, the coded lists and the retrain counters, see
+  // deserialize()
+  void serialize( std::ostream& os ) const override;
+  static std::unique_ptr< index > deserialize( std::istream& is, wk_col_ptr _collection_ptr );
+
+  // retrain both quantizers on the current vectors and re-encode them
+  void retrain() override { build(); }
+
+  void on_vectors_added( const std::vector< id_t >& new_ids ) override;
+  void on_vectors_removed( const std::vector< id_t >& removed_ids ) override;
+
+  // blocks until the background rebuild, if one is running, has been swapped in
+  void wait_for_rebuild();
+
+private:
+  // trains on the collection, or leaves the index untrained while it holds fewer than
+  // min_training_size() vectors
+  void build();
+  void build( const collection& col );
+  size_t min_training_size() const;
+  // starts a rebuild in the background unless one is running already
+  void schedule_rebuild();
+  // counts `changes` more changes; true once an untrained index can train, the lists doubled since the
+  // last training, or rebuild_threshold_ changes piled up and the new vectors drifted. Sizes the collection
+  // while untrained, so it must not be called with the collection locked
+  bool needs_rebuild( size_t changes );
+  // drop listed ids that left the collection and encode the ones that joined it since the save
+  void reconcile();
+  bool trained() const;
+
+  size_t codebook_size() const { return size_t{ 1 } << params_.nbits_; }
+  // nearest centroid of `vec`, and its distance
+  std::pair< size_t, double > find_nearest_cluster( const float* vec ) const;
+
+  void add_vectors_incremental( const std::vector< id_t >& new_ids );
+  // encodes the vectors into the list of their nearest centroid, an already listed id being moved. The
+  // caller holds mutex_ exclusively.
+  void apply_added( const std::vector< std::pair< id_t, float_vector > >& vectors );
+  void remove_vectors_incremental( const std::vector< id_t >& removed_ids );
+};
+
+}  // namespace vector_db::indices::ivf_pq
@@ -3,11 +3,15 @@
 //
 #pragma once
 #include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <limits>
+#include <numeric>
 #include <random>
 
 #include "../distance.h"
 #include "../float_vector.h"
+#include "util.h"
 
 namespace vector_db
 {
@@ -25,93 +29,381 @@ struct k_means_result
     }
   };
   std::vector< centroid_result > centroids;
+  double distance_sum{ 0.0 };  // over all vectors, of the distance to their centroid
+  std::uint64_t distance_computations{ 0 };
+  int iterations{ 0 };  // Lloyd iterations run on the sample
 };
 
-inline k_means_result k_means( const std::vector< float_vector >& vectors,
+namespace details
+{
+// index and distance of the centroid nearest to `row`
+inline std::pair< unsigned int, double > nearest_centroid( distance::distance_t* dist_fn,
+                                                           const float* row,
+                                                           const std::vector< float >& centroids,
+                                                           const unsigned int k,
+                                                           const int dim )
+{
+  unsigned int best = 0;
+  double best_dist = std::numeric_limits< double >::max();
+  for ( unsigned int j = 0; j < k; ++j )
+  {
+    const double d = dist_fn->compute( row, centroids.data() + static_cast< size_t >( j ) * dim, dim );
+    if ( d < best_dist )
+    {
+      best_dist = d;
+      best = j;
+    }
+  }
+  return { best, best_dist };
+}
+
+// Capacity-constrained assignment: every row goes to its nearest centroid unless that one holds `capacity`
+// rows already, the rows with the clearest choice (largest margin between their two nearest centroids)
+// being placed first. A row whose nearest centroid is full goes to the nearest one with room.
+inline std::uint64_t assign_with_capacity( distance::distance_t* dist_fn,
+                                           const float* rows,
+                                           const std::vector< float >& centroids,
+                                           const unsigned int k,
+                                           const int dim,
+                                           const size_t capacity,
+                                           const std::vector< double >& margin,
+                                           std::vector< std::pair< unsigned int, double > >& nearest )
+{
+  std::vector< size_t > order( nearest.size() );
+  std::iota( order.begin(), order.end(), 0 );
+  std::stable_sort( order.begin(), order.end(), [ & ]( const size_t a, const size_t b ) { return margin[ a ] > margin[ b ]; } );
+
+  std::uint64_t computations = 0;
+  std::vector< size_t > load( k, 0 );
+  for ( const auto i : order )
+  {
+    if ( load[ nearest[ i ].first ] < capacity )
+    {
+      ++load[ nearest[ i ].first ];
+      continue;
+    }
+    std::pair< unsigned int, double > best{ 0, std::numeric_limits< double >::max() };
+    for ( unsigned int j = 0; j < k; ++j )
+    {
+      if ( load[ j ] >= capacity )
+        continue;
+      const double d = dist_fn->compute( rows + i * dim, centroids.data() + static_cast< size_t >( j ) * dim, dim );
+      if ( d < best.second )
+        best = { j, d };
+    }
+    computations += k;
+    nearest[ i ] = best;
+    ++load[ best.first ];
+  }
+  return computations;
+}
+
+// k-means++: every next seed is drawn among `sample` with a probability proportional to its squared
+// distance to the nearest seed so far, which spreads the seeds over the data
+inline std::vector< float > k_means_plus_plus( distance::distance_t* dist_fn,
+                                               const float* rows,
+                                               const std::vector< size_t >& sample,
+                                               const unsigned int k,
+                                               const int dim,
+                                               std::mt19937_64& rng )
+{
+  std::vector< float > centroids;
+  centroids.reserve( static_cast< size_t >( k ) * dim );
+  const auto add_seed = [ & ]( const size_t row )
+  { centroids.insert( centroids.end(), rows + row * dim, rows + ( row + 1 ) * dim ); };
+
+  add_seed( sample[ std::uniform_int_distribution< size_t >( 0, sample.size() - 1 )( rng ) ] );
+  std::vector< double > weights( sample.size(), std::numeric_limits< double >::max() );
+  for ( unsigned int c = 1; c < k; ++c )
+  {
+    const float* last = centroids.data() + static_cast< size_t >( c - 1 ) * dim;
+    double total = 0.0;
+    for ( size_t i = 0; i < sample.size(); ++i )
+    {
+      const double d = std::max( 0.0, dist_fn->compute( rows + sample[ i ] * dim, last, dim ) );
+      weights[ i ] = std::min( weights[ i ], d * d );
+      total += weights[ i ];
+    }
+
+    // all remaining points coincide with a seed: any of them will do
+    if ( total <= 0.0 )
+    {
+      add_seed( sample[ std::uniform_int_distribution< size_t >( 0, sample.size() - 1 )( rng ) ] );
+      continue;
+    }
+    double target = std::uniform_real_distribution< double >( 0.0, total )( rng );
+    size_t chosen = sample.size() - 1;
+    for ( size_t i = 0; i < sample.size(); ++i )
+    {
+      target -= weights[ i ];
+      if ( target <= 0.0 )
+      {
+        chosen = i;
+        break;
+      }
+    }
+    add_seed( sample[ chosen ] );
+  }
+  return centroids;
+}
+}  // namespace details
+
+// Fewer rows than this per centroid leave k-means with centroids fitted to a handful of points: indices
+// defer training until they have k times as many vectors
+inline constexpr size_t min_points_per_centroid = 39;
+
+// Clusters `count` rows of `dim` floats into k groups. The centroids are seeded with k-means++ and
+// refined with Lloyd iterations on a random sample of `sample_size` rows (all of them when 0), then every
+// row is assigned to its nearest centroid in a single pass. The result's vector_ids are row numbers.
+// Assignment and update steps run on `threads` threads, the caller and the whole shared pool when 0. For the
+// euclidean metric, Hamerly's bounds skip the points whose centroid provably did not change.
+// With max_imbalance > 0 (at least 1) the final pass is balanced: no cluster takes more than max_imbalance
+// times count / k rows, and the centroids are then moved to the mean of the rows they got.
+inline k_means_result k_means( const float* rows,
+                               const size_t count,
+                               const int dim,
                                unsigned int k,
-                               distance::dist_type dist_type = distance::dist_type::euclidean,
-                               int max_iterations = 100 )
+                               const distance::dist_type dist_type = distance::dist_type::euclidean,
+                               const size_t sample_size = 0,
+                               const int max_iterations = 100,
+                               const std::uint64_t seed = 42,
+                               const unsigned int threads = 0,
+                               const double max_imbalance = 0.0 )
 {
-  if ( vectors.empty() || k == 0 )
+  if ( count == 0 || k == 0 || dim <= 0 )
     return {};
-  if ( vectors.size() < k )
-    k = vectors.size();
 
   distance::ptr dist_fn = distance::get_distance_instance( dist_type );
+  std::mt19937_64 rng( seed );
+  std::atomic< std::uint64_t > computations{ 0 };
 
-  k_means_result result;
-  result.centroids.reserve( k );
-
-  // 1. Initial centroids: For simplicity, pick the first k vectors.
-  // In a more robust implementation, we might use k-means++ or random selection.
-  for ( unsigned int i = 0; i < k; ++i )
+  // 1. Training sample, drawn without replacement
+  std::vector< size_t > sample( count );
+  std::iota( sample.begin(), sample.end(), 0 );
+  if ( sample_size > 0 && sample_size < count )
   {
-    result.centroids.emplace_back( vectors[ i ] );
+    for ( size_t i = 0; i < sample_size; ++i )
+      std::swap( sample[ i ], sample[ std::uniform_int_distribution< size_t >( i, count - 1 )( rng ) ] );
+    sample.resize( sample_size );
   }
+  if ( sample.size() < k )
+    k = static_cast< unsigned int >( sample.size() );
+  const size_t n = sample.size();
 
-  bool changed = true;
-  int iteration = 0;
-  while ( changed && iteration < max_iterations )
+  // 2. Seeding
+  auto centroids = details::k_means_plus_plus( dist_fn, rows, sample, k, dim, rng );
+  computations += static_cast< std::uint64_t >( k - 1 ) * n;
+  const auto centroid = [ & ]( const unsigned int j ) { return centroids.data() + static_cast< size_t >( j ) * dim; };
+
+  // 3. Lloyd iterations on the sample, until the assignments settle. upper[i] bounds the distance of
+  // point i to its centroid from above, lower[i] that to any other centroid from below.
+  const bool bounded = dist_type == distance::dist_type::euclidean;  // the bounds need the triangle inequality
+  std::vector< unsigned int > assignment( n );
+  std::vector< double > upper( n ), lower( n );
+  const auto full_scan = [ & ]( const size_t i )
   {
-    changed = false;
-    iteration++;
+    const float* row = rows + sample[ i ] * dim;
+    unsigned int best = 0;
+    double best_dist = std::numeric_limits< double >::max(), second_dist = std::numeric_limits< double >::max();
+    for ( unsigned int j = 0; j < k; ++j )
+    {
+      const double d = dist_fn->compute( row, centroid( j ), dim );
+      if ( d < best_dist )
+      {
+        second_dist = best_dist;
+        best_dist = d;
+        best = j;
+      }
+      else if ( d < second_dist )
+        second_dist = d;
+    }
+    const bool changed = best != assignment[ i ];
+    assignment[ i ] = best;
+    upper[ i ] = best_dist;
+    lower[ i ] = second_dist;
+    return changed;
+  };
 
-    // Clear vector assignments
-    for ( auto& c : result.centroids )
-      c.vector_ids.clear();
+  utils::parallel_for( n, threads, [ & ]( const size_t begin, const size_t end )
+  {
+    for ( size_t i = begin; i < end; ++i )
+      full_scan( i );
+  } );
+  computations += static_cast< std::uint64_t >( n ) * k;
 
-    // 2. Assignment step
-    for ( size_t i = 0; i < vectors.size(); ++i )
+  std::vector< float > previous;
+  std::vector< size_t > offsets( k + 1 ), members( n );
+  std::vector< double > moved( k ), half_gap( k );
+  int iteration = 0;
+  while ( iteration < max_iterations )
+  {
+    ++iteration;
+    // update: the members of every cluster are bucketed, then the clusters are averaged in parallel
+    previous = centroids;
+    std::fill( offsets.begin(), offsets.end(), 0 );
+    for ( size_t i = 0; i < n; ++i )
+      ++offsets[ assignment[ i ] + 1 ];
+    std::partial_sum( offsets.begin(), offsets.end(), offsets.begin() );
     {
-      double min_dist = std::numeric_limits< double >::max();
-      int best_centroid = -1;
-
-      for ( unsigned int j = 0; j < k; ++j )
+      auto next = offsets;
+      for ( size_t i = 0; i < n; ++i )
+        members[ next[ assignment[ i ] ]++ ] = i;
+    }
+    utils::parallel_for( k, threads, [ & ]( const size_t begin, const size_t end )
+    {
+      std::vector< double > sum( dim );
+      for ( size_t j = begin; j < end; ++j )
       {
-        double d = dist_fn->compute( vectors[ i ], result.centroids[ j ].centroid );
-        if ( d < min_dist )
+        // an emptied cluster keeps its previous centroid
+        if ( offsets[ j ] == offsets[ j + 1 ] )
+          continue;
+        std::fill( sum.begin(), sum.end(), 0.0 );
+        for ( size_t m = offsets[ j ]; m < offsets[ j + 1 ]; ++m )
         {
-          min_dist = d;
-          best_centroid = j;
+          const float* row = rows + sample[ members[ m ] ] * dim;
+          for ( int d = 0; d < dim; ++d )
+            sum[ d ] += row[ d ];
         }
+        const double size = static_cast< double >( offsets[ j + 1 ] - offsets[ j ] );
+        float* c = centroids.data() + j * dim;
+        for ( int d = 0; d < dim; ++d )
+          c[ d ] = static_cast< float >( sum[ d ] / size );
       }
-      if ( best_centroid != -1 )
-        result.centroids[ best_centroid ].vector_ids.push_back( i );
-    }
+    } );
 
-    // 3. Update step
+    // how far every centroid moved, and the two largest moves
+    double max_moved = 0.0, second_moved = 0.0;
+    unsigned int max_mover = 0;
     for ( unsigned int j = 0; j < k; ++j )
     {
-      if ( result.centroids[ j ].vector_ids.empty() )
-        continue;
+      moved[ j ] = dist_fn->compute( previous.data() + static_cast< size_t >( j ) * dim, centroid( j ), dim );
+      if ( moved[ j ] > max_moved )
+      {
+        second_moved = max_moved;
+        max_moved = moved[ j ];
+        max_mover = j;
+      }
+      else if ( moved[ j ] > second_moved )
+        second_moved = moved[ j ];
+    }
+    computations += k;
+    if ( max_moved == 0.0 )
+      break;
 
-      int dim = vectors[ 0 ].dimension_;
-      std::vector< double > sum( dim, 0.0 );
-      for ( auto idx : result.centroids[ j ].vector_ids )
+    if ( bounded )
+    {
+      // half the distance from every centroid to its nearest neighbour: a point closer than that to its
+      // own centroid can't be closer to another one
+      utils::parallel_for( k, threads, [ & ]( const size_t begin, const size_t end )
       {
-        for ( int d = 0; d < dim; ++d )
+        for ( size_t j = begin; j < end; ++j )
         {
-          sum[ d ] += vectors[ idx ].data_[ d ];
+          double nearest = std::numeric_limits< double >::max();
+          for ( unsigned int other = 0; other < k; ++other )
+            if ( other != j )
+              nearest = std::min( nearest, dist_fn->compute( centroid( j ), centroid( other ), dim ) );
+          half_gap[ j ] = nearest / 2.0;
         }
-      }
+      } );
+      computations += static_cast< std::uint64_t >( k ) * ( k - 1 );
+    }
 
-      float_vector new_centroid;
-      new_centroid.dimension_ = dim;
-      new_centroid.data_ = std::make_unique< float[] >( dim );
-      for ( int d = 0; d < dim; ++d )
+    // assignment
+    std::atomic< size_t > changes{ 0 };
+    utils::parallel_for( n, threads, [ & ]( const size_t begin, const size_t end )
+    {
+      size_t local_changes = 0;
+      std::uint64_t local_computations = 0;
+      for ( size_t i = begin; i < end; ++i )
       {
-        new_centroid.data_[ d ] = static_cast< float >( sum[ d ] / result.centroids[ j ].vector_ids.size() );
+        if ( bounded )
+        {
+          const auto own = assignment[ i ];
+          upper[ i ] += moved[ own ];
+          lower[ i ] -= own == max_mover ? second_moved : max_moved;
+          const double bound = std::max( half_gap[ own ], lower[ i ] );
+          if ( upper[ i ] <= bound )
+            continue;
+          upper[ i ] = dist_fn->compute( rows + sample[ i ] * dim, centroid( own ), dim );
+          ++local_computations;
+          if ( upper[ i ] <= bound )
+            continue;
+        }
+        local_changes += full_scan( i );
+        local_computations += k;
       }
+      changes += local_changes;
+      computations += local_computations;
+    } );
+    if ( changes == 0 )
+      break;
+  }
 
-      if ( !( new_centroid == result.centroids[ j ].centroid ) )
+  // 4. A single assignment pass over every row
+  std::vector< std::pair< unsigned int, double > > nearest( count );
+  utils::parallel_for( count, threads, [ & ]( const size_t begin, const size_t end )
+  {
+    for ( size_t i = begin; i < end; ++i )
+      nearest[ i ] = details::nearest_centroid( dist_fn, rows + i * dim, centroids, k, dim );
+  } );
+  computations += static_cast< std::uint64_t >( count ) * k;
+
+  // 5. Balancing: the overflow of the crowded clusters spills over to their neighbours
+  const auto capacity
+      = static_cast< size_t >( std::ceil( std::max( 1.0, max_imbalance ) * static_cast< double >( count ) / k ) );
+  std::vector< size_t > sizes( k, 0 );
+  if ( max_imbalance > 0.0 )
+    for ( const auto& [ j, _ ] : nearest )
+      ++sizes[ j ];
+  if ( max_imbalance > 0.0 && *std::max_element( sizes.begin(), sizes.end() ) > capacity )
+  {
+    // how much a row loses by not going to its nearest centroid
+    std::vector< double > margin( count );
+    utils::parallel_for( count, threads, [ & ]( const size_t begin, const size_t end )
+    {
+      for ( size_t i = begin; i < end; ++i )
       {
-        result.centroids[ j ].centroid = std::move( new_centroid );
-        changed = true;
+        double second = std::numeric_limits< double >::max();
+        for ( unsigned int j = 0; j < k; ++j )
+          if ( j != nearest[ i ].first )
+            second = std::min( second, dist_fn->compute( rows + i * dim, centroid( j ), dim ) );
+        margin[ i ] = second - nearest[ i ].second;
       }
+    } );
+    computations += static_cast< std::uint64_t >( count ) * ( k - 1 );
+    computations += details::assign_with_capacity( dist_fn, rows, centroids, k, dim, capacity, margin, nearest );
+
+    // the centroids follow the rows they got, which the rows are then measured against
+    std::vector< double > sums( static_cast< size_t >( k ) * dim, 0.0 );
+    std::fill( sizes.begin(), sizes.end(), 0 );
+    for ( size_t i = 0; i < count; ++i )
+    {
+      const auto j = nearest[ i ].first;
+      ++sizes[ j ];
+      for ( int d = 0; d < dim; ++d )
+        sums[ static_cast< size_t >( j ) * dim + d ] += rows[ i * dim + d ];
     }
+    for ( unsigned int j = 0; j < k; ++j )
+      if ( sizes[ j ] > 0 )
+        for ( int d = 0; d < dim; ++d )
+          centroid( j )[ d ] = static_cast< float >( sums[ static_cast< size_t >( j ) * dim + d ] / sizes[ j ] );
+    for ( size_t i = 0; i < count; ++i )
+      nearest[ i ].second = dist_fn->compute( rows + i * dim, centroid( nearest[ i ].first ), dim );
+    computations += count;
   }
 
+  k_means_result result;
+  result.centroids.reserve( k );
+  for ( unsigned int j = 0; j < k; ++j )
+    result.centroids.emplace_back( float_vector( dim, centroid( j ) ) );
+  for ( size_t i = 0; i < count; ++i )
+  {
+    result.centroids[ nearest[ i ].first ].vector_ids.push_back( i );
+    result.distance_sum += nearest[ i ].second;
+  }
+  result.distance_computations = computations;
+  result.iterations = iteration;
   return result;
 }
 
-}  // namespace vector_db
\ No newline at end of file
+}  // namespace vector_db
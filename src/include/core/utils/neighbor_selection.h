@@ -0,0 +1,40 @@
+//
+// Neighbour selection shared by the HNSW index and the proximity graph over IVF centroids.
+//
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace vector_db
+{
+
+// Algorithm 4 of the HNSW paper. `candidates` holds (distance to the base, node) pairs nearest first, and
+// `between( a, b )` is the distance of two nodes. A candidate is kept only if it is closer to the base than
+// to every node kept so far, which spreads the links out in different directions. With `keep_pruned`, the
+// nearest of the pruned candidates fill up what is left of the `max` links. Returns the links nearest first.
+template < typename Node, typename Candidates, typename Between >
+std::vector< std::pair< double, Node > >
+select_neighbors_heuristic( const Candidates& candidates, const std::size_t max, const Between& between, const bool keep_pruned )
+{
+  std::vector< std::pair< double, Node > > kept, pruned;
+  for ( const auto& [ d, cand ] : candidates )
+  {
+    if ( kept.size() >= max )
+      break;
+    const bool diverse
+        = std::all_of( kept.begin(), kept.end(), [ & ]( const auto& selected ) { return d < between( cand, selected.second ); } );
+    ( diverse ? kept : pruned ).emplace_back( d, cand );
+  }
+  if ( !keep_pruned || kept.size() >= max || pruned.empty() )
+    return kept;
+
+  const auto diverse_count = static_cast< std::ptrdiff_t >( kept.size() );
+  const auto backfill = std::min( pruned.size(), max - kept.size() );
+  kept.insert( kept.end(), pruned.begin(), pruned.begin() + static_cast< std::ptrdiff_t >( backfill ) );
+  std::inplace_merge( kept.begin(), kept.begin() + diverse_count, kept.end() );
+  return kept;
+}
+
+}  // namespace vector_db
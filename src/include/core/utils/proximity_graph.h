@@ -0,0 +1,220 @@
+//
+// Small HNSW-style graph over a caller owned set of points, e.g. the centroids of an IVF index.
+//
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <random>
+#include <vector>
+
+#include "../distance.h"
+#include "neighbor_selection.h"
+
+namespace vector_db
+{
+
+// Layered navigable small world graph over points addressed by their position 0..size()-1. Only the links are
+// stored: every call reads the points through `point`, so that they may move in place between calls (IVF
+// centroids follow their members) at the cost of somewhat less suited links.
+//
+// The links are selected as HNSW's are, with the shared select_neighbors_heuristic. The beam search is its
+// own: the one of hnsw::index runs over dense slots with filters, deleted nodes, sq8 codes and prefetching,
+// none of which a graph over a few thousand centroids read through a callback has.
+class proximity_graph
+{
+public:
+  using point_fn = std::function< const float*( uint32_t ) >;
+  using result_t = std::vector< std::pair< double, uint32_t > >;
+
+  proximity_graph() = default;
+  proximity_graph( const distance::dist_type dist_type,
+                   const int dim,
+                   const unsigned int M = 16,
+                   const unsigned int ef_construction = 64,
+                   const std::uint64_t seed = 42 )
+      : dist_fn_( distance::get_distance_instance( dist_type ) )
+      , dim_( dim )
+      , M_( std::max( 2u, M ) )
+      , ef_construction_( ef_construction )
+      , ml_( 1.0 / std::log( static_cast< double >( std::max( 2u, M ) ) ) )
+      , rng_( seed )
+  {
+  }
+
+  size_t size() const { return links_.size(); }
+
+  // links point size(), which has to be readable through `point`
+  void insert( const point_fn& point )
+  {
+    const auto node = static_cast< uint32_t >( links_.size() );
+    const int level = static_cast< int >( -std::log( std::uniform_real_distribution< double >( 1e-12, 1.0 )( rng_ ) ) * ml_ );
+    links_.emplace_back( level + 1 );
+    if ( node == 0 )
+    {
+      entry_ = 0;
+      max_level_ = level;
+      return;
+    }
+
+    const float* q = point( node );
+    uint32_t entry = entry_;
+    std::uint64_t computations = 0;
+    for ( int l = max_level_; l > level; --l )
+      entry = greedy( q, entry, l, point, computations );
+    for ( int l = std::min( level, max_level_ ); l >= 0; --l )
+    {
+      auto candidates = search_layer( q, entry, ef_construction_, l, point, computations );
+      entry = candidates.front().second;
+      links_[ node ][ l ] = select( candidates, max_links( l ), point );
+      for ( const auto neighbour : links_[ node ][ l ] )
+      {
+        auto& back = links_[ neighbour ][ l ];
+        back.push_back( node );
+        if ( back.size() <= max_links( l ) )
+          continue;
+        // over full: keep the most diverse of its links
+        const float* p = point( neighbour );
+        result_t scored;
+        for ( const auto other : back )
+          scored.emplace_back( dist( p, point( other ) ), other );
+        std::sort( scored.begin(), scored.end() );
+        back = select( scored, max_links( l ), point );
+      }
+    }
+    if ( level > max_level_ )
+    {
+      max_level_ = level;
+      entry_ = node;
+    }
+  }
+
+  // the k points nearest to `query` found with a candidate list of ef, nearest first. The distances computed
+  // are added to `computations`.
+  result_t search( const float* query,
+                   const size_t k,
+                   const size_t ef,
+                   const point_fn& point,
+                   std::uint64_t& computations ) const
+  {
+    if ( links_.empty() )
+      return {};
+    uint32_t entry = entry_;
+    for ( int l = max_level_; l > 0; --l )
+      entry = greedy( query, entry, l, point, computations );
+    auto found = search_layer( query, entry, std::max( k, ef ), 0, point, computations );
+    if ( found.size() > k )
+      found.resize( k );
+    return found;
+  }
+
+private:
+  distance::ptr dist_fn_{ nullptr };
+  int dim_{ 0 };
+  unsigned int M_{ 16 };
+  unsigned int ef_construction_{ 64 };
+  double ml_{ 0.0 };
+  std::mt19937_64 rng_;
+  std::vector< std::vector< std::vector< uint32_t > > > links_;  // links_[node][level] = neighbours on `level`
+  uint32_t entry_{ 0 };
+  int max_level_{ -1 };
+
+  size_t max_links( const int level ) const { return level == 0 ? 2 * M_ : M_; }
+  double dist( const float* a, const float* b ) const { return dist_fn_->compute( a, b, dim_ ); }
+
+  // nearest node to q reachable from `entry` by moving to a closer neighbour on `level`
+  uint32_t greedy( const float* q, uint32_t entry, const int level, const point_fn& point, std::uint64_t& computations ) const
+  {
+    double best = dist( q, point( entry ) );
+    ++computations;
+    for ( bool moved = true; moved; )
+    {
+      moved = false;
+      for ( const auto neighbour : links_[ entry ][ level ] )
+      {
+        const double d = dist( q, point( neighbour ) );
+        ++computations;
+        if ( d < best )
+        {
+          best = d;
+          entry = neighbour;
+          moved = true;
+        }
+      }
+    }
+    return entry;
+  }
+
+  // beam search on `level`, nearest first
+  result_t search_layer( const float* q,
+                         const uint32_t entry,
+                         const size_t ef,
+                         const int level,
+                         const point_fn& point,
+                         std::uint64_t& computations ) const
+  {
+    // visited marks are per thread, a bumped epoch clears them
+    thread_local std::vector< std::uint32_t > marks;
+    thread_local std::uint32_t epoch = 0;
+    if ( marks.size() < links_.size() )
+      marks.resize( links_.size(), 0 );
+    if ( ++epoch == 0 )
+    {
+      std::fill( marks.begin(), marks.end(), 0 );
+      epoch = 1;
+    }
+
+    using cand_t = std::pair< double, uint32_t >;
+    std::priority_queue< cand_t, std::vector< cand_t >, std::greater<> > candidates;
+    std::priority_queue< cand_t > result;
+    const double d = dist( q, point( entry ) );
+    ++computations;
+    candidates.emplace( d, entry );
+    result.emplace( d, entry );
+    marks[ entry ] = epoch;
+    while ( !candidates.empty() )
+    {
+      const auto [ cand_dist, cand ] = candidates.top();
+      if ( cand_dist > result.top().first && result.size() >= ef )
+        break;
+      candidates.pop();
+      for ( const auto neighbour : links_[ cand ][ level ] )
+      {
+        if ( marks[ neighbour ] == epoch )
+          continue;
+        marks[ neighbour ] = epoch;
+        const double nd = dist( q, point( neighbour ) );
+        ++computations;
+        if ( result.size() < ef || nd < result.top().first )
+        {
+          candidates.emplace( nd, neighbour );
+          result.emplace( nd, neighbour );
+          if ( result.size() > ef )
+            result.pop();
+        }
+      }
+    }
+
+    result_t sorted( result.size() );
+    for ( auto it = sorted.rbegin(); it != sorted.rend(); ++it )
+    {
+      *it = result.top();
+      result.pop();
+    }
+    return sorted;
+  }
+
+  // the links of a node among `candidates`, nearest first, the pruned ones filling up what is left
+  std::vector< uint32_t > select( const result_t& candidates, const size_t max, const point_fn& point ) const
+  {
+    const auto between = [ & ]( const uint32_t a, const uint32_t b ) { return dist( point( a ), point( b ) ); };
+    std::vector< uint32_t > links;
+    for ( const auto& [ _, node ] : select_neighbors_heuristic< uint32_t >( candidates, max, between, true ) )
+      links.push_back( node );
+    return links;
+  }
+};
+
+}  // namespace vector_db
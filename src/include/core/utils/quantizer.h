@@ -0,0 +1,104 @@
+//
+// Scalar quantization of float vectors into compact codes.
+//
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <vector>
+
+#include "../distance.h"
+#include "simd.h"
+
+namespace vector_db
+{
+
+enum class quantizer_type : uint8_t
+{
+  none = 0,
+  sq8 = 1,  // one byte per dimension
+};
+
+// 8-bit scalar quantizer: every dimension is mapped linearly onto [0, 255] between the min and max seen
+// in training. Values outside the trained range are clamped.
+struct sq8_quantizer
+{
+  std::vector< float > min_;    // per dimension lower bound
+  std::vector< float > scale_;  // per dimension step, (max - min) / 255
+
+  bool trained() const { return !min_.empty(); }
+  std::size_t dimension() const { return min_.size(); }
+
+  void train( const float* rows, const std::size_t count, const std::size_t dim )
+  {
+    min_.assign( dim, std::numeric_limits< float >::max() );
+    std::vector< float > max( dim, std::numeric_limits< float >::lowest() );
+    for ( std::size_t i = 0; i < count; ++i )
+    {
+      for ( std::size_t d = 0; d < dim; ++d )
+      {
+        min_[ d ] = std::min( min_[ d ], rows[ i * dim + d ] );
+        max[ d ] = std::max( max[ d ], rows[ i * dim + d ] );
+      }
+    }
+    scale_.resize( dim );
+    for ( std::size_t d = 0; d < dim; ++d )
+      scale_[ d ] = max[ d ] > min_[ d ] ? ( max[ d ] - min_[ d ] ) / 255.0f : 1.0f;
+  }
+
+  void encode( const float* vec, uint8_t* code ) const
+  {
+    for ( std::size_t d = 0; d < min_.size(); ++d )
+    {
+      const float level = std::round( ( vec[ d ] - min_[ d ] ) / scale_[ d ] );
+      code[ d ] = static_cast< uint8_t >( std::clamp( level, 0.0f, 255.0f ) );
+    }
+  }
+
+  void decode( const uint8_t* code, float* vec ) const
+  {
+    for ( std::size_t d = 0; d < min_.size(); ++d )
+      vec[ d ] = min_[ d ] + scale_[ d ] * code[ d ];
+  }
+
+  // asymmetric distance between a full precision query and a code, in the metric of `type`
+  double distance( const distance::dist_type type, const float* query, const uint8_t* code ) const
+  {
+    const auto dim = min_.size();
+    if ( type == distance::dist_type::euclidean )
+      return std::sqrt( static_cast< double >( simd::sq8_squared_l2( query, min_.data(), scale_.data(), code, dim ) ) );
+
+    float dot_product, mag_q, mag_c;
+    simd::sq8_dot_and_norms( query, min_.data(), scale_.data(), code, dim, dot_product, mag_q, mag_c );
+    if ( type == distance::dist_type::inner_product )
+      return dot_product;
+    if ( mag_q == 0.0f || mag_c == 0.0f )
+      return 1.0;
+    return 1.0 - dot_product / ( std::sqrt( static_cast< double >( mag_q ) ) * std::sqrt( static_cast< double >( mag_c ) ) );
+  }
+
+  void serialize( std::ostream& os ) const
+  {
+    const auto dim = static_cast< uint32_t >( min_.size() );
+    os.write( reinterpret_cast< const char* >( &dim ), sizeof( dim ) );
+    os.write( reinterpret_cast< const char* >( min_.data() ), dim * sizeof( float ) );
+    os.write( reinterpret_cast< const char* >( scale_.data() ), dim * sizeof( float ) );
+  }
+
+  static sq8_quantizer deserialize( std::istream& is )
+  {
+    sq8_quantizer quantizer;
+    uint32_t dim;
+    is.read( reinterpret_cast< char* >( &dim ), sizeof( dim ) );
+    quantizer.min_.resize( dim );
+    quantizer.scale_.resize( dim );
+    is.read( reinterpret_cast< char* >( quantizer.min_.data() ), dim * sizeof( float ) );
+    is.read( reinterpret_cast< char* >( quantizer.scale_.data() ), dim * sizeof( float ) );
+    return quantizer;
+  }
+};
+
+}  // namespace vector_db
@@ -0,0 +1,199 @@
+//
+// Distance kernels over raw rows and over 8-bit scalar codes, vectorized with AVX2 or SSE2 when the
+// target has them: the TARGET_ARCH build option picks which, AVX2 needing x86-64-v3 or native. They
+// accumulate in float lanes; callers widen the result to double.
+//
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined( __AVX2__ ) || defined( __SSE2__ )
+#include <immintrin.h>
+#endif
+
+namespace vector_db::simd
+{
+
+namespace details
+{
+#if defined( __AVX2__ )
+constexpr std::size_t lanes = 8;
+using lane_t = __m256;
+inline lane_t zero() { return _mm256_setzero_ps(); }
+inline lane_t load( const float* p ) { return _mm256_loadu_ps( p ); }
+inline lane_t add( const lane_t a, const lane_t b ) { return _mm256_add_ps( a, b ); }
+inline lane_t sub( const lane_t a, const lane_t b ) { return _mm256_sub_ps( a, b ); }
+inline lane_t mul( const lane_t a, const lane_t b ) { return _mm256_mul_ps( a, b ); }
+// 8 codes widened to floats
+inline lane_t load_codes( const std::uint8_t* p )
+{
+  return _mm256_cvtepi32_ps( _mm256_cvtepu8_epi32( _mm_loadl_epi64( reinterpret_cast< const __m128i* >( p ) ) ) );
+}
+inline float horizontal_sum( const lane_t v )
+{
+  __m128 sum = _mm_add_ps( _mm256_castps256_ps128( v ), _mm256_extractf128_ps( v, 1 ) );
+  sum = _mm_add_ps( sum, _mm_movehl_ps( sum, sum ) );
+  sum = _mm_add_ss( sum, _mm_shuffle_ps( sum, sum, 0x55 ) );
+  return _mm_cvtss_f32( sum );
+}
+#elif defined( __SSE2__ )
+constexpr std::size_t lanes = 4;
+using lane_t = __m128;
+inline lane_t zero() { return _mm_setzero_ps(); }
+inline lane_t load( const float* p ) { return _mm_loadu_ps( p ); }
+inline lane_t add( const lane_t a, const lane_t b ) { return _mm_add_ps( a, b ); }
+inline lane_t sub( const lane_t a, const lane_t b ) { return _mm_sub_ps( a, b ); }
+inline lane_t mul( const lane_t a, const lane_t b ) { return _mm_mul_ps( a, b ); }
+// 4 codes widened to floats
+inline lane_t load_codes( const std::uint8_t* p )
+{
+  std::int32_t packed;
+  std::memcpy( &packed, p, sizeof( packed ) );
+  const __m128i zero = _mm_setzero_si128();
+  return _mm_cvtepi32_ps( _mm_unpacklo_epi16( _mm_unpacklo_epi8( _mm_cvtsi32_si128( packed ), zero ), zero ) );
+}
+inline float horizontal_sum( const lane_t v )
+{
+  __m128 sum = _mm_add_ps( v, _mm_movehl_ps( v, v ) );
+  sum = _mm_add_ss( sum, _mm_shuffle_ps( sum, sum, 0x55 ) );
+  return _mm_cvtss_f32( sum );
+}
+#endif
+}  // namespace details
+
+// sum of ( a[i] - b[i] )^2
+inline float squared_l2( const float* a, const float* b, const std::size_t dim )
+{
+  std::size_t i = 0;
+  float sum = 0.0f;
+#if defined( __AVX2__ ) || defined( __SSE2__ )
+  using namespace details;
+  lane_t acc = zero();
+  for ( ; i + lanes <= dim; i += lanes )
+  {
+    const lane_t diff = sub( load( a + i ), load( b + i ) );
+    acc = add( acc, mul( diff, diff ) );
+  }
+  sum = horizontal_sum( acc );
+#endif
+  for ( ; i < dim; ++i )
+  {
+    const float diff = a[ i ] - b[ i ];
+    sum += diff * diff;
+  }
+  return sum;
+}
+
+// sum of a[i] * b[i]
+inline float dot( const float* a, const float* b, const std::size_t dim )
+{
+  std::size_t i = 0;
+  float sum = 0.0f;
+#if defined( __AVX2__ ) || defined( __SSE2__ )
+  using namespace details;
+  lane_t acc = zero();
+  for ( ; i + lanes <= dim; i += lanes )
+    acc = add( acc, mul( load( a + i ), load( b + i ) ) );
+  sum = horizontal_sum( acc );
+#endif
+  for ( ; i < dim; ++i )
+    sum += a[ i ] * b[ i ];
+  return sum;
+}
+
+// a . b, a . a and b . b in one pass, for the cosine distance
+inline void dot_and_norms( const float* a, const float* b, const std::size_t dim, float& ab, float& aa, float& bb )
+{
+  std::size_t i = 0;
+  ab = aa = bb = 0.0f;
+#if defined( __AVX2__ ) || defined( __SSE2__ )
+  using namespace details;
+  lane_t acc_ab = zero(), acc_aa = zero(), acc_bb = zero();
+  for ( ; i + lanes <= dim; i += lanes )
+  {
+    const lane_t va = load( a + i ), vb = load( b + i );
+    acc_ab = add( acc_ab, mul( va, vb ) );
+    acc_aa = add( acc_aa, mul( va, va ) );
+    acc_bb = add( acc_bb, mul( vb, vb ) );
+  }
+  ab = horizontal_sum( acc_ab );
+  aa = horizontal_sum( acc_aa );
+  bb = horizontal_sum( acc_bb );
+#endif
+  for ( ; i < dim; ++i )
+  {
+    ab += a[ i ] * b[ i ];
+    aa += a[ i ] * a[ i ];
+    bb += b[ i ] * b[ i ];
+  }
+}
+
+// SQ8 codes decode to min[i] + scale[i] * code[i]. The kernels below decode in registers and score the
+// full precision query against the result, widening 8 codes per step with AVX2 and 4 with SSE2.
+
+// sum of ( query[i] - decoded[i] )^2
+inline float sq8_squared_l2( const float* query,
+                             const float* min,
+                             const float* scale,
+                             const std::uint8_t* code,
+                             const std::size_t dim )
+{
+  std::size_t i = 0;
+  float sum = 0.0f;
+#if defined( __AVX2__ ) || defined( __SSE2__ )
+  using namespace details;
+  lane_t acc = zero();
+  for ( ; i + lanes <= dim; i += lanes )
+  {
+    const lane_t decoded = add( load( min + i ), mul( load( scale + i ), load_codes( code + i ) ) );
+    const lane_t diff = sub( load( query + i ), decoded );
+    acc = add( acc, mul( diff, diff ) );
+  }
+  sum = horizontal_sum( acc );
+#endif
+  for ( ; i < dim; ++i )
+  {
+    const float diff = query[ i ] - ( min[ i ] + scale[ i ] * code[ i ] );
+    sum += diff * diff;
+  }
+  return sum;
+}
+
+// query . decoded, query . query and decoded . decoded in one pass
+inline void sq8_dot_and_norms( const float* query,
+                               const float* min,
+                               const float* scale,
+                               const std::uint8_t* code,
+                               const std::size_t dim,
+                               float& qc,
+                               float& qq,
+                               float& cc )
+{
+  std::size_t i = 0;
+  qc = qq = cc = 0.0f;
+#if defined( __AVX2__ ) || defined( __SSE2__ )
+  using namespace details;
+  lane_t acc_qc = zero(), acc_qq = zero(), acc_cc = zero();
+  for ( ; i + lanes <= dim; i += lanes )
+  {
+    const lane_t q = load( query + i );
+    const lane_t c = add( load( min + i ), mul( load( scale + i ), load_codes( code + i ) ) );
+    acc_qc = add( acc_qc, mul( q, c ) );
+    acc_qq = add( acc_qq, mul( q, q ) );
+    acc_cc = add( acc_cc, mul( c, c ) );
+  }
+  qc = horizontal_sum( acc_qc );
+  qq = horizontal_sum( acc_qq );
+  cc = horizontal_sum( acc_cc );
+#endif
+  for ( ; i < dim; ++i )
+  {
+    const float c = min[ i ] + scale[ i ] * code[ i ];
+    qc += query[ i ] * c;
+    qq += query[ i ] * query[ i ];
+    cc += c * c;
+  }
+}
+
+}  // namespace vector_db::simd
@@ -0,0 +1,125 @@
+//
+// Fixed set of worker threads the indices fan their searches out to.
+//
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace vector_db::utils
+{
+
+// Work fanned out to a pool runs on at most size() workers at once, however many callers fan out at the
+// same time, and the workers' thread_local state (e.g. search scratch) outlives each call. shared() is
+// created on first use and lives until the process exits.
+class thread_pool
+{
+  // one call to run(): its work, and how many workers are in it
+  struct batch
+  {
+    const std::function< void() >* work{ nullptr };
+    std::mutex mutex;
+    std::condition_variable done;
+    unsigned int running{ 0 };
+    bool closed{ false };  // the caller finished: workers that did not start yet skip it
+  };
+
+  std::vector< std::thread > workers_;
+  std::deque< std::shared_ptr< batch > > queue_;
+  std::mutex mutex_;  // guards queue_ and stopped_
+  std::condition_variable cv_;
+  bool stopped_{ false };
+
+  void worker_loop()
+  {
+    while ( true )
+    {
+      std::shared_ptr< batch > next;
+      {
+        std::unique_lock lock( mutex_ );
+        cv_.wait( lock, [ this ] { return stopped_ || !queue_.empty(); } );
+        if ( stopped_ )
+          return;
+        next = std::move( queue_.front() );
+        queue_.pop_front();
+      }
+      {
+        std::lock_guard lock( next->mutex );
+        if ( next->closed )
+          continue;
+        ++next->running;
+      }
+      ( *next->work )();
+      {
+        std::lock_guard lock( next->mutex );
+        --next->running;
+      }
+      next->done.notify_all();
+    }
+  }
+
+public:
+  explicit thread_pool( const unsigned int threads )
+  {
+    workers_.reserve( threads );
+    for ( unsigned int t = 0; t < threads; ++t )
+      workers_.emplace_back( [ this ] { worker_loop(); } );
+  }
+
+  ~thread_pool()
+  {
+    {
+      std::lock_guard lock( mutex_ );
+      stopped_ = true;
+    }
+    cv_.notify_all();
+    for ( auto& worker : workers_ )
+      worker.join();
+  }
+
+  thread_pool( const thread_pool& ) = delete;
+  thread_pool& operator=( const thread_pool& ) = delete;
+
+  static thread_pool& shared()
+  {
+    static thread_pool pool( std::max( 1u, std::thread::hardware_concurrency() ) );
+    return pool;
+  }
+
+  unsigned int size() const { return static_cast< unsigned int >( workers_.size() ); }
+
+  // Runs work() on the calling thread and on up to `helpers` workers, and returns once every run of it
+  // has. `work` must take its items off a shared cursor and must not throw: helpers that did not start by
+  // the time the caller's own run is over are skipped, so a busy pool never holds the caller up.
+  void run( const unsigned int helpers, const std::function< void() >& work )
+  {
+    const auto b = std::make_shared< batch >();
+    b->work = &work;
+    const unsigned int count = std::min( helpers, size() );
+    if ( count > 0 )
+    {
+      {
+        std::lock_guard lock( mutex_ );
+        for ( unsigned int h = 0; h < count; ++h )
+          queue_.push_back( b );
+      }
+      if ( count == 1 )
+        cv_.notify_one();
+      else
+        cv_.notify_all();
+    }
+
+    work();
+
+    std::unique_lock lock( b->mutex );
+    b->closed = true;
+    b->done.wait( lock, [ &b ] { return b->running == 0; } );
+  }
+};
+
+}  // namespace vector_db::utils
@@ -3,8 +3,14 @@
 //
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <vector>
+
 #include "core/float_vector.h"
 #include "core/status.h"
+#include "core/utils/thread_pool.h"
 
 namespace vector_db::utils
 {
@@ -15,6 +21,47 @@ double get_cosine_distance( const float_vector& a, const float_vector& b );
 
 status is_collection_name_valid( const std::string& collection_name );
 
+// Hint the CPU to start loading the cache lines of [ptr, ptr + bytes) ahead of a read.
+inline void prefetch( const void* ptr, const std::size_t bytes = 1 )
+{
+#if defined( __GNUC__ ) || defined( __clang__ )
+  constexpr std::size_t cache_line = 64;
+  const auto* p = static_cast< const char* >( ptr );
+  for ( std::size_t offset = 0; offset < bytes; offset += cache_line )
+    __builtin_prefetch( p + offset, 0, 3 );
+#else
+  ( void )ptr;
+  ( void )bytes;
+#endif
+}
+
+// Runs fn( begin, end ) over `threads` contiguous chunks of [0, count), on the calling thread and the shared
+// pool's workers; 0 uses the caller and the whole pool. Chunks the busy pool doesn't pick up run on the caller.
+// fn must not throw.
+template< typename F >
+void parallel_for( const std::size_t count, unsigned int threads, F&& fn )
+{
+  auto& pool = thread_pool::shared();
+  if ( threads == 0 )
+    threads = pool.size() + 1;
+  threads = static_cast< unsigned int >( std::min< std::size_t >( threads, count ) );
+  if ( threads <= 1 )
+  {
+    if ( count > 0 )
+      fn( std::size_t{ 0 }, count );
+    return;
+  }
+
+  const std::size_t chunk = ( count + threads - 1 ) / threads;
+  std::atomic< std::size_t > next{ 0 };
+  const std::function< void() > work = [ & ]
+  {
+    for ( std::size_t begin = next.fetch_add( chunk ); begin < count; begin = next.fetch_add( chunk ) )
+      fn( begin, std::min( count, begin + chunk ) );
+  };
+  pool.run( threads - 1, work );
+}
+
 template< typename Derived >
 struct singleton
 {
@@ -36,6 +36,8 @@ private:
   struct delete_vector_handler;
   struct add_index_handler;
   struct get_index_handler;
+  struct get_index_stats_handler;
+  struct retrain_index_handler;
 
   template< typename... rpc >
   void init_rpc_handlers();
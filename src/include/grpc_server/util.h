@@ -1,6 +1,8 @@
 #pragma once
 
 #include "core/database.h"
+#include "core/indices/ivfflat.h"
+#include "core/utils/quantizer.h"
 #include "db.grpc.pb.h"
 
 namespace vector_db
@@ -13,6 +15,8 @@ inline index_type proto_to_db_index( const IndexType& _algo )
       return index_type::ivf_flat;
     case IndexType::HNSW:
       return index_type::hnsw;
+    case IndexType::IVF_PQ:
+      return index_type::ivf_pq;
     default:
       return index_type::unknown;
   }
@@ -47,6 +51,60 @@ inline DistanceType db_dist_to_proto( const distance::dist_type& _algo )
       return DistanceType::EUCLIDEAN;  // default fallback
   }
 }
+inline quantizer_type proto_to_db_quantizer( const QuantizerType& _quantizer )
+{
+  switch ( _quantizer )
+  {
+    case QuantizerType::SQ8:
+      return quantizer_type::sq8;
+    default:
+      return quantizer_type::none;
+  }
+}
+
+inline QuantizerType db_quantizer_to_proto( const quantizer_type& _quantizer )
+{
+  switch ( _quantizer )
+  {
+    case quantizer_type::sq8:
+      return QuantizerType::SQ8;
+    default:
+      return QuantizerType::NO_QUANTIZER;
+  }
+}
+
+inline indices::ivf_flat::coarse_quantizer proto_to_db_coarse( const CoarseQuantizer& _coarse )
+{
+  switch ( _coarse )
+  {
+    case CoarseQuantizer::CENTROID_GRAPH:
+      return indices::ivf_flat::coarse_quantizer::graph;
+    default:
+      return indices::ivf_flat::coarse_quantizer::flat;
+  }
+}
+
+inline CoarseQuantizer db_coarse_to_proto( const indices::ivf_flat::coarse_quantizer& _coarse )
+{
+  switch ( _coarse )
+  {
+    case indices::ivf_flat::coarse_quantizer::graph:
+      return CoarseQuantizer::CENTROID_GRAPH;
+    default:
+      return CoarseQuantizer::FLAT_SCAN;
+  }
+}
+
+inline void db_query_stats_to_proto( const query_stats& _stats, QueryStats* _proto )
+{
+  _proto->set_distancecomputations( _stats.distance_computations_ );
+  _proto->set_nodesexpanded( _stats.nodes_expanded_ );
+  _proto->set_visited( _stats.visited_ );
+  _proto->clear_hopsperlayer();
+  for ( const auto hops : _stats.hops_per_layer_ )
+    _proto->add_hopsperlayer( hops );
+  _proto->set_listsprobed( _stats.lists_probed_ );
+}
 
 inline grpc::Status status_to_grpc_status( const status s )
 {
@@ -124,6 +124,67 @@ TEST_F( DatabaseResultTests, GetNearestKInvalidCollectionName )
   EXPECT_FALSE( result.has_payload() );
 }
 
+TEST_F( DatabaseResultTests, GetNearestKIndexNotFound )
+{
+  // Test get_nearest_k against an index the collection doesn't have
+  float_vector query{ 3, std::vector< float >{ 1.0f, 2.0f, 3.0f }.data() };
+  auto result = db.get_nearest_k( "test_collection", query, 5, "non_existent_index" );
+
+  EXPECT_FALSE( result.is_success() );
+  EXPECT_EQ( result.status_, status::index_does_not_exist );
+  EXPECT_FALSE( result.has_payload() );
+}
+
+TEST_F( DatabaseResultTests, GetNearestKPerQueryNProbe )
+{
+  std::vector< std::pair< vector_db::id_t, float_vector > > vectors;
+  for ( int i = 0; i < 100; ++i )
+  {
+    vectors.emplace_back( i, float_vector{ 3, std::vector< float >{ 1.0f * i, 2.0f * i, 3.0f * i }.data() } );
+  }
+  db.add_vectors( "test_collection", vectors );
+
+  auto ivf_params = indices::ivf_flat::params( distance::dist_type::euclidean, 10, 1 );
+  ASSERT_EQ( db.add_index( "test_collection", "ivf_index", index_type::ivf_flat, &ivf_params ), status::success );
+
+  // probing every cluster makes the search exhaustive, whatever the index was created with
+  search_params_t search_params;
+  search_params.n_probe_ = 10;
+  float_vector query{ 3, std::vector< float >{ 50.0f, 100.0f, 150.0f }.data() };
+  auto result = db.get_nearest_k( "test_collection", query, 20, "ivf_index", search_params );
+
+  ASSERT_TRUE( result.is_success() );
+  ASSERT_EQ( result.value().size(), 20 );
+  for ( const auto& [ score, _id_vector ] : result.value() )
+  {
+    EXPECT_GE( _id_vector.first, 40 );
+    EXPECT_LE( _id_vector.first, 60 );
+  }
+}
+
+TEST_F( DatabaseResultTests, GetNearestKMetadataFilter )
+{
+  std::vector< std::pair< vector_db::id_t, float_vector > > vectors;
+  for ( int i = 0; i < 20; ++i )
+  {
+    float_vector vec{ 3, std::vector< float >{ 1.0f * i, 0.0f, 0.0f }.data() };
+    vec.add_metadata( "tenant", i % 2 == 0 ? "even" : "odd" );
+    vectors.emplace_back( i, std::move( vec ) );
+  }
+  db.add_vectors( "test_collection", vectors );
+
+  search_params_t search_params;
+  search_params.filter_ = metadata_filter{ { { "tenant", { "odd" } } } };
+  float_vector query{ 3, std::vector< float >{ 4.0f, 0.0f, 0.0f }.data() };
+  auto result = db.get_nearest_k( "test_collection", query, 3, "", search_params );
+
+  ASSERT_TRUE( result.is_success() );
+  ASSERT_EQ( result.value().size(), 3 );
+  EXPECT_EQ( result.value()[ 0 ].second.first, 3 );
+  EXPECT_EQ( result.value()[ 1 ].second.first, 5 );
+  EXPECT_EQ( result.value()[ 2 ].second.first, 1 );
+}
+
 TEST_F( DatabaseResultTests, GetIndexParamsHNSWSuccess )
 {
   // Add an HNSW index
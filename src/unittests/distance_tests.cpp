@@ -0,0 +1,79 @@
+#include <cmath>
+#include <gtest/gtest.h>
+#include <random>
+#include <vector>
+
+#include "core/distance.h"
+#include "core/utils/quantizer.h"
+
+namespace vector_db::test
+{
+
+// the vectorized kernels against plain double loops, over dimensions that leave every tail length
+TEST( DistanceTest, KernelsMatchScalarLoops )
+{
+  std::mt19937 rng( 7 );
+  std::uniform_real_distribution< float > value( -2.0f, 2.0f );
+  for ( std::size_t dim = 1; dim <= 40; ++dim )
+  {
+    std::vector< float > a( dim ), b( dim );
+    for ( std::size_t i = 0; i < dim; ++i )
+    {
+      a[ i ] = value( rng );
+      b[ i ] = value( rng );
+    }
+
+    double sq = 0.0, ab = 0.0, aa = 0.0, bb = 0.0;
+    for ( std::size_t i = 0; i < dim; ++i )
+    {
+      sq += ( static_cast< double >( a[ i ] ) - b[ i ] ) * ( static_cast< double >( a[ i ] ) - b[ i ] );
+      ab += static_cast< double >( a[ i ] ) * b[ i ];
+      aa += static_cast< double >( a[ i ] ) * a[ i ];
+      bb += static_cast< double >( b[ i ] ) * b[ i ];
+    }
+
+    auto* euclidean = distance::get_distance_instance( distance::dist_type::euclidean );
+    auto* cosine = distance::get_distance_instance( distance::dist_type::cosine );
+    auto* inner_product = distance::get_distance_instance( distance::dist_type::inner_product );
+    EXPECT_NEAR( euclidean->compute( a.data(), b.data(), dim ), std::sqrt( sq ), 1e-4 ) << dim;
+    EXPECT_NEAR( cosine->compute( a.data(), b.data(), dim ), 1.0 - ab / std::sqrt( aa * bb ), 1e-4 ) << dim;
+    EXPECT_NEAR( inner_product->compute( a.data(), b.data(), dim ), ab, 1e-4 ) << dim;
+  }
+}
+
+// SQ8 distances against the decoded codes scored with double loops
+TEST( DistanceTest, SQ8KernelsMatchDecodedCodes )
+{
+  std::mt19937 rng( 8 );
+  std::uniform_real_distribution< float > value( -2.0f, 2.0f );
+  for ( std::size_t dim = 1; dim <= 40; ++dim )
+  {
+    std::vector< float > rows( 16 * dim ), query( dim );
+    for ( auto& x : rows )
+      x = value( rng );
+    for ( auto& x : query )
+      x = value( rng );
+    sq8_quantizer sq8;
+    sq8.train( rows.data(), 16, dim );
+    std::vector< std::uint8_t > code( dim );
+    sq8.encode( rows.data(), code.data() );
+    std::vector< float > decoded( dim );
+    sq8.decode( code.data(), decoded.data() );
+
+    double sq = 0.0, qc = 0.0, qq = 0.0, cc = 0.0;
+    for ( std::size_t i = 0; i < dim; ++i )
+    {
+      sq += ( static_cast< double >( query[ i ] ) - decoded[ i ] ) * ( static_cast< double >( query[ i ] ) - decoded[ i ] );
+      qc += static_cast< double >( query[ i ] ) * decoded[ i ];
+      qq += static_cast< double >( query[ i ] ) * query[ i ];
+      cc += static_cast< double >( decoded[ i ] ) * decoded[ i ];
+    }
+
+    EXPECT_NEAR( sq8.distance( distance::dist_type::euclidean, query.data(), code.data() ), std::sqrt( sq ), 1e-4 ) << dim;
+    EXPECT_NEAR( sq8.distance( distance::dist_type::cosine, query.data(), code.data() ), 1.0 - qc / std::sqrt( qq * cc ), 1e-4 )
+        << dim;
+    EXPECT_NEAR( sq8.distance( distance::dist_type::inner_product, query.data(), code.data() ), qc, 1e-4 ) << dim;
+  }
+}
+
+}  // namespace vector_db::test
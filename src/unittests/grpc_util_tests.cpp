@@ -72,4 +72,41 @@ TEST( GrpcUtilTests, ProtoToDbIndexConversion )
   // Test proto to db index type conversions
   EXPECT_EQ( proto_to_db_index( IndexType::HNSW ), index_type::hnsw );
   EXPECT_EQ( proto_to_db_index( IndexType::IVF_FLAT ), index_type::ivf_flat );
+  EXPECT_EQ( proto_to_db_index( IndexType::IVF_PQ ), index_type::ivf_pq );
+}
+
+TEST( GrpcUtilTests, QuantizerConversionRoundTrip )
+{
+  EXPECT_EQ( proto_to_db_quantizer( QuantizerType::NO_QUANTIZER ), quantizer_type::none );
+  EXPECT_EQ( proto_to_db_quantizer( QuantizerType::SQ8 ), quantizer_type::sq8 );
+  EXPECT_EQ( db_quantizer_to_proto( quantizer_type::none ), QuantizerType::NO_QUANTIZER );
+  EXPECT_EQ( db_quantizer_to_proto( quantizer_type::sq8 ), QuantizerType::SQ8 );
+}
+
+TEST( GrpcUtilTests, CoarseQuantizerConversion )
+{
+  EXPECT_EQ( proto_to_db_coarse( CoarseQuantizer::FLAT_SCAN ), indices::ivf_flat::coarse_quantizer::flat );
+  EXPECT_EQ( proto_to_db_coarse( CoarseQuantizer::CENTROID_GRAPH ), indices::ivf_flat::coarse_quantizer::graph );
+  EXPECT_EQ( db_coarse_to_proto( indices::ivf_flat::coarse_quantizer::flat ), CoarseQuantizer::FLAT_SCAN );
+  EXPECT_EQ( db_coarse_to_proto( indices::ivf_flat::coarse_quantizer::graph ), CoarseQuantizer::CENTROID_GRAPH );
+}
+
+TEST( GrpcUtilTests, QueryStatsConversion )
+{
+  query_stats stats;
+  stats.distance_computations_ = 120;
+  stats.nodes_expanded_ = 14;
+  stats.visited_ = 90;
+  stats.hops_per_layer_ = { 10, 3, 1 };
+  stats.lists_probed_ = 4;
+
+  QueryStats proto;
+  db_query_stats_to_proto( stats, &proto );
+  EXPECT_EQ( proto.distancecomputations(), 120u );
+  EXPECT_EQ( proto.nodesexpanded(), 14u );
+  EXPECT_EQ( proto.visited(), 90u );
+  ASSERT_EQ( proto.hopsperlayer_size(), 3 );
+  EXPECT_EQ( proto.hopsperlayer( 0 ), 10u );
+  EXPECT_EQ( proto.hopsperlayer( 2 ), 1u );
+  EXPECT_EQ( proto.listsprobed(), 4u );
 }
@@ -0,0 +1,613 @@
+#include <chrono>
+#include <gtest/gtest.h>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "core/collection.h"
+#include "core/indices/hnsw.h"
+
+namespace vector_db::test
+{
+
+namespace
+{
+std::vector< std::pair< id_t, float_vector > > make_grid( id_t first, id_t last )
+{
+  std::vector< std::pair< id_t, float_vector > > vectors;
+  for ( id_t i = first; i < last; ++i )
+  {
+    float d[] = { static_cast< float >( i % 10 ), static_cast< float >( i / 10 ) };
+    vectors.emplace_back( i, float_vector( 2, d ) );
+  }
+  return vectors;
+}
+
+std::vector< id_t > ids_of( const std::vector< std::pair< id_t, float_vector > >& vectors )
+{
+  std::vector< id_t > ids;
+  for ( const auto& [ id, _ ] : vectors )
+    ids.push_back( id );
+  return ids;
+}
+
+std::vector< std::pair< id_t, float_vector > > make_random( std::size_t count, unsigned int dimension, unsigned int seed )
+{
+  std::mt19937 rng( seed );
+  std::uniform_real_distribution< float > dist( 0.0f, 1.0f );
+  std::vector< std::pair< id_t, float_vector > > vectors;
+  std::vector< float > d( dimension );
+  for ( std::size_t i = 0; i < count; ++i )
+  {
+    for ( auto& value : d )
+      value = dist( rng );
+    vectors.emplace_back( i, float_vector( dimension, d.data() ) );
+  }
+  return vectors;
+}
+
+// `per_cluster` points around each of `clusters` centres, the blobs being far smaller than the gaps between them.
+// The centres are the same for every seed.
+std::vector< std::pair< id_t, float_vector > >
+make_clusters( std::size_t clusters, std::size_t per_cluster, unsigned int dimension, unsigned int seed )
+{
+  std::mt19937 centre_rng( 0 ), rng( seed );
+  std::uniform_real_distribution< float > centre( 0.0f, 100.0f );
+  std::normal_distribution< float > spread( 0.0f, 1.0f );
+  std::vector< std::pair< id_t, float_vector > > vectors;
+  std::vector< float > mean( dimension ), d( dimension );
+  for ( std::size_t c = 0; c < clusters; ++c )
+  {
+    for ( auto& value : mean )
+      value = centre( centre_rng );
+    for ( std::size_t p = 0; p < per_cluster; ++p )
+    {
+      for ( unsigned int i = 0; i < dimension; ++i )
+        d[ i ] = mean[ i ] + spread( rng );
+      vectors.emplace_back( vectors.size(), float_vector( dimension, d.data() ) );
+    }
+  }
+  return vectors;
+}
+
+// top-10 recall of an index over `vectors`, against a brute-force scan
+double recall( const indices::hnsw::params& params,
+               std::vector< std::pair< id_t, float_vector > > vectors,
+               const std::vector< std::pair< id_t, float_vector > >& queries )
+{
+  constexpr unsigned int k = 10;
+  const auto dimension = queries.front().second.dimension_;
+
+  // exact neighbours, computed before the vectors move into the collection
+  auto distance = distance::get_distance_instance( params.dist_type_ );
+  std::vector< std::set< id_t > > expected;
+  for ( const auto& [ _, query ] : queries )
+  {
+    std::vector< std::pair< double, id_t > > all;
+    for ( const auto& [ id, vec ] : vectors )
+      all.emplace_back( distance->compute( query, vec ), id );
+    std::partial_sort( all.begin(), all.begin() + k, all.end() );
+    std::set< id_t > top;
+    for ( unsigned int i = 0; i < k; ++i )
+      top.insert( all[ i ].second );
+    expected.push_back( std::move( top ) );
+  }
+
+  auto col = std::make_shared< collection >( dimension, "hnsw_recall" );
+  col->add_vectors( std::move( vectors ) );
+  indices::hnsw::index idx( col, params );
+  idx.init();
+
+  std::size_t hits = 0;
+  for ( std::size_t q = 0; q < queries.size(); ++q )
+  {
+    std::vector< score_pair > results;
+    idx.search_for_top_k( queries[ q ].second, k, results );
+    for ( const auto& [ _, _id_vector ] : results )
+      hits += expected[ q ].count( _id_vector.first );
+  }
+  return static_cast< double >( hits ) / ( queries.size() * k );
+}
+
+// top-10 recall over 2000 random 16-d vectors
+double recall_on_random_data( const indices::hnsw::params& params )
+{
+  constexpr unsigned int dimension = 16;
+  return recall( params, make_random( 2000, dimension, 1 ), make_random( 50, dimension, 2 ) );
+}
+
+bool wait_for_indexer( const indices::hnsw::index& idx )
+{
+  for ( int i = 0; i < 500 && idx.pending() > 0; ++i )
+    std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+  return idx.pending() == 0;
+}
+}  // namespace
+
+TEST( HNSWTest, PendingVectorsAreSearchableBeforeIndexing )
+{
+  auto col = std::make_shared< collection >( 2, "hnsw_pending" );
+  col->add_vectors( make_grid( 0, 15 ) );
+
+  // small enough for every node to link to every other one, so results are exact wherever a vector lives
+  indices::hnsw::index idx( col, indices::hnsw::params( distance::dist_type::euclidean, 16, 64, 64 ) );
+  idx.init();
+
+  auto new_vectors = make_grid( 15, 30 );
+  const auto new_ids = ids_of( new_vectors );
+  col->add_vectors( std::move( new_vectors ) );
+  idx.on_vectors_added( new_ids );
+
+  // whatever the indexer has linked so far, the vector must be found either in the graph or in the tail
+  float q[] = { 3.0f, 2.0f };
+  std::vector< score_pair > results;
+  ASSERT_TRUE( idx.search_for_top_k( float_vector( 2, q ), 1, results ) );
+  ASSERT_EQ( results.size(), 1 );
+  EXPECT_EQ( results[ 0 ].second.first, 23 );
+
+  ASSERT_TRUE( wait_for_indexer( idx ) );
+  ASSERT_TRUE( idx.search_for_top_k( float_vector( 2, q ), 1, results ) );
+  ASSERT_EQ( results.size(), 1 );
+  EXPECT_EQ( results[ 0 ].second.first, 23 );
+}
+
+TEST( HNSWTest, RemovedAndUpdatedVectorsAreNotReturnedStale )
+{
+  auto col = std::make_shared< collection >( 2, "hnsw_remove_update" );
+  col->add_vectors( make_grid( 0, 30 ) );
+
+  indices::hnsw::index idx( col, indices::hnsw::params( distance::dist_type::euclidean, 16, 64, 64 ) );
+  idx.init();
+
+  col->remove_vectors( { 25 } );
+  idx.on_vectors_removed( { 25 } );
+
+  std::vector< std::pair< id_t, float_vector > > update;
+  float moved[] = { 100.0f, 100.0f };
+  update.emplace_back( 14, float_vector( 2, moved ) );
+  col->add_vectors( std::move( update ) );
+  idx.on_vectors_added( { 14 } );
+
+  for ( int round = 0; round < 2; ++round )
+  {
+    std::vector< score_pair > results;
+    float q1[] = { 5.0f, 2.0f };
+    ASSERT_TRUE( idx.search_for_top_k( float_vector( 2, q1 ), 1, results ) );
+    ASSERT_EQ( results.size(), 1 );
+    EXPECT_NE( results[ 0 ].second.first, 25 );
+
+    float q2[] = { 99.0f, 99.0f };
+    ASSERT_TRUE( idx.search_for_top_k( float_vector( 2, q2 ), 1, results ) );
+    ASSERT_EQ( results.size(), 1 );
+    EXPECT_EQ( results[ 0 ].second.first, 14 );
+
+    ASSERT_TRUE( wait_for_indexer( idx ) );
+  }
+}
+
+// without the pending scan, an updated vector is still found through its old graph node until it is relinked
+TEST( HNSWTest, UpdatedVectorsStaySearchableWithoutThePendingScan )
+{
+  auto col = std::make_shared< collection >( 2, "hnsw_update_unscanned" );
+  col->add_vectors( make_grid( 0, 30 ) );
+  auto params = indices::hnsw::params( distance::dist_type::euclidean, 16, 64, 64 );
+  params.search_pending_ = false;
+  indices::hnsw::index idx( col, params );
+  idx.init();
+
+  // vectors queued ahead, above the grid, keep the indexer busy while the update waits behind them
+  auto backlog = make_random( 2000, 2, 7 );
+  for ( auto& [ id, vec ] : backlog )
+  {
+    id += 1000;
+    vec.data_[ 0 ] *= 10.0f;
+    vec.data_[ 1 ] = 5.0f + vec.data_[ 1 ] * 10.0f;
+  }
+  const auto backlog_ids = ids_of( backlog );
+  col->add_vectors( std::move( backlog ) );
+  idx.on_vectors_added( backlog_ids );
+
+  float nudged[] = { 4.1f, 1.0f };
+  std::vector< std::pair< id_t, float_vector > > update;
+  update.emplace_back( 14, float_vector( 2, nudged ) );
+  col->add_vectors( std::move( update ) );
+  idx.on_vectors_added( { 14 } );
+
+  float q[] = { 4.0f, 1.0f };
+  const auto expected = distance::get_distance_instance( distance::dist_type::euclidean )
+                            ->compute( float_vector( 2, q ), float_vector( 2, nudged ) );
+  std::vector< score_pair > results;
+  ASSERT_TRUE( idx.search_for_top_k( float_vector( 2, q ), 1, results ) );
+  ASSERT_EQ( results.size(), 1 );
+  EXPECT_EQ( results[ 0 ].second.first, 14 );
+  EXPECT_DOUBLE_EQ( results[ 0 ].first, expected );
+  ASSERT_TRUE( wait_for_indexer( idx ) );
+}
+
+TEST( HNSWTest, DeletedSlotsAreReusedByLaterUpserts )
+{
+  auto col = std::make_shared< collection >( 2, "hnsw_slot_reuse" );
+  col->add_vectors( make_grid( 0, 30 ) );
+
+  // without compaction the deleted slots stay around for reuse
+  auto params = indices::hnsw::params( distance::dist_type::euclidean, 16, 64, 64 );
+  params.reorder_ = false;
+  indices::hnsw::index idx( col, params );
+  idx.init();
+  ASSERT_EQ( idx.slot_count(), 30 );
+
+  std::vector< id_t > removed;
+  for ( id_t i = 0; i < 30; i += 3 )
+    removed.push_back( i );
+  col->remove_vectors( removed );
+  idx.on_vectors_removed( removed );
+  ASSERT_TRUE( wait_for_indexer( idx ) );
+
+  // a removed id comes back, and fresh ids take over the remaining deleted slots
+  std::vector< std::pair< id_t, float_vector > > upserts;
+  float back[] = { 0.0f, 0.0f };
+  upserts.emplace_back( 0, float_vector( 2, back ) );
+  for ( id_t i = 100; i < 109; ++i )
+  {
+    float d[] = { static_cast< float >( i ), 0.5f };
+    upserts.emplace_back( i, float_vector( 2, d ) );
+  }
+  const auto upserted_ids = ids_of( upserts );
+  col->add_vectors( std::move( upserts ) );
+  idx.on_vectors_added( upserted_ids );
+  ASSERT_TRUE( wait_for_indexer( idx ) );
+
+  EXPECT_EQ( idx.slot_count(), 30 );
+
+  std::vector< score_pair > results;
+  float q1[] = { 104.0f, 0.5f };
+  ASSERT_TRUE( idx.search_for_top_k( float_vector( 2, q1 ), 1, results ) );
+  ASSERT_EQ( results.size(), 1 );
+  EXPECT_EQ( results[ 0 ].second.first, 104 );
+
+  float q2[] = { 0.0f, 0.0f };
+  ASSERT_TRUE( idx.search_for_top_k( float_vector( 2, q2 ), 1, results ) );
+  ASSERT_EQ( results.size(), 1 );
+  EXPECT_EQ( results[ 0 ].second.first, 0 );
+
+  float q3[] = { 3.0f, 0.0f };
+  ASSERT_TRUE( idx.search_for_top_k( float_vector( 2, q3 ), 1, results ) );
+  ASSERT_EQ( results.size(), 1 );
+  EXPECT_NE( results[ 0 ].second.first, 3 );
+}
+
+TEST( HNSWTest, DeletedSlotsWaitForRepairBeforeReuse )
+{
+  auto col = std::make_shared< collection >( 2, "hnsw_slot_repair" );
+  col->add_vectors( make_grid( 0, 200 ) );
+
+  auto params = indices::hnsw::params( distance::dist_type::euclidean, 16, 64, 64 );
+  params.reorder_ = false;
+  indices::hnsw::index idx( col, params );
+  idx.init();
+
+  // too few deletions for a repair: their neighbours still link to them
+  col->remove_vectors( { 55, 56 } );
+  idx.on_vectors_removed( { 55, 56 } );
+  ASSERT_TRUE( wait_for_indexer( idx ) );
+
+  std::vector< std::pair< id_t, float_vector > > upserts;
+  for ( id_t i = 500; i < 502; ++i )
+  {
+    float d[] = { 100.0f + i, 100.0f };
+    upserts.emplace_back( i, float_vector( 2, d ) );
+  }
+  const auto upserted_ids = ids_of( upserts );
+  col->add_vectors( std::move( upserts ) );
+  idx.on_vectors_added( upserted_ids );
+  ASSERT_TRUE( wait_for_indexer( idx ) );
+
+  // the new ids got slots of their own, the old region stays reachable through the deleted ones
+  EXPECT_EQ( idx.slot_count(), 202 );
+  for ( const id_t i : { 54, 57, 65, 66 } )
+  {
+    float q[] = { static_cast< float >( i % 10 ), static_cast< float >( i / 10 ) };
+    std::vector< score_pair > results;
+    ASSERT_TRUE( idx.search_for_top_k( float_vector( 2, q ), 1, results ) );
+    ASSERT_EQ( results.size(), 1 );
+    EXPECT_EQ( results[ 0 ].second.first, i );
+  }
+}
+
+TEST( HNSWTest, CompactionDropsDeletedSlots )
+{
+  auto col = std::make_shared< collection >( 2, "hnsw_compaction" );
+  col->add_vectors( make_grid( 0, 30 ) );
+
+  indices::hnsw::index idx( col, indices::hnsw::params( distance::dist_type::euclidean, 16, 64, 64 ) );
+  idx.init();
+
+  std::vector< id_t > removed;
+  for ( id_t i = 0; i < 30; i += 3 )
+    removed.push_back( i );
+  col->remove_vectors( removed );
+  idx.on_vectors_removed( removed );
+  ASSERT_TRUE( wait_for_indexer( idx ) );
+  EXPECT_EQ( idx.slot_count(), 20 );
+
+  // every surviving vector is still its own nearest neighbour after the renumbering
+  for ( id_t i = 0; i < 30; ++i )
+  {
+    if ( i % 3 == 0 )
+      continue;
+    float q[] = { static_cast< float >( i % 10 ), static_cast< float >( i / 10 ) };
+    std::vector< score_pair > results;
+    ASSERT_TRUE( idx.search_for_top_k( float_vector( 2, q ), 1, results ) );
+    ASSERT_EQ( results.size(), 1 );
+    EXPECT_EQ( results[ 0 ].second.first, i );
+  }
+}
+
+// a repair reuses the deleted slots in place, only heavy churn renumbers the whole graph
+TEST( HNSWTest, RenumberingWaitsForHeavyChurn )
+{
+  auto col = std::make_shared< collection >( 2, "hnsw_churn" );
+  col->add_vectors( make_grid( 0, 200 ) );
+
+  indices::hnsw::index idx( col, indices::hnsw::params( distance::dist_type::euclidean, 16, 64, 64 ) );
+  idx.init();
+
+  std::vector< id_t > removed;
+  for ( id_t i = 0; i < 200; i += 16 )
+    removed.push_back( i );
+  col->remove_vectors( removed );
+  idx.on_vectors_removed( removed );
+  ASSERT_TRUE( wait_for_indexer( idx ) );
+
+  std::vector< std::pair< id_t, float_vector > > upserts;
+  for ( id_t i = 500; i < 500 + removed.size(); ++i )
+  {
+    float d[] = { 100.0f + i, 100.0f };
+    upserts.emplace_back( i, float_vector( 2, d ) );
+  }
+  const auto upserted_ids = ids_of( upserts );
+  col->add_vectors( std::move( upserts ) );
+  idx.on_vectors_added( upserted_ids );
+  ASSERT_TRUE( wait_for_indexer( idx ) );
+  // the new ids took the freed slots or the ones the compaction cut off the end
+  EXPECT_EQ( idx.slot_count(), 200 );
+
+  // half the graph leaves: that is renumbered away
+  removed.clear();
+  for ( id_t i = 0; i < 200; ++i )
+    if ( i % 16 != 0 && i % 2 == 1 )
+      removed.push_back( i );
+  col->remove_vectors( removed );
+  idx.on_vectors_removed( removed );
+  ASSERT_TRUE( wait_for_indexer( idx ) );
+  EXPECT_EQ( idx.slot_count(), col->size() );
+
+  for ( const auto id : col->get_all_vector_ids() )
+  {
+    const auto vec = col->get_vector_by_id( id );
+    std::vector< score_pair > results;
+    ASSERT_TRUE( idx.search_for_top_k( *vec, 1, results ) );
+    ASSERT_EQ( results.size(), 1 );
+    EXPECT_EQ( results[ 0 ].second.first, id );
+  }
+}
+
+TEST( HNSWTest, GraphIsRestoredFromSerializedIndex )
+{
+  auto col = std::make_shared< collection >( 2, "hnsw_serialize" );
+  col->add_vectors( make_grid( 0, 30 ) );
+
+  auto params = indices::hnsw::params( distance::dist_type::euclidean, 16, 64, 64 );
+  params.reorder_ = false;
+  indices::hnsw::index idx( col, params );
+  idx.init();
+
+  col->remove_vectors( { 4, 5 } );
+  idx.on_vectors_removed( { 4, 5 } );
+  ASSERT_TRUE( wait_for_indexer( idx ) );
+
+  std::stringstream ss;
+  const auto type = idx.get_index_type();
+  ss.write( reinterpret_cast< const char* >( &type ), sizeof( type ) );
+  idx.serialize( ss );
+
+  auto restored = index_t::deserialize( ss, col );
+  ASSERT_NE( restored, nullptr );
+  restored->init();
+
+  // a rebuild would only hold the 28 live vectors, the loaded graph still has the deleted slots
+  auto* restored_hnsw = dynamic_cast< indices::hnsw::index* >( restored.get() );
+  ASSERT_NE( restored_hnsw, nullptr );
+  EXPECT_EQ( restored_hnsw->slot_count(), 30 );
+
+  float q[] = { 4.0f, 0.0f };
+  std::vector< score_pair > results;
+  ASSERT_TRUE( restored->search_for_top_k( float_vector( 2, q ), 3, results ) );
+  ASSERT_EQ( results.size(), 3 );
+  EXPECT_EQ( results[ 0 ].second.first, 3 );
+  EXPECT_EQ( results[ 1 ].second.first, 14 );
+}
+
+TEST( HNSWTest, RecallOnRandomData )
+{
+  EXPECT_GE( recall_on_random_data( indices::hnsw::params( distance::dist_type::euclidean, 16, 100, 64 ) ), 0.95 );
+}
+
+// Linking each node to its M closest candidates keeps every link inside its cluster, and a search that
+// reaches the wrong cluster on layer 0 cannot leave it. The heuristic skips candidates that are closer to a
+// neighbour already kept, which leaves room for links to the other clusters. Closest-M selection stays
+// around 0.65 here.
+TEST( HNSWTest, HeuristicLinksConnectClusters )
+{
+  constexpr unsigned int dimension = 8;
+  const auto params = indices::hnsw::params( distance::dist_type::euclidean, 8, 64, 10 );
+  EXPECT_GE( recall( params, make_clusters( 40, 50, dimension, 1 ), make_clusters( 40, 2, dimension, 2 ) ), 0.9 );
+}
+
+TEST( HNSWTest, QuantizedTraversalRecall )
+{
+  auto params = indices::hnsw::params( distance::dist_type::euclidean, 16, 100, 64 );
+  params.quantizer_ = quantizer_type::sq8;
+  EXPECT_GE( recall_on_random_data( params ), 0.95 );
+}
+
+// An index created empty trains its quantizer once enough vectors arrived, whether they come in one batch or
+// the first of them alone. Trained on that one, every later vector would be clamped to its values.
+TEST( HNSWTest, QuantizerTrainsOnceEnoughVectorsArrived )
+{
+  constexpr unsigned int dimension = 16;
+  for ( const std::size_t first_batch : { std::size_t( 1200 ), std::size_t( 1 ) } )
+  {
+    const auto vectors = make_random( 1200, dimension, 5 );
+    auto col = std::make_shared< collection >( dimension, "hnsw_late_quantizer" );
+    auto params = indices::hnsw::params( distance::dist_type::euclidean, 16, 32, 64 );
+    params.quantizer_ = quantizer_type::sq8;
+    indices::hnsw::index idx( col, params );
+    idx.init();
+
+    for ( const auto& batch : { std::vector( vectors.begin(), vectors.begin() + first_batch ),
+                                std::vector( vectors.begin() + first_batch, vectors.end() ) } )
+    {
+      col->add_vectors( batch );
+      idx.on_vectors_added( ids_of( batch ) );
+      ASSERT_TRUE( wait_for_indexer( idx ) );
+    }
+
+    std::size_t hits = 0;
+    for ( const auto& [ id, vec ] : vectors )
+    {
+      std::vector< score_pair > results;
+      ASSERT_TRUE( idx.search_for_top_k( vec, 1, results ) );
+      hits += results[ 0 ].second.first == id;
+    }
+    EXPECT_GE( hits, vectors.size() * 95 / 100 ) << "first batch of " << first_batch;
+  }
+}
+
+TEST( HNSWTest, FilteredSearchOnlyReturnsMatches )
+{
+  constexpr unsigned int dimension = 16;
+  constexpr unsigned int k = 10;
+  auto vectors = make_random( 2000, dimension, 3 );
+  for ( auto& [ id, vec ] : vectors )
+  {
+    vec.add_metadata( "parity", std::to_string( id % 2 ) );
+    vec.add_metadata( "fifth", std::to_string( id % 5 ) );
+    if ( id % 400 == 0 )
+      vec.add_metadata( "rare", "yes" );
+  }
+  const auto queries = make_random( 20, dimension, 4 );
+
+  auto col = std::make_shared< collection >( dimension, "hnsw_filtered" );
+  col->add_vectors( vectors );
+  auto params = indices::hnsw::params( distance::dist_type::euclidean, 16, 100, 64 );
+  ASSERT_TRUE( col->add_index( "hnsw", index_type::hnsw, &params ) );
+
+  // one filter per search path: plain traversal, two-hop traversal and the brute-force fallback
+  const std::vector< metadata_filter > filters = { { { { "parity", { "1" } } } },
+                                                   { { { "fifth", { "3" } } } },
+                                                   { { { "rare", { "yes" } } } } };
+  auto distance = distance::get_distance_instance( distance::dist_type::euclidean );
+  for ( const auto& filter : filters )
+  {
+    std::size_t hits = 0, expected_count = 0;
+    for ( const auto& [ _, query ] : queries )
+    {
+      std::vector< std::pair< double, id_t > > matching;
+      for ( const auto& [ id, vec ] : vectors )
+        if ( filter.matches( vec.metadata_.get() ) )
+          matching.emplace_back( distance->compute( query, vec ), id );
+      const auto top = std::min< std::size_t >( k, matching.size() );
+      std::partial_sort( matching.begin(), matching.begin() + top, matching.end() );
+      std::set< id_t > expected;
+      for ( std::size_t i = 0; i < top; ++i )
+        expected.insert( matching[ i ].second );
+
+      search_params_t search_params;
+      search_params.filter_ = filter;
+      std::vector< score_pair > results;
+      ASSERT_TRUE( col->search_for_top_k( query, k, results, "hnsw", search_params ) );
+      ASSERT_EQ( results.size(), top );
+      for ( const auto& [ _score, _id_vector ] : results )
+      {
+        EXPECT_TRUE( filter.matches( _id_vector.second->metadata_.get() ) );
+        hits += expected.count( _id_vector.first );
+      }
+      expected_count += top;
+    }
+    EXPECT_GE( static_cast< double >( hits ) / expected_count, 0.9 ) << filter.terms_[ 0 ].key_;
+  }
+}
+
+TEST( HNSWTest, BatchSearchMatchesSingleQueries )
+{
+  constexpr unsigned int dimension = 16;
+  constexpr unsigned int k = 10;
+  auto col = std::make_shared< collection >( dimension, "hnsw_batch" );
+  col->add_vectors( make_random( 2000, dimension, 5 ) );
+  indices::hnsw::index idx( col, indices::hnsw::params( distance::dist_type::euclidean, 16, 100, 64 ) );
+  idx.init();
+
+  std::vector< float_vector > queries;
+  for ( auto& [ _, query ] : make_random( 200, dimension, 6 ) )
+    queries.push_back( std::move( query ) );
+
+  std::vector< std::vector< score_pair > > batch;
+  idx.search_knn_batch( queries, k, batch, {}, 4 );
+  ASSERT_EQ( batch.size(), queries.size() );
+  for ( std::size_t q = 0; q < queries.size(); ++q )
+  {
+    std::vector< score_pair > single;
+    idx.search_knn( queries[ q ], k, single );
+    ASSERT_EQ( batch[ q ].size(), single.size() );
+    for ( std::size_t i = 0; i < single.size(); ++i )
+      EXPECT_EQ( batch[ q ][ i ].second.first, single[ i ].second.first );
+  }
+
+  // through the collection, with the brute-force index as the fallback implementation
+  std::vector< std::vector< score_pair > > exact;
+  ASSERT_TRUE( col->search_for_top_k_batch( queries, k, exact ) );
+  ASSERT_EQ( exact.size(), queries.size() );
+  EXPECT_EQ( exact.front().size(), k );
+}
+
+TEST( HNSWTest, SearchAndBuildCountersAreReported )
+{
+  constexpr unsigned int dimension = 16;
+  auto col = std::make_shared< collection >( dimension, "hnsw_stats" );
+  col->add_vectors( make_random( 1000, dimension, 7 ) );
+  indices::hnsw::index idx( col, indices::hnsw::params( distance::dist_type::euclidean, 8, 64, 32 ) );
+  idx.init();
+
+  const auto queries = make_random( 10, dimension, 8 );
+  query_stats per_query;
+  search_params_t search_params;
+  search_params.stats_ = &per_query;
+  std::vector< score_pair > results;
+  idx.search_knn( queries[ 0 ].second, 5, results, search_params );
+  EXPECT_GT( per_query.distance_computations_, 0u );
+  EXPECT_GT( per_query.nodes_expanded_, 0u );
+  EXPECT_GE( per_query.visited_, per_query.nodes_expanded_ );
+  ASSERT_FALSE( per_query.hops_per_layer_.empty() );
+  EXPECT_GT( per_query.hops_per_layer_[ 0 ], 0u );
+
+  for ( std::size_t q = 1; q < queries.size(); ++q )
+    idx.search_knn( queries[ q ].second, 5, results );
+
+  const auto base = idx.get_stats();
+  const auto* _stats = dynamic_cast< const indices::hnsw::stats* >( base.get() );
+  ASSERT_NE( _stats, nullptr );
+  EXPECT_EQ( _stats->queries_, queries.size() );
+  EXPECT_GE( _stats->totals_.distance_computations_, per_query.distance_computations_ );
+  EXPECT_EQ( _stats->inserts_, 1000u );
+  EXPECT_GT( _stats->inserts_per_sec_, 0.0 );
+  EXPECT_GT( _stats->pruned_edges_, 0u );
+  EXPECT_EQ( _stats->live_count_, 1000u );
+  ASSERT_FALSE( _stats->average_degree_.empty() );
+  EXPECT_GT( _stats->average_degree_[ 0 ], 1.0 );
+  EXPECT_LE( _stats->average_degree_[ 0 ], 16.0 );
+}
+
+}  // namespace vector_db::test
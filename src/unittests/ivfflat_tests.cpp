@@ -1,8 +1,17 @@
+#include <algorithm>
+#include <array>
 #include <gtest/gtest.h>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
 #include <vector>
 
 #include "core/collection.h"
 #include "core/indices/ivfflat.h"
+#include "core/utils/k_means.h"
+#include "core/utils/proximity_graph.h"
 
 using namespace vector_db;
 
@@ -216,3 +225,1117 @@ TEST( IVFFlatTest, CustomParams )
   EXPECT_TRUE( col->search_for_top_k( query, 10, results, "ivf" ) );
   ASSERT_GE( results.size(), 1 );
 }
+
+TEST( IVFFlatTest, ListsAreRestoredFromSerializedIndex )
+{
+  auto col = std::make_shared< vector_db::collection >( 2, "test_collection_restore" );
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > vectors;
+  for ( int i = 0; i < 200; ++i )
+  {
+    float d[] = { static_cast< float >( i % 20 ), static_cast< float >( i / 20 ) };
+    vectors.emplace_back( i, vector_db::float_vector( 2, d ) );
+  }
+  col->add_vectors( std::move( vectors ) );
+
+  vector_db::indices::ivf_flat::params params( vector_db::distance::dist_type::euclidean, 8, 2 );
+  vector_db::indices::ivf_flat::index idx( col, params );
+  idx.init();
+
+  std::stringstream ss;
+  idx.serialize( ss );
+  auto restored = vector_db::indices::ivf_flat::index::deserialize( ss, col );
+
+  // changes made while the index was "offline" are picked up by init() without retraining
+  col->remove_vectors( { 5 } );
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > added;
+  float d[] = { 5.1f, 0.1f };
+  added.emplace_back( 1000, vector_db::float_vector( 2, d ) );
+  col->add_vectors( std::move( added ) );
+  restored->init();
+
+  float q[] = { 5.0f, 0.0f };
+  vector_db::float_vector query( 2, q );
+  std::vector< vector_db::score_pair > results;
+  EXPECT_TRUE( restored->search_for_top_k( query, 1, results ) );
+  ASSERT_EQ( results.size(), 1 );
+  EXPECT_EQ( results[ 0 ].second.first, 1000 );
+
+  // untouched regions answer exactly like the original
+  float far[] = { 15.0f, 8.0f };
+  vector_db::float_vector far_query( 2, far );
+  std::vector< vector_db::score_pair > original_results, restored_results;
+  EXPECT_TRUE( idx.search_for_top_k( far_query, 5, original_results ) );
+  EXPECT_TRUE( restored->search_for_top_k( far_query, 5, restored_results ) );
+  ASSERT_EQ( original_results.size(), restored_results.size() );
+  for ( size_t i = 0; i < original_results.size(); ++i )
+    EXPECT_EQ( original_results[ i ].second.first, restored_results[ i ].second.first );
+}
+
+TEST( IVFFlatTest, KMeansFindsSeparatedBlobsFromASample )
+{
+  // four tight blobs far apart, 500 points each
+  const float centres[ 4 ][ 2 ] = { { 0.0f, 0.0f }, { 100.0f, 0.0f }, { 0.0f, 100.0f }, { 100.0f, 100.0f } };
+  std::mt19937 rng( 3 );
+  std::normal_distribution< float > noise( 0.0f, 1.0f );
+  std::vector< float > rows;
+  for ( int i = 0; i < 2000; ++i )
+  {
+    rows.push_back( centres[ i % 4 ][ 0 ] + noise( rng ) );
+    rows.push_back( centres[ i % 4 ][ 1 ] + noise( rng ) );
+  }
+
+  // trained on 10% of the points, then every point is assigned
+  const auto result = vector_db::k_means( rows.data(), 2000, 2, 4, vector_db::distance::dist_type::euclidean, 200 );
+  ASSERT_EQ( result.centroids.size(), 4 );
+  size_t assigned = 0;
+  for ( const auto& c : result.centroids )
+  {
+    EXPECT_EQ( c.vector_ids.size(), 500 );
+    assigned += c.vector_ids.size();
+    // every member comes from the same blob
+    for ( const auto row : c.vector_ids )
+      EXPECT_EQ( row % 4, c.vector_ids.front() % 4 );
+  }
+  EXPECT_EQ( assigned, 2000 );
+  EXPECT_LT( result.distance_sum / 2000, 2.0 );
+}
+
+TEST( IVFFlatTest, KMeansBoundsSkipDistancesWithoutChangingTheResult )
+{
+  std::mt19937 rng( 5 );
+  std::uniform_real_distribution< float > uniform( 0.0f, 1.0f );
+  constexpr size_t count = 4000;
+  constexpr int dim = 8;
+  std::vector< float > rows( count * dim );
+  for ( auto& value : rows )
+    value = uniform( rng );
+
+  const auto euclidean = vector_db::distance::dist_type::euclidean;
+  const auto serial = vector_db::k_means( rows.data(), count, dim, 32, euclidean, 0, 100, 42, 1 );
+  const auto parallel = vector_db::k_means( rows.data(), count, dim, 32, euclidean, 0, 100, 42, 4 );
+
+  // the thread count doesn't change the clustering
+  ASSERT_EQ( serial.centroids.size(), parallel.centroids.size() );
+  for ( size_t j = 0; j < serial.centroids.size(); ++j )
+    EXPECT_EQ( serial.centroids[ j ].vector_ids, parallel.centroids[ j ].vector_ids );
+  EXPECT_EQ( serial.distance_computations, parallel.distance_computations );
+
+  // a naive assignment step scores every point against every centroid
+  const auto naive = static_cast< std::uint64_t >( serial.iterations + 2 ) * count * 32;
+  EXPECT_GT( serial.iterations, 2 );
+  EXPECT_LT( serial.distance_computations, naive * 2 / 3 );
+}
+
+TEST( IVFFlatTest, CentroidsFollowStreamedVectors )
+{
+  std::mt19937 rng( 9 );
+  std::normal_distribution< float > noise( 0.0f, 0.5f );
+  const auto point = [ & ]( const float x, const float y )
+  {
+    float d[] = { x + noise( rng ), y + noise( rng ) };
+    return vector_db::float_vector( 2, d );
+  };
+
+  auto col = std::make_shared< vector_db::collection >( 2, "test_collection_mini_batch" );
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > vectors;
+  for ( int i = 0; i < 200; ++i )
+    vectors.emplace_back( i, point( i % 2 ? 10.0f : 0.0f, 0.0f ) );
+  col->add_vectors( std::move( vectors ) );
+
+  // no rebuild: only the incremental updates can move the centroids
+  vector_db::indices::ivf_flat::params params( vector_db::distance::dist_type::euclidean, 2, 1, 1000000 );
+  vector_db::indices::ivf_flat::index idx( col, params );
+  idx.init();
+
+  for ( int batch = 0; batch < 20; ++batch )
+  {
+    std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > streamed;
+    for ( int i = 0; i < 20; ++i )
+      streamed.emplace_back( 1000 + batch * 20 + i, point( 10.0f, 6.0f ) );
+    col->add_vectors( streamed );
+    std::vector< vector_db::id_t > new_ids;
+    for ( const auto& [ id, _ ] : streamed )
+      new_ids.push_back( id );
+    idx.on_vectors_added( new_ids );
+  }
+
+  // read the centroids back from the serialized lists
+  std::stringstream ss;
+  idx.serialize( ss );
+  vector_db::indices::ivf_flat::params::deserialize( ss, vector_db::read_format_version( ss ) );
+  int dim;
+  uint32_t cluster_count;
+  ss.read( reinterpret_cast< char* >( &dim ), sizeof( dim ) );
+  ss.read( reinterpret_cast< char* >( &cluster_count ), sizeof( cluster_count ) );
+  ASSERT_EQ( dim, 2 );
+  ASSERT_EQ( cluster_count, 2 );
+  std::vector< std::pair< float, float > > centroids;
+  for ( uint32_t c = 0; c < cluster_count; ++c )
+  {
+    float xy[ 2 ];
+    ss.read( reinterpret_cast< char* >( xy ), sizeof( xy ) );
+    centroids.emplace_back( xy[ 0 ], xy[ 1 ] );
+    double radius;
+    ss.read( reinterpret_cast< char* >( &radius ), sizeof( radius ) );
+    uint64_t id_count;
+    ss.read( reinterpret_cast< char* >( &id_count ), sizeof( id_count ) );
+    ss.seekg( id_count * sizeof( vector_db::id_t ), std::ios::cur );
+
+    // the radius still bounds the members after the centroid moved
+    std::vector< float > rows( id_count * dim );
+    ss.read( reinterpret_cast< char* >( rows.data() ), rows.size() * sizeof( float ) );
+    for ( uint64_t m = 0; m < id_count; ++m )
+      EXPECT_LE( std::hypot( rows[ m * dim ] - xy[ 0 ], rows[ m * dim + 1 ] - xy[ 1 ] ), radius + 1e-4 );
+  }
+  std::sort( centroids.begin(), centroids.end() );
+
+  // the untouched cluster stays at the origin, the other one moved to the mean of its old and new members
+  EXPECT_NEAR( centroids[ 0 ].first, 0.0f, 0.5f );
+  EXPECT_NEAR( centroids[ 0 ].second, 0.0f, 0.5f );
+  EXPECT_NEAR( centroids[ 1 ].first, 10.0f, 0.5f );
+  EXPECT_NEAR( centroids[ 1 ].second, 6.0f * 400 / 500, 0.5f );
+}
+
+TEST( IVFFlatTest, ProbingEveryListMatchesExactSearchAfterRemovals )
+{
+  std::mt19937 rng( 3 );
+  std::uniform_real_distribution< float > coord( -10.0f, 10.0f );
+  auto col = std::make_shared< vector_db::collection >( 4, "test_collection_inline_lists" );
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > vectors;
+  for ( int i = 0; i < 300; ++i )
+  {
+    float d[] = { coord( rng ), coord( rng ), coord( rng ), coord( rng ) };
+    vectors.emplace_back( i, vector_db::float_vector( 4, d ) );
+  }
+  col->add_vectors( vectors );
+
+  vector_db::indices::ivf_flat::params params( vector_db::distance::dist_type::euclidean, 8, 8, 1000000 );
+  vector_db::indices::ivf_flat::index idx( col, params );
+  idx.init();
+
+  // every third vector leaves: the swap-removes reorder the lists
+  std::vector< vector_db::id_t > removed;
+  for ( int i = 0; i < 300; i += 3 )
+    removed.push_back( i );
+  col->remove_vectors( removed );
+  idx.on_vectors_removed( removed );
+
+  float q[] = { 1.0f, -2.0f, 3.0f, 0.5f };
+  vector_db::float_vector query( 4, q );
+  std::vector< std::pair< double, vector_db::id_t > > expected;
+  const auto dist_fn = vector_db::distance::get_distance_instance( vector_db::distance::dist_type::euclidean );
+  for ( const auto& [ id, vec ] : vectors )
+    if ( id % 3 != 0 )
+      expected.emplace_back( dist_fn->compute( query, vec ), id );
+  std::sort( expected.begin(), expected.end() );
+
+  std::vector< vector_db::score_pair > results;
+  ASSERT_TRUE( idx.search_for_top_k( query, 10, results ) );
+  ASSERT_EQ( results.size(), 10 );
+  for ( size_t i = 0; i < results.size(); ++i )
+  {
+    EXPECT_EQ( results[ i ].second.first, expected[ i ].second );
+    EXPECT_NEAR( results[ i ].first, expected[ i ].first, 1e-4 );
+    EXPECT_EQ( results[ i ].second.second->dimension_, 4 );
+  }
+}
+
+TEST( IVFFlatTest, UpdatedVectorsMoveInsteadOfBeingListedTwice )
+{
+  auto col = std::make_shared< vector_db::collection >( 2, "test_collection_updates" );
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > vectors;
+  for ( int i = 0; i < 100; ++i )
+  {
+    float d[] = { ( i % 2 ? 10.0f : 0.0f ) + 0.01f * i, 0.0f };
+    vectors.emplace_back( i, vector_db::float_vector( 2, d ) );
+  }
+  col->add_vectors( vectors );
+
+  vector_db::indices::ivf_flat::params params( vector_db::distance::dist_type::euclidean, 2, 2, 1000000 );
+  vector_db::indices::ivf_flat::index idx( col, params );
+  idx.init();
+
+  // id 4 moves from the cluster at the origin over to the other one, twice
+  for ( const float x : { 10.5f, 10.6f } )
+  {
+    float d[] = { x, 0.0f };
+    std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > update;
+    update.emplace_back( 4, vector_db::float_vector( 2, d ) );
+    col->add_vectors( update );
+    idx.on_vectors_added( { 4 } );
+  }
+
+  float q[] = { 10.6f, 0.0f };
+  std::vector< vector_db::score_pair > results;
+  ASSERT_TRUE( idx.search_for_top_k( vector_db::float_vector( 2, q ), 200, results ) );
+  EXPECT_EQ( results.size(), 100 );
+  EXPECT_EQ( results.front().second.first, 4 );
+  EXPECT_NEAR( results.front().first, 0.0, 1e-6 );
+  EXPECT_EQ( std::count_if( results.begin(), results.end(), []( const auto& r ) { return r.second.first == 4; } ), 1 );
+
+  // and is gone once deleted
+  col->remove_vectors( { 4 } );
+  idx.on_vectors_removed( { 4 } );
+  ASSERT_TRUE( idx.search_for_top_k( vector_db::float_vector( 2, q ), 200, results ) );
+  EXPECT_EQ( results.size(), 99 );
+  EXPECT_NE( results.front().second.first, 4 );
+}
+
+TEST( IVFFlatTest, ChangesDuringABackgroundRebuildAreReplayed )
+{
+  std::mt19937 rng( 5 );
+  std::uniform_real_distribution< float > coord( -10.0f, 10.0f );
+  const auto random_vector = [ & ]
+  {
+    float d[ 8 ];
+    for ( auto& x : d )
+      x = coord( rng );
+    return vector_db::float_vector( 8, d );
+  };
+
+  auto col = std::make_shared< vector_db::collection >( 8, "test_collection_background_rebuild" );
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > vectors;
+  for ( int i = 0; i < 20000; ++i )
+    vectors.emplace_back( i, random_vector() );
+  col->add_vectors( vectors );
+
+  // every 100 changes rebuild, whatever the drift
+  vector_db::indices::ivf_flat::params params( vector_db::distance::dist_type::euclidean, 32, 32, 100 );
+  params.drift_threshold_ = 0.0f;
+  vector_db::indices::ivf_flat::index idx( col, params );
+  idx.init();
+
+  // the first batch starts a rebuild, the later ones land while it trains
+  std::map< vector_db::id_t, vector_db::float_vector > expected;
+  for ( const auto& [ id, vec ] : vectors )
+    expected.emplace( id, vec );
+  for ( int batch = 0; batch < 10; ++batch )
+  {
+    std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > upserts;
+    std::vector< vector_db::id_t > upserted, removed;
+    for ( int i = 0; i < 50; ++i )
+    {
+      const vector_db::id_t id = 20000 + batch * 50 + i;
+      upserts.emplace_back( id, random_vector() );
+      upserts.emplace_back( batch * 100 + i, random_vector() );  // update
+      removed.push_back( batch * 100 + 50 + i );
+    }
+    for ( const auto& [ id, vec ] : upserts )
+    {
+      upserted.push_back( id );
+      expected.insert_or_assign( id, vec );
+    }
+    for ( const auto id : removed )
+      expected.erase( id );
+    col->add_vectors( upserts );
+    idx.on_vectors_added( upserted );
+    col->remove_vectors( removed );
+    idx.on_vectors_removed( removed );
+  }
+  idx.wait_for_rebuild();
+
+  // probing every list finds each vector exactly once, scored on its latest value
+  float q[ 8 ] = {};
+  const vector_db::float_vector query( 8, q );
+  const auto dist_fn = vector_db::distance::get_distance_instance( vector_db::distance::dist_type::euclidean );
+  std::vector< vector_db::score_pair > results;
+  ASSERT_TRUE( idx.search_for_top_k( query, 30000, results ) );
+  ASSERT_EQ( results.size(), expected.size() );
+  std::set< vector_db::id_t > seen;
+  for ( const auto& [ dist, id_vec ] : results )
+  {
+    EXPECT_TRUE( seen.insert( id_vec.first ).second );
+    ASSERT_TRUE( expected.count( id_vec.first ) );
+    EXPECT_NEAR( dist, dist_fn->compute( query, expected.at( id_vec.first ) ), 1e-4 );
+  }
+}
+
+TEST( IVFFlatTest, TrainingWaitsForEnoughVectors )
+{
+  std::mt19937 rng( 13 );
+  std::uniform_real_distribution< float > coord( -10.0f, 10.0f );
+  auto col = std::make_shared< vector_db::collection >( 8, "test_collection_fill" );
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > vectors;
+  for ( int i = 0; i < 1000; ++i )
+  {
+    float d[ 8 ];
+    for ( auto& x : d )
+      x = coord( rng );
+    vectors.emplace_back( i, vector_db::float_vector( 8, d ) );
+  }
+
+  // every list probed: a trained index is exact too
+  vector_db::indices::ivf_flat::params params( vector_db::distance::dist_type::euclidean, 10, 10, 1000000 );
+  vector_db::indices::ivf_flat::index idx( col, params );
+  idx.init();
+
+  // filled one vector at a time, as an empty collection is
+  const auto insert = [ & ]( const size_t begin, const size_t end )
+  {
+    for ( size_t i = begin; i < end; ++i )
+    {
+      col->add_vectors( { vectors[ i ] } );
+      idx.on_vectors_added( { vectors[ i ].first } );
+    }
+  };
+  // lists, listed vectors
+  const auto list_counts = [ & ]
+  {
+    const auto base = idx.get_stats();
+    const auto& _stats = dynamic_cast< const vector_db::indices::ivf_flat::stats& >( *base );
+    return std::make_pair( _stats.list_count_, _stats.vector_count_ );
+  };
+  const auto dist_fn = vector_db::distance::get_distance_instance( vector_db::distance::dist_type::euclidean );
+  const auto expect_exact = [ & ]( const size_t count, vector_db::query_stats& stats )
+  {
+    vector_db::search_params_t search_params;
+    search_params.stats_ = &stats;
+    for ( size_t q = 0; q < 20; ++q )
+    {
+      const auto& query = vectors[ q * 7 ].second;
+      std::vector< std::pair< double, vector_db::id_t > > all;
+      for ( size_t i = 0; i < count; ++i )
+        all.emplace_back( dist_fn->compute( query, vectors[ i ].second ), vectors[ i ].first );
+      std::partial_sort( all.begin(), all.begin() + 5, all.end() );
+      std::vector< vector_db::score_pair > results;
+      ASSERT_TRUE( idx.search_for_top_k( query, 5, results, search_params ) );
+      ASSERT_EQ( results.size(), 5 );
+      for ( size_t i = 0; i < 5; ++i )
+        EXPECT_EQ( results[ i ].second.first, all[ i ].second );
+    }
+  };
+
+  // below k * 39 vectors nothing is trained: searches scan the collection
+  insert( 0, 200 );
+  vector_db::query_stats untrained;
+  expect_exact( 200, untrained );
+  EXPECT_EQ( untrained.lists_probed_, 0 );
+  EXPECT_EQ( list_counts().first, 0u );
+
+  // trained in the background once there are enough, on all of them
+  insert( 200, vectors.size() );
+  idx.wait_for_rebuild();
+  vector_db::query_stats trained;
+  expect_exact( vectors.size(), trained );
+  EXPECT_GT( trained.lists_probed_, 0 );
+  EXPECT_EQ( list_counts(), std::make_pair( size_t{ 10 }, vectors.size() ) );
+}
+
+TEST( IVFFlatTest, Sq8ListsAreSmallerAndRerankRestoresTheExactOrder )
+{
+  std::mt19937 rng( 4 );
+  std::uniform_real_distribution< float > coord( -10.0f, 10.0f );
+  auto col = std::make_shared< vector_db::collection >( 16, "test_collection_sq8_lists" );
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > vectors;
+  for ( int i = 0; i < 2000; ++i )
+  {
+    float d[ 16 ];
+    for ( auto& x : d )
+      x = coord( rng );
+    vectors.emplace_back( i, vector_db::float_vector( 16, d ) );
+  }
+  col->add_vectors( vectors );
+
+  // every list is probed: only the coding of the lists differs
+  vector_db::indices::ivf_flat::params params( vector_db::distance::dist_type::euclidean, 8, 8, 1000000 );
+  vector_db::indices::ivf_flat::index flat( col, params );
+  flat.init();
+  params.quantizer_ = vector_db::quantizer_type::sq8;
+  vector_db::indices::ivf_flat::index sq8( col, params );
+  sq8.init();
+
+  std::stringstream flat_ss, sq8_ss;
+  flat.serialize( flat_ss );
+  sq8.serialize( sq8_ss );
+  // 16 code bytes per member instead of 64 for the vector, the 8 bytes of its id aside
+  EXPECT_LT( sq8_ss.str().size() * 5, flat_ss.str().size() * 2 );
+
+  vector_db::search_params_t rerank;
+  rerank.rerank_factor_ = 4.0f;
+  size_t found = 0;
+  for ( int q = 0; q < 20; ++q )
+  {
+    const auto& query = vectors[ q * 97 ].second;
+    std::vector< vector_db::score_pair > expected, approximate, reranked;
+    ASSERT_TRUE( flat.search_for_top_k( query, 10, expected ) );
+    ASSERT_TRUE( sq8.search_for_top_k( query, 10, approximate ) );
+    ASSERT_TRUE( sq8.search_for_top_k( query, 10, reranked, rerank ) );
+    ASSERT_EQ( reranked.size(), expected.size() );
+
+    std::set< vector_db::id_t > expected_ids;
+    for ( const auto& [ _, id_vec ] : expected )
+      expected_ids.insert( id_vec.first );
+    for ( const auto& [ _, id_vec ] : approximate )
+      found += expected_ids.count( id_vec.first );
+    for ( size_t i = 0; i < reranked.size(); ++i )
+    {
+      EXPECT_EQ( reranked[ i ].second.first, expected[ i ].second.first );
+      EXPECT_NEAR( reranked[ i ].first, expected[ i ].first, 1e-4 );
+    }
+  }
+  EXPECT_GE( found, 180 );
+}
+
+TEST( IVFFlatTest, Sq8ListsAreRestoredAndUpdatedInPlace )
+{
+  std::mt19937 rng( 5 );
+  std::uniform_real_distribution< float > coord( -10.0f, 10.0f );
+  auto col = std::make_shared< vector_db::collection >( 4, "test_collection_sq8_restore" );
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > vectors;
+  for ( int i = 0; i < 500; ++i )
+  {
+    float d[] = { coord( rng ), coord( rng ), coord( rng ), coord( rng ) };
+    vectors.emplace_back( i, vector_db::float_vector( 4, d ) );
+  }
+  col->add_vectors( vectors );
+
+  vector_db::indices::ivf_flat::params params( vector_db::distance::dist_type::euclidean, 8, 8, 1000000 );
+  params.quantizer_ = vector_db::quantizer_type::sq8;
+  params.rerank_factor_ = 2.0f;
+  vector_db::indices::ivf_flat::index idx( col, params );
+  idx.init();
+
+  std::stringstream ss;
+  idx.serialize( ss );
+  auto restored = vector_db::indices::ivf_flat::index::deserialize( ss, col );
+  EXPECT_EQ( restored->get_params()->quantizer_, vector_db::quantizer_type::sq8 );
+  EXPECT_EQ( restored->get_params()->rerank_factor_, 2.0f );
+  restored->init();
+
+  // removals swap coded rows around, an update moves the id to the list of its new vector
+  std::vector< vector_db::id_t > removed;
+  for ( int i = 0; i < 500; i += 5 )
+    removed.push_back( i );
+  col->remove_vectors( removed );
+  restored->on_vectors_removed( removed );
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > update;
+  update.emplace_back( 1, vectors[ 2 ].second );
+  col->add_vectors( update );
+  restored->on_vectors_added( { 1 } );
+
+  std::vector< vector_db::score_pair > results;
+  ASSERT_TRUE( restored->search_for_top_k( vectors[ 2 ].second, 1000, results ) );
+  EXPECT_EQ( results.size(), 400 );
+  std::set< vector_db::id_t > seen;
+  for ( const auto& [ _, id_vec ] : results )
+  {
+    EXPECT_TRUE( seen.insert( id_vec.first ).second );
+    EXPECT_NE( id_vec.first % 5, 0 );
+  }
+  ASSERT_GE( results.size(), 2 );
+  EXPECT_NEAR( results[ 0 ].first, 0.0, 1e-6 );
+  EXPECT_NEAR( results[ 1 ].first, 0.0, 1e-6 );
+}
+
+TEST( IVFFlatTest, AdaptiveProbingStaysExactWhileSkippingLists )
+{
+  // blobs around well separated centres, so that most lists are provably too far
+  std::mt19937 rng( 6 );
+  std::uniform_real_distribution< float > centre( -50.0f, 50.0f );
+  std::normal_distribution< float > noise( 0.0f, 1.0f );
+  std::vector< std::vector< float > > centres( 20, std::vector< float >( 8 ) );
+  for ( auto& c : centres )
+    for ( auto& x : c )
+      x = centre( rng );
+  const auto blob_vector = [ & ]( const size_t i )
+  {
+    float d[ 8 ];
+    for ( int j = 0; j < 8; ++j )
+      d[ j ] = centres[ i % centres.size() ][ j ] + noise( rng );
+    return vector_db::float_vector( 8, d );
+  };
+
+  auto col = std::make_shared< vector_db::collection >( 8, "test_collection_adaptive_probe" );
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > vectors;
+  for ( int i = 0; i < 4000; ++i )
+    vectors.emplace_back( i, blob_vector( i ) );
+  col->add_vectors( vectors );
+
+  // n_probe only caps: every list may be probed
+  vector_db::indices::ivf_flat::params params( vector_db::distance::dist_type::euclidean, 20, 20, 1000000 );
+  params.adaptive_probe_ = true;
+  vector_db::indices::ivf_flat::index idx( col, params );
+  idx.init();
+
+  // streamed vectors move the centroids, the radii have to keep bounding the lists
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > streamed;
+  std::vector< vector_db::id_t > streamed_ids;
+  for ( int i = 4000; i < 4500; ++i )
+  {
+    streamed.emplace_back( i, blob_vector( i ) );
+    streamed_ids.push_back( i );
+  }
+  col->add_vectors( streamed );
+  idx.on_vectors_added( streamed_ids );
+  vectors.insert( vectors.end(), streamed.begin(), streamed.end() );
+
+  const auto dist_fn = vector_db::distance::get_distance_instance( vector_db::distance::dist_type::euclidean );
+  vector_db::query_stats stats;
+  vector_db::search_params_t search_params;
+  search_params.stats_ = &stats;
+  const int queries = 20;
+  for ( int q = 0; q < queries; ++q )
+  {
+    const auto query = blob_vector( q * 7 );
+    std::vector< std::pair< double, vector_db::id_t > > expected;
+    for ( const auto& [ id, vec ] : vectors )
+      expected.emplace_back( dist_fn->compute( query, vec ), id );
+    std::partial_sort( expected.begin(), expected.begin() + 10, expected.end() );
+
+    std::vector< vector_db::score_pair > results;
+    ASSERT_TRUE( idx.search_for_top_k( query, 10, results, search_params ) );
+    ASSERT_EQ( results.size(), 10 );
+    for ( size_t i = 0; i < results.size(); ++i )
+      EXPECT_NEAR( results[ i ].first, expected[ i ].first, 1e-4 );
+  }
+  EXPECT_LT( stats.lists_probed_, queries * 5u );
+
+  // the budget stops probing after the first list
+  params.probe_budget_ = 1;
+  vector_db::indices::ivf_flat::index budgeted( col, params );
+  budgeted.init();
+  vector_db::query_stats budget_stats;
+  search_params.stats_ = &budget_stats;
+  std::vector< vector_db::score_pair > results;
+  ASSERT_TRUE( budgeted.search_for_top_k( blob_vector( 3 ), 10, results, search_params ) );
+  EXPECT_EQ( budget_stats.lists_probed_, 1u );
+}
+
+TEST( IVFFlatTest, ProximityGraphFindsTheNearestPoints )
+{
+  std::mt19937 rng( 7 );
+  std::uniform_real_distribution< float > coord( -1.0f, 1.0f );
+  const int dim = 16;
+  std::vector< float > points( 3000 * dim );
+  for ( auto& x : points )
+    x = coord( rng );
+  const auto point = [ & ]( const uint32_t j ) { return static_cast< const float* >( points.data() + j * dim ); };
+
+  vector_db::proximity_graph graph( vector_db::distance::dist_type::euclidean, dim );
+  for ( size_t j = 0; j < 3000; ++j )
+    graph.insert( point );
+  ASSERT_EQ( graph.size(), 3000 );
+
+  const auto dist_fn = vector_db::distance::get_distance_instance( vector_db::distance::dist_type::euclidean );
+  size_t found = 0;
+  uint64_t computations = 0;
+  for ( int q = 0; q < 50; ++q )
+  {
+    float query[ dim ];
+    for ( auto& x : query )
+      x = coord( rng );
+    std::vector< std::pair< double, uint32_t > > expected;
+    for ( uint32_t j = 0; j < 3000; ++j )
+      expected.emplace_back( dist_fn->compute( query, point( j ), dim ), j );
+    std::partial_sort( expected.begin(), expected.begin() + 10, expected.end() );
+    expected.resize( 10 );
+
+    const auto results = graph.search( query, 10, 64, point, computations );
+    ASSERT_EQ( results.size(), 10 );
+    EXPECT_TRUE( std::is_sorted( results.begin(), results.end() ) );
+    for ( const auto& result : results )
+      found += std::count( expected.begin(), expected.end(), result );
+  }
+  EXPECT_GE( found, 475 );
+  EXPECT_LT( computations, 50u * 3000 / 2 );
+}
+
+// the graph stores no points: after they moved a little, as centroids do, searches score the new positions
+TEST( IVFFlatTest, ProximityGraphFollowsPointsMovedInPlace )
+{
+  std::mt19937 rng( 8 );
+  std::uniform_real_distribution< float > coord( -1.0f, 1.0f ), jitter( -0.05f, 0.05f );
+  const int dim = 8;
+  const size_t count = 2000;
+  std::vector< float > points( count * dim );
+  for ( auto& x : points )
+    x = coord( rng );
+  const auto point = [ & ]( const uint32_t j ) { return static_cast< const float* >( points.data() + j * dim ); };
+
+  vector_db::proximity_graph graph( vector_db::distance::dist_type::euclidean, dim );
+  for ( size_t j = 0; j < count; ++j )
+    graph.insert( point );
+  for ( auto& x : points )
+    x += jitter( rng );
+
+  uint64_t computations = 0;
+  size_t found = 0;
+  for ( uint32_t j = 0; j < count; j += 10 )
+  {
+    const auto results = graph.search( point( j ), 1, 32, point, computations );
+    ASSERT_EQ( results.size(), 1 );
+    found += results[ 0 ].second == j && results[ 0 ].first == 0.0;
+  }
+  EXPECT_GE( found, count / 10 * 98 / 100 );
+}
+
+// Algorithm 4 on a hand-made neighbourhood of the origin
+TEST( IVFFlatTest, NeighborSelectionKeepsDiverseCandidates )
+{
+  // a, b next to it, c and d in other directions
+  const std::vector< std::array< float, 2 > > points = { { 1.0f, 0.0f }, { 1.1f, 0.1f }, { 0.0f, 1.2f }, { -1.3f, 0.0f } };
+  const auto dist_fn = vector_db::distance::get_distance_instance( vector_db::distance::dist_type::euclidean );
+  const auto between = [ & ]( const uint32_t a, const uint32_t b ) { return dist_fn->compute( points[ a ].data(), points[ b ].data(), 2 ); };
+  const float origin[ 2 ] = {};
+  std::vector< std::pair< double, uint32_t > > candidates;
+  for ( uint32_t j = 0; j < points.size(); ++j )
+    candidates.emplace_back( dist_fn->compute( origin, points[ j ].data(), 2 ), j );
+  std::sort( candidates.begin(), candidates.end() );
+
+  const auto nodes = [ & ]( const size_t max, const bool keep_pruned )
+  {
+    std::vector< uint32_t > kept;
+    for ( const auto& [ _, node ] : vector_db::select_neighbors_heuristic< uint32_t >( candidates, max, between, keep_pruned ) )
+      kept.push_back( node );
+    return kept;
+  };
+  // b is closer to a than to the origin
+  EXPECT_EQ( nodes( 4, false ), ( std::vector< uint32_t >{ 0, 2, 3 } ) );
+  EXPECT_EQ( nodes( 2, false ), ( std::vector< uint32_t >{ 0, 2 } ) );
+  // backfilled, the links stay nearest first
+  EXPECT_EQ( nodes( 4, true ), ( std::vector< uint32_t >{ 0, 1, 2, 3 } ) );
+  EXPECT_EQ( nodes( 3, true ), ( std::vector< uint32_t >{ 0, 2, 3 } ) );
+}
+
+TEST( IVFFlatTest, CentroidGraphPicksTheListsOfTheFlatScan )
+{
+  std::mt19937 rng( 8 );
+  std::uniform_real_distribution< float > coord( -10.0f, 10.0f );
+  auto col = std::make_shared< vector_db::collection >( 8, "test_collection_centroid_graph" );
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > vectors;
+  for ( int i = 0; i < 8000; ++i )
+  {
+    float d[ 8 ];
+    for ( auto& x : d )
+      x = coord( rng );
+    vectors.emplace_back( i, vector_db::float_vector( 8, d ) );
+  }
+  col->add_vectors( vectors );
+
+  // same data and seed: both train the same clusters, only the coarse search differs
+  vector_db::indices::ivf_flat::params params( vector_db::distance::dist_type::euclidean, 256, 8, 1000000 );
+  params.training_sample_ = 16;
+  vector_db::indices::ivf_flat::index flat( col, params );
+  flat.init();
+  params.coarse_ = vector_db::indices::ivf_flat::coarse_quantizer::graph;
+  vector_db::indices::ivf_flat::index graph( col, params );
+  graph.init();
+
+  // streamed vectors are assigned through the graph
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > streamed;
+  streamed.emplace_back( 9000, vectors[ 11 ].second );
+  col->add_vectors( streamed );
+  flat.on_vectors_added( { 9000 } );
+  graph.on_vectors_added( { 9000 } );
+
+  size_t common = 0;
+  for ( int q = 0; q < 30; ++q )
+  {
+    const auto& query = vectors[ q * 251 ].second;
+    std::vector< vector_db::score_pair > expected, results;
+    ASSERT_TRUE( flat.search_for_top_k( query, 10, expected ) );
+    ASSERT_TRUE( graph.search_for_top_k( query, 10, results ) );
+    std::set< vector_db::id_t > expected_ids;
+    for ( const auto& [ _, id_vec ] : expected )
+      expected_ids.insert( id_vec.first );
+    for ( const auto& [ _, id_vec ] : results )
+      common += expected_ids.count( id_vec.first );
+  }
+  EXPECT_GE( common, 285 );
+
+  std::vector< vector_db::score_pair > results;
+  ASSERT_TRUE( graph.search_for_top_k( vectors[ 11 ].second, 2, results ) );
+  ASSERT_EQ( results.size(), 2 );
+  EXPECT_NEAR( results[ 1 ].first, 0.0, 1e-6 );
+
+  // the graph is linked again on load
+  std::stringstream ss;
+  graph.serialize( ss );
+  auto restored = vector_db::indices::ivf_flat::index::deserialize( ss, col );
+  EXPECT_EQ( restored->get_params()->coarse_, vector_db::indices::ivf_flat::coarse_quantizer::graph );
+  std::vector< vector_db::score_pair > before, after;
+  ASSERT_TRUE( graph.search_for_top_k( vectors[ 5 ].second, 10, before ) );
+  ASSERT_TRUE( restored->search_for_top_k( vectors[ 5 ].second, 10, after ) );
+  ASSERT_EQ( before.size(), after.size() );
+  for ( size_t i = 0; i < before.size(); ++i )
+    EXPECT_EQ( before[ i ].second.first, after[ i ].second.first );
+}
+
+TEST( IVFFlatTest, ParallelListScanMatchesTheSequentialOne )
+{
+  std::mt19937 rng( 10 );
+  std::uniform_real_distribution< float > coord( -10.0f, 10.0f );
+  auto col = std::make_shared< vector_db::collection >( 8, "test_collection_parallel_scan" );
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > vectors;
+  for ( int i = 0; i < 5000; ++i )
+  {
+    float d[ 8 ];
+    for ( auto& x : d )
+      x = coord( rng );
+    vectors.emplace_back( i, vector_db::float_vector( 8, d ) );
+  }
+  col->add_vectors( vectors );
+
+  vector_db::indices::ivf_flat::params params( vector_db::distance::dist_type::euclidean, 32, 16, 1000000 );
+  vector_db::indices::ivf_flat::index sequential( col, params );
+  sequential.init();
+  params.parallel_scan_threshold_ = 1000;
+  params.scan_threads_ = 4;
+  vector_db::indices::ivf_flat::index parallel( col, params );
+  parallel.init();
+
+  for ( const unsigned int k : { 1u, 10u, 500u } )
+  {
+    vector_db::query_stats sequential_stats, parallel_stats;
+    vector_db::search_params_t search_params;
+    for ( int q = 0; q < 10; ++q )
+    {
+      const auto& query = vectors[ q * 311 ].second;
+      std::vector< vector_db::score_pair > expected, results;
+      search_params.stats_ = &sequential_stats;
+      ASSERT_TRUE( sequential.search_for_top_k( query, k, expected, search_params ) );
+      search_params.stats_ = &parallel_stats;
+      ASSERT_TRUE( parallel.search_for_top_k( query, k, results, search_params ) );
+      ASSERT_EQ( results.size(), expected.size() );
+      for ( size_t i = 0; i < results.size(); ++i )
+      {
+        EXPECT_EQ( results[ i ].second.first, expected[ i ].second.first );
+        EXPECT_EQ( results[ i ].first, expected[ i ].first );
+      }
+    }
+    EXPECT_EQ( parallel_stats.lists_probed_, sequential_stats.lists_probed_ );
+    EXPECT_EQ( parallel_stats.distance_computations_, sequential_stats.distance_computations_ );
+  }
+}
+
+// queries scanning in parallel at the same time share the pool's workers, and still see every list
+TEST( IVFFlatTest, ConcurrentParallelScansMatchTheSequentialOne )
+{
+  std::mt19937 rng( 12 );
+  std::uniform_real_distribution< float > coord( -10.0f, 10.0f );
+  auto col = std::make_shared< vector_db::collection >( 8, "test_collection_concurrent_scan" );
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > vectors;
+  for ( int i = 0; i < 4000; ++i )
+  {
+    float d[ 8 ];
+    for ( auto& x : d )
+      x = coord( rng );
+    vectors.emplace_back( i, vector_db::float_vector( 8, d ) );
+  }
+  col->add_vectors( vectors );
+
+  vector_db::indices::ivf_flat::params params( vector_db::distance::dist_type::euclidean, 32, 16, 1000000 );
+  vector_db::indices::ivf_flat::index sequential( col, params );
+  sequential.init();
+  params.parallel_scan_threshold_ = 500;
+  vector_db::indices::ivf_flat::index parallel( col, params );
+  parallel.init();
+
+  const int queries = 40;
+  std::vector< std::vector< vector_db::id_t > > expected( queries ), found( queries );
+  for ( int q = 0; q < queries; ++q )
+  {
+    std::vector< vector_db::score_pair > results;
+    ASSERT_TRUE( sequential.search_for_top_k( vectors[ q * 97 ].second, 10, results ) );
+    for ( const auto& result : results )
+      expected[ q ].push_back( result.second.first );
+  }
+
+  std::vector< std::thread > searchers;
+  for ( int t = 0; t < 4; ++t )
+    searchers.emplace_back(
+        [ &, t ]
+        {
+          for ( int q = t; q < queries; q += 4 )
+          {
+            std::vector< vector_db::score_pair > results;
+            parallel.search_for_top_k( vectors[ q * 97 ].second, 10, results );
+            for ( const auto& result : results )
+              found[ q ].push_back( result.second.first );
+          }
+        } );
+  for ( auto& searcher : searchers )
+    searcher.join();
+  for ( int q = 0; q < queries; ++q )
+    EXPECT_EQ( found[ q ], expected[ q ] );
+}
+
+TEST( IVFFlatTest, BalancedKMeansCapsTheClusterSizes )
+{
+  // one dense blob holding most of the rows, a few sparse ones around it
+  std::mt19937 rng( 11 );
+  std::normal_distribution< float > dense( 0.0f, 1.0f ), sparse( 0.0f, 0.3f );
+  const size_t count = 4000;
+  std::vector< float > rows;
+  for ( size_t i = 0; i < count; ++i )
+  {
+    const bool in_blob = i % 10 != 0;
+    const float cx = in_blob ? 0.0f : 20.0f * static_cast< float >( i % 40 / 10 );
+    rows.push_back( cx + ( in_blob ? dense( rng ) : sparse( rng ) ) );
+    rows.push_back( in_blob ? dense( rng ) : 20.0f + sparse( rng ) );
+  }
+
+  const auto euclidean = vector_db::distance::dist_type::euclidean;
+  const auto free = vector_db::k_means( rows.data(), count, 2, 16, euclidean );
+  const auto balanced = vector_db::k_means( rows.data(), count, 2, 16, euclidean, 0, 100, 42, 0, 1.2 );
+  const auto largest = []( const vector_db::k_means_result& result )
+  {
+    size_t size = 0;
+    for ( const auto& c : result.centroids )
+      size = std::max( size, c.vector_ids.size() );
+    return size;
+  };
+  EXPECT_GT( largest( free ), 300u );
+  EXPECT_LE( largest( balanced ), 300u );
+
+  size_t assigned = 0;
+  for ( const auto& c : balanced.centroids )
+  {
+    assigned += c.vector_ids.size();
+    if ( c.vector_ids.empty() )
+      continue;
+    // the centroids sit at the mean of the rows they got
+    double x = 0.0, y = 0.0;
+    for ( const auto row : c.vector_ids )
+    {
+      x += rows[ row * 2 ];
+      y += rows[ row * 2 + 1 ];
+    }
+    EXPECT_NEAR( c.centroid.data_[ 0 ], x / c.vector_ids.size(), 1e-3 );
+    EXPECT_NEAR( c.centroid.data_[ 1 ], y / c.vector_ids.size(), 1e-3 );
+  }
+  EXPECT_EQ( assigned, count );
+}
+
+TEST( IVFFlatTest, StatsReportTheListSizes )
+{
+  std::mt19937 rng( 12 );
+  std::normal_distribution< float > dense( 0.0f, 1.0f );
+  auto col = std::make_shared< vector_db::collection >( 2, "test_collection_list_stats" );
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > vectors;
+  for ( int i = 0; i < 1000; ++i )
+  {
+    float d[] = { dense( rng ) + ( i % 5 == 0 ? 30.0f : 0.0f ), dense( rng ) };
+    vectors.emplace_back( i, vector_db::float_vector( 2, d ) );
+  }
+  col->add_vectors( vectors );
+
+  vector_db::indices::ivf_flat::params params( vector_db::distance::dist_type::euclidean, 10, 2, 1000000 );
+  params.max_list_imbalance_ = 1.5f;
+  vector_db::indices::ivf_flat::index idx( col, params );
+  idx.init();
+  std::vector< vector_db::score_pair > results;
+  for ( int q = 0; q < 3; ++q )
+    ASSERT_TRUE( idx.search_for_top_k( vectors[ q ].second, 5, results ) );
+
+  const auto base = idx.get_stats();
+  const auto* _stats = dynamic_cast< const vector_db::indices::ivf_flat::stats* >( base.get() );
+  ASSERT_NE( _stats, nullptr );
+  EXPECT_EQ( _stats->queries_, 3u );
+  EXPECT_EQ( _stats->totals_.lists_probed_, 6u );
+  EXPECT_GT( _stats->totals_.distance_computations_, 0u );
+  EXPECT_EQ( _stats->list_count_, 10u );
+  EXPECT_EQ( _stats->vector_count_, 1000u );
+  EXPECT_LE( _stats->largest_list_, 150u );
+
+  // every list falls in the bucket of its size
+  uint64_t lists = 0;
+  for ( const auto bucket : _stats->list_size_histogram_ )
+    lists += bucket;
+  EXPECT_EQ( lists, 10u );
+  ASSERT_FALSE( _stats->list_size_histogram_.empty() );
+  EXPECT_GT( _stats->list_size_histogram_.back(), 0u );
+  EXPECT_LE( _stats->largest_list_, ( size_t{ 1 } << ( _stats->list_size_histogram_.size() - 1 ) ) - 1 );
+  EXPECT_GE( _stats->largest_list_, size_t{ 1 } << ( _stats->list_size_histogram_.size() - 2 ) );
+}
+
+TEST( IVFFlatTest, SpilledListsRaiseRecallAtLowProbes )
+{
+  // uniform data has no gaps between the clusters: many neighbours sit across a list boundary
+  std::mt19937 rng( 13 );
+  std::uniform_real_distribution< float > uniform( 0.0f, 1.0f );
+  const auto random_vector = [ & ]()
+  {
+    float d[ 8 ];
+    for ( auto& x : d )
+      x = uniform( rng );
+    return vector_db::float_vector( 8, d );
+  };
+  auto col = std::make_shared< vector_db::collection >( 8, "test_collection_spill" );
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > vectors;
+  for ( int i = 0; i < 4000; ++i )
+    vectors.emplace_back( i, random_vector() );
+  col->add_vectors( vectors );
+
+  vector_db::indices::ivf_flat::params params( vector_db::distance::dist_type::euclidean, 40, 2, 1000000 );
+  vector_db::indices::ivf_flat::index single( col, params );
+  single.init();
+  params.spill_ = true;
+  vector_db::indices::ivf_flat::index spilled( col, params );
+  spilled.init();
+
+  const auto dist_fn = vector_db::distance::get_distance_instance( vector_db::distance::dist_type::euclidean );
+  const auto exact = [ & ]( const vector_db::float_vector& query, const size_t k )
+  {
+    std::vector< std::pair< double, vector_db::id_t > > all;
+    for ( const auto& [ id, vec ] : vectors )
+      all.emplace_back( dist_fn->compute( query, vec ), id );
+    std::partial_sort( all.begin(), all.begin() + k, all.end() );
+    all.resize( k );
+    return all;
+  };
+  const auto recall = [ & ]( vector_db::indices::ivf_flat::index& idx )
+  {
+    double found = 0.0;
+    for ( int q = 0; q < 50; ++q )
+    {
+      const auto query = random_vector();
+      const auto expected = exact( query, 10 );
+      std::vector< vector_db::score_pair > results;
+      EXPECT_TRUE( idx.search_for_top_k( query, 10, results ) );
+      std::set< vector_db::id_t > seen;
+      for ( const auto& [ _, id_vec ] : results )
+      {
+        EXPECT_TRUE( seen.insert( id_vec.first ).second );
+        found += std::count_if( expected.begin(),
+                                expected.end(),
+                                [ & ]( const auto& entry ) { return entry.second == id_vec.first; } );
+      }
+    }
+    return found / 500.0;
+  };
+  EXPECT_GT( recall( spilled ), recall( single ) + 0.05 );
+
+  // every vector is listed twice, in two different lists
+  auto base = spilled.get_stats();
+  EXPECT_EQ( dynamic_cast< const vector_db::indices::ivf_flat::stats* >( base.get() )->vector_count_, 8000u );
+
+  // removals take both copies, updates move both, and a restored index knows which members are copies
+  std::vector< vector_db::id_t > removed;
+  for ( vector_db::id_t id = 0; id < 4000; id += 9 )
+    removed.push_back( id );
+  col->remove_vectors( removed );
+  spilled.on_vectors_removed( removed );
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > updates;
+  std::vector< vector_db::id_t > updated;
+  for ( vector_db::id_t id = 1; id < 4000; id += 9 )
+  {
+    updates.emplace_back( id, random_vector() );
+    updated.push_back( id );
+  }
+  col->add_vectors( updates );
+  spilled.on_vectors_added( updated );
+  vectors.clear();
+  for ( const auto id : col->get_all_vector_ids() )
+    vectors.emplace_back( id, std::move( *col->get_vector_by_id( id ) ) );
+
+  std::stringstream ss;
+  const auto type = spilled.get_index_type();
+  ss.write( reinterpret_cast< const char* >( &type ), sizeof( type ) );
+  spilled.serialize( ss );
+  auto restored = vector_db::index_t::deserialize( ss, col );
+  ASSERT_TRUE( restored );
+  restored->init();
+  base = restored->get_stats();
+  EXPECT_EQ( dynamic_cast< const vector_db::indices::ivf_flat::stats* >( base.get() )->vector_count_, 2 * vectors.size() );
+
+  // with every list probed, the result is the exact one, free of duplicates
+  vector_db::search_params_t everything;
+  everything.n_probe_ = 40;
+  for ( int q = 0; q < 10; ++q )
+  {
+    const auto query = random_vector();
+    const auto expected = exact( query, 50 );
+    for ( auto* idx : { static_cast< vector_db::index_t* >( &spilled ), restored.get() } )
+    {
+      std::vector< vector_db::score_pair > results;
+      ASSERT_TRUE( idx->search_for_top_k( query, 50, results, everything ) );
+      ASSERT_EQ( results.size(), 50 );
+      for ( size_t i = 0; i < results.size(); ++i )
+        EXPECT_NEAR( results[ i ].first, expected[ i ].first, 1e-5 );
+    }
+  }
+}
+
+TEST( IVFFlatTest, MaintenanceKeepsListSizesBoundedAsDataDrifts )
+{
+  for ( const bool spill : { false, true } )
+  {
+    std::mt19937 rng( 14 );
+    std::uniform_real_distribution< float > uniform( 0.0f, 10.0f );
+    std::normal_distribution< float > hot_spot( 1.0f, 0.3f );
+    auto col = std::make_shared< vector_db::collection >( 4, "test_collection_maintenance" );
+    std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > vectors;
+    for ( int i = 0; i < 1000; ++i )
+    {
+      float d[] = { uniform( rng ), uniform( rng ), uniform( rng ), uniform( rng ) };
+      vectors.emplace_back( i, vector_db::float_vector( 4, d ) );
+    }
+    col->add_vectors( vectors );
+
+    // drift never triggers a rebuild: only maintenance keeps the lists in shape
+    vector_db::indices::ivf_flat::params params( vector_db::distance::dist_type::euclidean, 10, 3, 1000000 );
+    params.split_factor_ = 2.5f;
+    params.merge_factor_ = 0.3f;
+    params.spill_ = spill;
+    params.coarse_ = spill ? vector_db::indices::ivf_flat::coarse_quantizer::graph
+                           : vector_db::indices::ivf_flat::coarse_quantizer::flat;
+    vector_db::indices::ivf_flat::index idx( col, params );
+    idx.init();
+
+    // one corner empties out, its lists get dissolved
+    std::vector< vector_db::id_t > removed;
+    for ( const auto& [ id, vec ] : vectors )
+      if ( vec.data_[ 0 ] > 6.0f && vec.data_[ 1 ] > 6.0f )
+        removed.push_back( id );
+    col->remove_vectors( removed );
+    idx.on_vectors_removed( removed );
+    idx.wait_for_rebuild();
+
+    // and the new vectors crowd into another one, whose lists get split
+    for ( int batch = 0; batch < 30; ++batch )
+    {
+      std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > streamed;
+      std::vector< vector_db::id_t > streamed_ids;
+      for ( int i = 0; i < 100; ++i )
+      {
+        float d[] = { hot_spot( rng ), hot_spot( rng ), hot_spot( rng ), hot_spot( rng ) };
+        streamed.emplace_back( 1000 + batch * 100 + i, vector_db::float_vector( 4, d ) );
+        streamed_ids.push_back( streamed.back().first );
+      }
+      col->add_vectors( streamed );
+      idx.on_vectors_added( streamed_ids );
+      idx.wait_for_rebuild();
+    }
+
+    const auto base = idx.get_stats();
+    const auto* _stats = dynamic_cast< const vector_db::indices::ivf_flat::stats* >( base.get() );
+    ASSERT_NE( _stats, nullptr );
+    const size_t listed = col->get_all_vector_ids().size() * ( spill ? 2 : 1 );
+    EXPECT_EQ( _stats->vector_count_, listed );
+    EXPECT_GT( _stats->lists_merged_, 0u );
+    EXPECT_GT( _stats->lists_split_, 0u );
+    EXPECT_LE( _stats->largest_list_, 2.5 * listed / _stats->list_count_ );
+
+    // the lists still hold every vector once (per copy): probing all of them is exact
+    vectors.clear();
+    for ( const auto id : col->get_all_vector_ids() )
+      vectors.emplace_back( id, std::move( *col->get_vector_by_id( id ) ) );
+    const auto dist_fn = vector_db::distance::get_distance_instance( vector_db::distance::dist_type::euclidean );
+    vector_db::search_params_t everything;
+    everything.n_probe_ = 1000;
+    for ( int q = 0; q < 10; ++q )
+    {
+      const auto& query = vectors[ q * 97 % vectors.size() ].second;
+      std::vector< double > expected;
+      for ( const auto& [ id, vec ] : vectors )
+        expected.push_back( dist_fn->compute( query, vec ) );
+      std::partial_sort( expected.begin(), expected.begin() + 20, expected.end() );
+      std::vector< vector_db::score_pair > results;
+      ASSERT_TRUE( idx.search_for_top_k( query, 20, results, everything ) );
+      ASSERT_EQ( results.size(), 20 );
+      for ( size_t i = 0; i < results.size(); ++i )
+        EXPECT_NEAR( results[ i ].first, expected[ i ], 1e-5 );
+    }
+  }
+}
@@ -0,0 +1,282 @@
+#include <algorithm>
+#include <gtest/gtest.h>
+#include <random>
+#include <set>
+#include <sstream>
+#include <vector>
+
+#include "core/collection.h"
+#include "core/indices/ivfpq.h"
+
+using namespace vector_db;
+
+namespace
+{
+constexpr int dimension = 16;
+
+// gaussian blobs around random centres
+std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > blobs( const size_t count, const unsigned int seed )
+{
+  std::mt19937 rng( seed );
+  std::uniform_real_distribution< float > centre( -10.0f, 10.0f );
+  std::normal_distribution< float > noise( 0.0f, 1.0f );
+  std::vector< std::vector< float > > centres( 20, std::vector< float >( dimension ) );
+  for ( auto& c : centres )
+    for ( auto& x : c )
+      x = centre( rng );
+
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > vectors;
+  for ( size_t i = 0; i < count; ++i )
+  {
+    float d[ dimension ];
+    const auto& c = centres[ i % centres.size() ];
+    for ( int j = 0; j < dimension; ++j )
+      d[ j ] = c[ j ] + noise( rng );
+    vectors.emplace_back( i, vector_db::float_vector( dimension, d ) );
+  }
+  return vectors;
+}
+
+std::vector< vector_db::id_t > exact_top_k( const std::vector< std::pair< vector_db::id_t, vector_db::float_vector > >& vectors,
+                                            const vector_db::float_vector& query,
+                                            const size_t k )
+{
+  const auto dist_fn = vector_db::distance::get_distance_instance( vector_db::distance::dist_type::euclidean );
+  std::vector< std::pair< double, vector_db::id_t > > all;
+  for ( const auto& [ id, vec ] : vectors )
+    all.emplace_back( dist_fn->compute( query, vec ), id );
+  std::partial_sort( all.begin(), all.begin() + k, all.end() );
+  std::vector< vector_db::id_t > ids;
+  for ( size_t i = 0; i < k; ++i )
+    ids.push_back( all[ i ].second );
+  return ids;
+}
+
+// mean fraction of the exact top-10 found by the index, over queries close to the data
+double recall_at_10( vector_db::indices::ivf_pq::index& idx,
+                     const std::vector< std::pair< vector_db::id_t, vector_db::float_vector > >& vectors,
+                     const vector_db::search_params_t& search_params = {} )
+{
+  double found = 0.0;
+  const int queries = 50;
+  for ( int q = 0; q < queries; ++q )
+  {
+    const auto& query = vectors[ q * 37 % vectors.size() ].second;
+    const auto expected = exact_top_k( vectors, query, 10 );
+    std::vector< vector_db::score_pair > results;
+    EXPECT_TRUE( idx.search_for_top_k( query, 10, results, search_params ) );
+    for ( const auto& [ _, id_vec ] : results )
+      found += std::count( expected.begin(), expected.end(), id_vec.first );
+  }
+  return found / ( queries * 10 );
+}
+}  // namespace
+
+TEST( IVFPQTest, RerankRecoversRecall )
+{
+  const auto vectors = blobs( 4000, 1 );
+  auto col = std::make_shared< vector_db::collection >( dimension, "test_collection_pq" );
+  col->add_vectors( vectors );
+
+  vector_db::indices::ivf_pq::params params( vector_db::distance::dist_type::euclidean, 20, 4, 8, 8 );
+  vector_db::indices::ivf_pq::index idx( col, params );
+  idx.init();
+
+  const double approximate = recall_at_10( idx, vectors );
+  vector_db::search_params_t rerank;
+  rerank.rerank_factor_ = 10.0f;
+  const double reranked = recall_at_10( idx, vectors, rerank );
+  EXPECT_GT( approximate, 0.4 );
+  EXPECT_GT( reranked, 0.9 );
+  EXPECT_GE( reranked, approximate );
+}
+
+TEST( IVFPQTest, FastScanRanksLikeTheTableScan )
+{
+  const auto vectors = blobs( 4000, 2 );
+  auto col = std::make_shared< vector_db::collection >( dimension, "test_collection_pq_fast_scan" );
+  col->add_vectors( vectors );
+
+  // same data and seeds: both indices train the same quantizers, only the scan differs
+  vector_db::indices::ivf_pq::params params( vector_db::distance::dist_type::euclidean, 20, 4, 8, 4 );
+  vector_db::indices::ivf_pq::index table_scan( col, params );
+  table_scan.init();
+  params.fast_scan_ = true;
+  vector_db::indices::ivf_pq::index fast_scan( col, params );
+  fast_scan.init();
+
+  // blocks are filled by appends and emptied by swap-removes
+  std::vector< vector_db::id_t > removed;
+  for ( vector_db::id_t id = 0; id < 4000; id += 7 )
+    removed.push_back( id );
+  col->remove_vectors( removed );
+  table_scan.on_vectors_removed( removed );
+  fast_scan.on_vectors_removed( removed );
+
+  for ( int q = 0; q < 20; ++q )
+  {
+    const auto& query = vectors[ q * 101 + 1 ].second;
+    std::vector< vector_db::score_pair > expected, results;
+    ASSERT_TRUE( table_scan.search_for_top_k( query, 20, expected ) );
+    ASSERT_TRUE( fast_scan.search_for_top_k( query, 20, results ) );
+    ASSERT_EQ( results.size(), expected.size() );
+
+    // the 8-bit tables only blur the estimates
+    std::set< vector_db::id_t > table_ids, fast_ids;
+    for ( size_t i = 0; i < results.size(); ++i )
+    {
+      EXPECT_NEAR( results[ i ].first, expected[ i ].first, 0.1 * expected[ i ].first + 0.5 );
+      EXPECT_NE( results[ i ].second.first % 7, 0 );
+      table_ids.insert( expected[ i ].second.first );
+      fast_ids.insert( results[ i ].second.first );
+    }
+    std::vector< vector_db::id_t > common;
+    std::set_intersection( table_ids.begin(), table_ids.end(), fast_ids.begin(), fast_ids.end(), std::back_inserter( common ) );
+    EXPECT_GE( common.size(), 14 );
+  }
+}
+
+TEST( IVFPQTest, FineCodesApproximateEveryMetric )
+{
+  // one dimension per sub-quantizer and 256 entries each: the codes are nearly exact
+  const auto vectors = blobs( 2000, 3 );
+  auto col = std::make_shared< vector_db::collection >( dimension, "test_collection_pq_metrics" );
+  col->add_vectors( vectors );
+
+  for ( const auto metric : { vector_db::distance::dist_type::euclidean,
+                              vector_db::distance::dist_type::cosine,
+                              vector_db::distance::dist_type::inner_product } )
+  {
+    vector_db::indices::ivf_pq::params params( metric, 8, 8, dimension, 8 );
+    vector_db::indices::ivf_pq::index idx( col, params );
+    idx.init();
+
+    const auto dist_fn = vector_db::distance::get_distance_instance( metric );
+    const auto& query = vectors[ 5 ].second;
+    std::vector< vector_db::score_pair > results;
+    ASSERT_TRUE( idx.search_for_top_k( query, 10, results ) );
+    ASSERT_EQ( results.size(), 10 );
+    for ( const auto& [ dist, id_vec ] : results )
+    {
+      const double exact = dist_fn->compute( query, *id_vec.second );
+      EXPECT_NEAR( dist, exact, 0.02 * std::abs( exact ) + 0.1 );
+    }
+  }
+}
+
+TEST( IVFPQTest, ListsAreRestoredAndKeptDuplicateFree )
+{
+  const auto vectors = blobs( 1000, 4 );
+  auto col = std::make_shared< vector_db::collection >( dimension, "test_collection_pq_restore" );
+  col->add_vectors( vectors );
+
+  vector_db::indices::ivf_pq::params params( vector_db::distance::dist_type::euclidean, 10, 10, 4, 4 );
+  params.fast_scan_ = true;
+  params.rerank_factor_ = 2.0f;
+  vector_db::indices::ivf_pq::index idx( col, params );
+  idx.init();
+
+  std::stringstream ss;
+  const auto type = idx.get_index_type();
+  ss.write( reinterpret_cast< const char* >( &type ), sizeof( type ) );
+  idx.serialize( ss );
+  auto restored = vector_db::index_t::deserialize( ss, col );
+  ASSERT_TRUE( restored );
+  ASSERT_EQ( restored->get_index_type(), vector_db::index_type::ivf_pq );
+  const auto* restored_params = dynamic_cast< const vector_db::indices::ivf_pq::params* >( restored->get_params() );
+  ASSERT_TRUE( restored_params );
+  EXPECT_TRUE( restored_params->fast_scan_ );
+  EXPECT_EQ( restored_params->m_, 4 );
+
+  // one vector joined and one left while the index was on disk
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > joined;
+  joined.emplace_back( 5000, vectors[ 3 ].second );
+  col->add_vectors( joined );
+  col->remove_vectors( { 7 } );
+  restored->init();
+
+  // updating an id moves it instead of listing it twice
+  std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > update;
+  update.emplace_back( 3, vectors[ 500 ].second );
+  col->add_vectors( update );
+  restored->on_vectors_added( { 3 } );
+
+  std::vector< vector_db::score_pair > loaded;
+  ASSERT_TRUE( restored->search_for_top_k( vectors[ 3 ].second, 2000, loaded ) );
+  EXPECT_EQ( loaded.size(), 1000 );
+  std::set< vector_db::id_t > seen;
+  for ( const auto& [ _, id_vec ] : loaded )
+    EXPECT_TRUE( seen.insert( id_vec.first ).second );
+  EXPECT_TRUE( seen.count( 5000 ) );
+  EXPECT_FALSE( seen.count( 7 ) );
+  EXPECT_EQ( loaded.front().second.first, 5000 );
+}
+
+TEST( IVFPQTest, TrainingWaitsForEnoughVectors )
+{
+  const auto vectors = blobs( 3000, 5 );
+  auto col = std::make_shared< vector_db::collection >( dimension, "test_collection_pq_fill" );
+  vector_db::indices::ivf_pq::params params( vector_db::distance::dist_type::euclidean, 20, 4, 8, 8 );
+  vector_db::indices::ivf_pq::index idx( col, params );
+  idx.init();
+
+  // filled one vector at a time, as an empty collection is
+  const auto insert = [ & ]( const size_t begin, const size_t end )
+  {
+    for ( size_t i = begin; i < end; ++i )
+    {
+      col->add_vectors( { vectors[ i ] } );
+      idx.on_vectors_added( { vectors[ i ].first } );
+    }
+  };
+
+  // below k * 39 vectors nothing is trained: searches are exact scans
+  insert( 0, 300 );
+  const std::vector< std::pair< vector_db::id_t, vector_db::float_vector > > first( vectors.begin(), vectors.begin() + 300 );
+  vector_db::query_stats untrained;
+  vector_db::search_params_t exhaustive;
+  exhaustive.stats_ = &untrained;
+  EXPECT_DOUBLE_EQ( recall_at_10( idx, first, exhaustive ), 1.0 );
+  EXPECT_EQ( untrained.lists_probed_, 0 );
+
+  // trained in the background once there are enough, then retrained as the lists double
+  insert( 300, vectors.size() );
+  idx.wait_for_rebuild();
+  vector_db::query_stats trained;
+  vector_db::search_params_t rerank;
+  rerank.rerank_factor_ = 10.0f;
+  rerank.stats_ = &trained;
+  EXPECT_GT( recall_at_10( idx, vectors, rerank ), 0.9 );
+  EXPECT_GT( trained.lists_probed_, 0 );
+}
+
+// removals reach an untrained index with the collection still locked
+TEST( IVFPQTest, VectorsAreRemovedBeforeTraining )
+{
+  auto col = std::make_shared< vector_db::collection >( dimension, "test_collection_pq_untrained" );
+  vector_db::indices::ivf_pq::params params( vector_db::distance::dist_type::euclidean, 20, 4, 8, 8 );
+  ASSERT_TRUE( col->add_index( "pq", vector_db::index_type::ivf_pq, &params ) );
+  auto vectors = blobs( 10, 6 );
+  const auto query = vectors[ 3 ].second;
+  col->add_vectors( std::move( vectors ) );
+
+  EXPECT_EQ( col->remove_vectors( { 3 } ), 1 );
+  std::vector< vector_db::score_pair > results;
+  ASSERT_TRUE( col->search_for_top_k( query, 10, results, "pq" ) );
+  EXPECT_EQ( results.size(), 9 );
+  for ( const auto& [ _, id_vec ] : results )
+    EXPECT_NE( id_vec.first, 3 );
+}
+
+TEST( IVFPQTest, UnsupportedParamsAreRejected )
+{
+  auto col = std::make_shared< vector_db::collection >( dimension, "test_collection_pq_params" );
+  vector_db::indices::ivf_pq::params params( vector_db::distance::dist_type::euclidean, 10, 2, 4, 8 );
+  params.fast_scan_ = true;
+  EXPECT_FALSE( col->add_index( "pq", vector_db::index_type::ivf_pq, &params ) );
+  params.nbits_ = 9;
+  params.fast_scan_ = false;
+  EXPECT_FALSE( col->add_index( "pq", vector_db::index_type::ivf_pq, &params ) );
+  params.nbits_ = 4;
+  EXPECT_TRUE( col->add_index( "pq", vector_db::index_type::ivf_pq, &params ) );
+}
@@ -127,4 +127,72 @@ TEST_F( PersistenceTest, IVFFlatPersistence )
   }
 }
 
+// A collection file as written before index payloads were versioned: the indices saved their params
+// alone (HNSW: metric, M, ef_construction, ef_search; IVF-Flat: metric, k, n_probe, rebuild_threshold)
+TEST_F( PersistenceTest, LoadsUnversionedIndices )
+{
+  {
+    std::ofstream ofs( "test_data/legacy_col.db", std::ios::binary );
+    const auto put = [ &ofs ]( const auto value ) { ofs.write( reinterpret_cast< const char* >( &value ), sizeof( value ) ); };
+    const auto put_name = [ & ]( const std::string& name )
+    {
+      put( static_cast< uint32_t >( name.size() ) );
+      ofs.write( name.data(), name.size() );
+    };
+
+    put_name( "legacy_col" );
+    put( 3u );
+    put( uint32_t{ 20 } );
+    for ( uint64_t id = 0; id < 20; ++id )
+    {
+      put( id );
+      put( 3 );
+      for ( const float x : { static_cast< float >( id ), static_cast< float >( id % 4 ), 1.0f } )
+        put( x );
+      put( false );
+    }
+
+    put( uint32_t{ 2 } );
+    put_name( "hnsw_idx" );
+    put( index_type::hnsw );
+    put( distance::dist_type::euclidean );
+    put( 8u );
+    put( 40u );
+    put( 20u );
+    put_name( "ivf_idx" );
+    put( index_type::ivf_flat );
+    put( distance::dist_type::euclidean );
+    put( 2u );
+    put( 2u );
+    put( size_t{ 500 } );
+  }
+
+  database db;
+  ASSERT_EQ( db.load(), status::success );
+
+  auto hnsw_res = db.get_index_params( "legacy_col", "hnsw_idx" );
+  ASSERT_EQ( hnsw_res.status_, status::success );
+  const auto* hnsw_params = static_cast< const indices::hnsw::params* >( hnsw_res.payload_->second );
+  EXPECT_EQ( hnsw_params->M_, 8 );
+  EXPECT_EQ( hnsw_params->ef_search_, 20 );
+  EXPECT_EQ( hnsw_params->quantizer_, quantizer_type::none );  // absent from version 0: defaulted
+
+  auto ivf_res = db.get_index_params( "legacy_col", "ivf_idx" );
+  ASSERT_EQ( ivf_res.status_, status::success );
+  const auto* ivf_params = static_cast< const indices::ivf_flat::params* >( ivf_res.payload_->second );
+  EXPECT_EQ( ivf_params->k_, 2 );
+  EXPECT_EQ( ivf_params->rebuild_threshold_, 500 );
+  EXPECT_FALSE( ivf_params->spill_ );
+
+  // both indices were built from the collection on load
+  float_vector query( 3, std::vector< float >{ 7.0f, 3.0f, 1.0f }.data() );
+  for ( const auto* name : { "hnsw_idx", "ivf_idx" } )
+  {
+    auto search_res = db.get_nearest_k( "legacy_col", query, 1, name );
+    ASSERT_EQ( search_res.status_, status::success ) << name;
+    ASSERT_EQ( search_res.payload_->size(), 1 ) << name;
+    EXPECT_EQ( search_res.payload_->at( 0 ).second.first, 7 ) << name;
+  }
+}
+
 }  // namespace vector_db::test
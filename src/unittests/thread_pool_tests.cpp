@@ -0,0 +1,109 @@
+#include <atomic>
+#include <functional>
+#include <gtest/gtest.h>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "core/utils/thread_pool.h"
+#include "core/utils/util.h"
+
+namespace vector_db::test
+{
+
+TEST( ThreadPoolTest, RunsEveryItemOnce )
+{
+  utils::thread_pool pool( 3 );
+  std::vector< std::atomic< int > > hits( 1000 );
+  std::atomic< size_t > next{ 0 };
+  const std::function< void() > work = [ & ]
+  {
+    for ( size_t i = next++; i < hits.size(); i = next++ )
+      ++hits[ i ];
+  };
+  pool.run( 3, work );
+  for ( const auto& hit : hits )
+    EXPECT_EQ( hit.load(), 1 );
+}
+
+// the helpers are the same threads from one run to the next, so their thread_local scratch survives
+TEST( ThreadPoolTest, HelpersPersistAcrossRuns )
+{
+  utils::thread_pool pool( 2 );
+  std::mutex mutex;
+  std::set< std::thread::id > seen;
+  const auto caller = std::this_thread::get_id();
+  for ( int run = 0; run < 20; ++run )
+  {
+    std::atomic< int > next{ 0 };
+    const std::function< void() > work = [ & ]
+    {
+      while ( next++ < 50 )
+      {
+        std::this_thread::sleep_for( std::chrono::microseconds( 50 ) );
+        std::lock_guard lock( mutex );
+        if ( std::this_thread::get_id() != caller )
+          seen.insert( std::this_thread::get_id() );
+      }
+    };
+    pool.run( 2, work );
+  }
+  EXPECT_LE( seen.size(), 2u );
+}
+
+// a caller whose helpers are all busy elsewhere does its items itself and returns
+TEST( ThreadPoolTest, BusyPoolDoesNotHoldTheCallerUp )
+{
+  utils::thread_pool pool( 1 );
+  std::atomic< bool > release{ false };
+  std::atomic< bool > blocking{ false };
+  const std::function< void() > block = [ & ]
+  {
+    blocking = true;
+    while ( !release )
+      std::this_thread::yield();
+  };
+  std::thread other( [ & ] { pool.run( 1, block ); } );
+  while ( !blocking )
+    std::this_thread::yield();
+
+  std::atomic< size_t > next{ 0 };
+  size_t done = 0;
+  const std::function< void() > work = [ & ]
+  {
+    for ( size_t i = next++; i < 100; i = next++ )
+      ++done;
+  };
+  pool.run( 1, work );
+  EXPECT_EQ( done, 100u );
+
+  release = true;
+  other.join();
+}
+
+// parallel_for fans out to the shared pool, also from work the pool is already running
+TEST( ThreadPoolTest, ParallelForCoversTheRangeOnce )
+{
+  std::vector< std::atomic< int > > hits( 1001 );
+  const auto count_hits = [ & ]( const std::size_t begin, const std::size_t end )
+  {
+    for ( std::size_t i = begin; i < end; ++i )
+      ++hits[ i ];
+  };
+  utils::parallel_for( hits.size(), 4, count_hits );
+  utils::parallel_for( hits.size(), 0, count_hits );
+
+  std::atomic< int > next{ 0 };
+  const std::function< void() > nested = [ & ]
+  {
+    while ( next++ < 2 )
+      utils::parallel_for( hits.size(), 3, count_hits );
+  };
+  utils::thread_pool::shared().run( 1, nested );
+
+  for ( const auto& hit : hits )
+    EXPECT_EQ( hit.load(), 4 );
+}
+
+}  // namespace vector_db::test